@@ -10,6 +10,15 @@ Application::Application(Options& options) {
   runtime_assert(_device != nullptr);
 
   _options = options;
+  _engine = RandomEngine(_options.seed, _options.sampler);
+
+  if (!_options.resume.empty()) {
+    load_checkpoint(_options.resume, _checkpoint);
+    _options.width = _checkpoint.width;
+    _options.height = _checkpoint.height;
+    _resuming = true;
+  }
+
   _ui = make_shared<UserInterface>(_options.input0, _scale);
 
   _modificationTime = 0;
@@ -35,6 +44,10 @@ Application::~Application() { rtcDeleteDevice(_device); }
 void Application::render(size_t width, size_t height, glm::dvec4* data) {
   auto view = ImageView(data, width, height);
 
+  if (_resuming) {
+    _resume(view);
+  }
+
   double epsilon = _technique->render(view, _engine, _options.cameraId);
 
   if (_options.technique != Options::Viewer) {
@@ -150,7 +163,20 @@ bool Application::updateScene() {
     if (_modificationTime < modificationTime) {
       if (_options.technique != Options::Viewer) {
         _scene = loadScene(_options);
-        _scene->buildAccelStructs(_device);
+        _scene->buildAccelStructs(_device, shared_threadpool());
+
+        if (!_options.quiet) {
+          std::cout << "Import time: " << _scene->import_time << "s\n"
+                    << "Convert time: " << _scene->convert_time << "s\n"
+                    << "BVH time: " << _scene->build_time << "s" << std::endl;
+
+          for (auto&& mesh : _scene->meshes) {
+            if (mesh.welded_bytes != 0) {
+              std::cout << "Welded \"" << mesh.name << "\": "
+                        << mesh.welded_bytes << " bytes saved" << std::endl;
+            }
+          }
+        }
       }
 
       _technique = makeTechnique(_scene, _options);
@@ -235,16 +261,119 @@ void Application::_save(const ImageView& view, size_t numSamples,
     path = stream.str();
   }
 
-  saveEXR(path, _technique->metadata(), vv4d_to_vv3f(view.width() * view.height(), view.data()));
+  size_t size = view.width() * view.height();
+  vv4d_to_vv3f(_save_buffer, size, view.data());
+  _samples_buffer.resize(size);
+
+  for (size_t i = 0; i < size; ++i) {
+    _samples_buffer[i] = float(view.data()[i].a);
+  }
+
+  _technique->features(view, _feature_buffer);
+  const feature_t* features =
+      _feature_buffer.empty() ? nullptr : _feature_buffer.data();
+
+  saveEXR(path, _technique->metadata(), _save_buffer.data(),
+          _samples_buffer.data(), features);
+
+  if (_options.denoise && features != nullptr) {
+    _denoise_buffer.resize(size);
+    denoise(shared_threadpool(), view.width(), view.height(),
+            _save_buffer.data(), features, _denoise_buffer.data());
+
+    auto split = splitext(path);
+    string denoised_path = split.first + ".denoised" + split.second;
+    saveEXR(denoised_path, _technique->metadata(), _denoise_buffer.data(),
+            _samples_buffer.data(), features);
+    std::cout << "Denoised output saved to `" << denoised_path << "`."
+              << std::endl;
+  }
 
   if (snapshot) {
     std::cout << "Snapshot saved to `" << path << "`." << std::endl;
+    _saveCheckpoint(view);
   } else {
     std::cout << "Result saved to `" << path << "`." << std::endl;
     std::cout << _technique->metadata() << std::endl;
   }
 }
 
+void Application::_saveCheckpoint(const ImageView& view) {
+  string path;
+
+  if (_options.output.empty()) {
+    auto split = splitext(_options.input0);
+    std::stringstream stream;
+    stream << split.first << "." << view.width() << "." << view.height() << "."
+           << techniqueString(_options) << ".checkpoint";
+    path = stream.str();
+  } else {
+    path = splitext(_options.output).first + ".checkpoint";
+  }
+
+  size_t size = view.width() * view.height();
+
+  _checkpoint.width = uint32_t(view.width());
+  _checkpoint.height = uint32_t(view.height());
+  _checkpoint.image.assign(view.data(), view.data() + size);
+  _checkpoint.seed = _engine.seed();
+  _checkpoint.sequence = _engine.sequence();
+  _checkpoint.stream = _engine.stream();
+  _checkpoint.sample = _engine.sample_index();
+  _checkpoint.dimension = _engine.dimension();
+  _technique->save(_checkpoint);
+
+  if (save_checkpoint(path, _checkpoint)) {
+    std::cout << "Checkpoint saved to `" << path << "`." << std::endl;
+  } else {
+    std::cout << "Cannot save checkpoint to `" << path << "`." << std::endl;
+  }
+
+  _checkpoint.image.clear();
+  _checkpoint.image.shrink_to_fit();
+}
+
+void Application::_resume(ImageView& view) {
+  _resuming = false;
+
+  if (view.width() != _checkpoint.width ||
+      view.height() != _checkpoint.height) {
+    throw std::runtime_error("The resolution doesn't match the checkpoint.");
+  }
+
+  if (_checkpoint.metadata.technique != _technique->name()) {
+    throw std::runtime_error("The checkpoint was rendered with " +
+                             _checkpoint.metadata.technique + ", not with " +
+                             _technique->name() + ".");
+  }
+
+  // The random sequence continues from the checkpoint, the one of the
+  // command line is ignored.
+  if (_options.seed != _checkpoint.seed) {
+    std::cerr << "The seed " << _options.seed
+              << " is overridden by the seed of the checkpoint, "
+              << _checkpoint.seed << "." << std::endl;
+  }
+
+  if (_options.sampler != _checkpoint.sequence) {
+    std::cerr << "The sampler " << sequence_name(_options.sampler)
+              << " is overridden by the sampler of the checkpoint, "
+              << sequence_name(_checkpoint.sequence) << "." << std::endl;
+  }
+
+  std::copy(_checkpoint.image.begin(), _checkpoint.image.end(), view.data());
+  _technique->restore(_checkpoint);
+  _engine = RandomEngine(_checkpoint.seed, _checkpoint.sequence);
+  _engine.seek(_checkpoint.stream, _checkpoint.sample, _checkpoint.dimension);
+
+  if (!_options.quiet) {
+    std::cout << "Resumed from `" << _options.resume << "` at "
+              << _checkpoint.metadata.num_samples << " samples." << std::endl;
+  }
+
+  _checkpoint = checkpoint_t();
+}
+
 std::size_t Application::_num_samples() const { return _technique->metadata().num_samples; }
 
 }
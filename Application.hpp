@@ -4,6 +4,7 @@
 #include <Scene.hpp>
 #include <Technique.hpp>
 #include <UserInterface.hpp>
+#include <denoise.hpp>
 
 namespace haste {
 
@@ -26,6 +27,8 @@ class Application : public Framework {
   void _saveIfRequired(const ImageView& view, double elapsed);
   void _updateQuitCond(const ImageView& view, double elapsed);
   void _save(const ImageView& view, size_t numSamples, bool snapshot);
+  void _saveCheckpoint(const ImageView& view);
+  void _resume(ImageView& view);
 
   std::size_t _num_samples() const;
 
@@ -37,5 +40,11 @@ class Application : public Framework {
   shared<UserInterface> _ui;
   size_t _modificationTime;
   vector<dvec4> _reference;
+  vector<vec3> _save_buffer;
+  vector<float> _samples_buffer;
+  vector<feature_t> _feature_buffer;
+  vector<vec3> _denoise_buffer;
+  checkpoint_t _checkpoint;
+  bool _resuming = false;
 };
 }
@@ -1,6 +1,7 @@
 #include <streamops.hpp>
 #include <runtime_assert>
 #include <Scene.hpp>
+#include <unittest>
 
 namespace haste {
 
@@ -30,6 +31,8 @@ std::unique_ptr<BSDF> AreaLight::create_bsdf(const bounding_sphere_t& bounding_s
 void AreaLights::init(const Intersector* intersector, bounding_sphere_t sphere) {
     _intersector = intersector;
     _scene_bound = sphere;
+    _updateSampler();
+    _buildTree();
 }
 
 const size_t AreaLights::addLight(
@@ -58,8 +61,6 @@ const size_t AreaLights::addLight(
     _totalPower += light.power();
     _totalArea += light.area();
 
-    _updateSampler();
-
     return lightId;
 }
 
@@ -88,18 +89,89 @@ const float AreaLights::totalPower() const {
 LightSample AreaLights::sample(
     RandomEngine& engine) const
 {
+    LightSample result;
+
+    // None of the lights emits, nothing is sampled.
+    if (_light_sampler.size() == 0) {
+        engine.sample();
+        engine.sample();
+        engine.sample();
+        result._radiance = vec3(0.0f);
+        result._areaDensity = 0.0f;
+        return result;
+    }
+
     size_t light_id = _sampleLight(engine);
     const auto& light = this->light(light_id);
 
+    result.surface._position = _samplePosition(light_id, engine);
+    result.surface._tangent = light.tangent;
+    result.surface.gnormal = light.normal();
+    result.surface._materialId = light.materialId;
+
+    result._radiance = light.radiance();
+    result._areaDensity = _light_sampler.pmf(light_id) / light.area();
+
+    return result;
+}
+
+LightSample AreaLights::sample(
+    RandomEngine& engine,
+    const vec3& point,
+    const vec3& normal) const
+{
+    runtime_assert(!_nodes.empty());
+
+    float uniform = engine.sample();
+    float density = 1.0f;
+    int32_t index = 0;
+
+    while (_nodes[index].light < 0) {
+        const int32_t child = _nodes[index].child;
+        const float left = _importance(_nodes[child], point, normal);
+        const float right = _importance(_nodes[child + 1], point, normal);
+
+        if (left + right == 0.0f) {
+            density = 0.0f;
+            break;
+        }
+
+        // The uniform number is rescaled to the chosen interval, so one
+        // number is enough for the whole traversal.
+        const float probability = left / (left + right);
+
+        if (uniform < probability) {
+            uniform = min(uniform / probability, 1.0f - FLT_EPSILON * 0.5f);
+            density *= probability;
+            index = child;
+        }
+        else {
+            uniform = min((uniform - probability) / (1.0f - probability), 1.0f - FLT_EPSILON * 0.5f);
+            density *= 1.0f - probability;
+            index = child + 1;
+        }
+    }
+
     LightSample result;
 
+    if (density == 0.0f) {
+        engine.sample();
+        engine.sample();
+        result._radiance = vec3(0.0f);
+        result._areaDensity = 0.0f;
+        return result;
+    }
+
+    size_t light_id = _nodes[index].light;
+    const auto& light = this->light(light_id);
+
     result.surface._position = _samplePosition(light_id, engine);
     result.surface._tangent = light.tangent;
     result.surface.gnormal = light.normal();
     result.surface._materialId = light.materialId;
 
     result._radiance = light.radiance();
-    result._areaDensity = _weights[light_id] / light.area();
+    result._areaDensity = density / light.area();
 
     return result;
 }
@@ -124,7 +196,24 @@ LSDFQuery AreaLights::queryLSDF(
 
     LSDFQuery result;
     result.radiance = light.radiance() * (cosTheta > 0.0f ? 1.0f : 0.0f);
-    result.density = _weights[light_id] / light.area();
+    result.density = _light_sampler.pmf(light_id) / light.area();
+
+    return result;
+}
+
+LSDFQuery AreaLights::queryLSDF(
+    size_t light_id,
+    const vec3& omega,
+    const vec3& point,
+    const vec3& normal) const
+{
+    auto& light = this->light(light_id);
+
+    float cosTheta = dot(omega, light.normal());
+
+    LSDFQuery result;
+    result.radiance = light.radiance() * (cosTheta > 0.0f ? 1.0f : 0.0f);
+    result.density = _treeDensity(light_id, point, normal) / light.area();
 
     return result;
 }
@@ -172,27 +261,191 @@ void AreaLights::updateBuffers(int* indices, vec4* vertices) const {
 }
 
 void AreaLights::_updateSampler() {
-    const float totalPower = this->totalPower();
-    const float totalPowerInv = 1.0f / totalPower;
     const size_t num_lights = this->num_lights();
 
-    _weights.resize(num_lights);
+    vector<float> powers(num_lights);
 
     for (size_t i = 0; i < num_lights; ++i) {
-        const float power = light(i).power();
-        _weights[i] = power * totalPowerInv;
+        powers[i] = light(i).power();
     }
 
-    lightSampler = PiecewiseSampler(
-        _weights.data(),
-        _weights.data() + _weights.size());
+    _light_sampler = alias_table_t(powers.data(), powers.data() + powers.size());
 }
 
 const size_t AreaLights::_sampleLight(RandomEngine& engine) const {
-    runtime_assert(num_lights() != 0);
+    runtime_assert(_light_sampler.size() != 0);
+    return _light_sampler.sample(engine.sample());
+}
+
+void AreaLights::_buildTree() {
+    _nodes.clear();
+    _light_nodes.assign(num_lights(), -1);
 
-    auto sample = lightSampler.sample();
-    return min(size_t(sample * num_lights()), num_lights() - 1);
+    if (num_lights() == 0) {
+        return;
+    }
+
+    vector<int32_t> indices(num_lights());
+
+    for (size_t i = 0; i < indices.size(); ++i) {
+        indices[i] = int32_t(i);
+    }
+
+    // With one light per leaf the tree has 2n - 1 nodes, the storage isn't
+    // reallocated while building.
+    _nodes.reserve(2 * num_lights() - 1);
+    _nodes.emplace_back();
+    _buildNode(0, indices.data(), indices.data() + indices.size(), -1);
+}
+
+// Cone of the normals of both cones (Conty Estevez and Kulla, Importance
+// Sampling of Many Lights with Adaptive Tree Splitting).
+static void merge_cones(vec3& axis, float& theta_o, vec3 axis1, float theta_o1) {
+    if (theta_o < theta_o1) {
+        std::swap(axis, axis1);
+        std::swap(theta_o, theta_o1);
+    }
+
+    float theta_d = acos(clamp(dot(axis, axis1), -1.0f, 1.0f));
+
+    if (min(theta_d + theta_o1, pi<float>()) <= theta_o) {
+        return;
+    }
+
+    float theta = (theta_o + theta_d + theta_o1) * 0.5f;
+    vec3 ortho = axis1 - axis * dot(axis, axis1);
+
+    if (pi<float>() <= theta || length(ortho) < 1e-6f) {
+        theta_o = pi<float>();
+        return;
+    }
+
+    float theta_r = theta - theta_o;
+    axis = normalize(axis * cos(theta_r) + normalize(ortho) * sin(theta_r));
+    theta_o = theta;
+}
+
+void AreaLights::_buildNode(int32_t index, int32_t* begin, int32_t* end, int32_t parent) {
+    light_node_t node;
+    node.lower = vec3(FLT_MAX);
+    node.upper = vec3(-FLT_MAX);
+    node.axis = _lights[*begin].normal();
+    node.theta_o = 0.0f;
+    node.power = 0.0f;
+    node.parent = parent;
+    node.child = -1;
+    node.light = -1;
+
+    vec3 centroid_lower = vec3(FLT_MAX);
+    vec3 centroid_upper = vec3(-FLT_MAX);
+
+    for (int32_t* itr = begin; itr != end; ++itr) {
+        const AreaLight& light = _lights[*itr];
+        const vec3 extent
+            = abs(light.tangent[2]) * light.size.x * 0.5f
+            + abs(light.tangent[0]) * light.size.y * 0.5f;
+
+        node.lower = min(node.lower, light.position - extent);
+        node.upper = max(node.upper, light.position + extent);
+        node.power += light.power();
+        merge_cones(node.axis, node.theta_o, light.normal(), 0.0f);
+        centroid_lower = min(centroid_lower, light.position);
+        centroid_upper = max(centroid_upper, light.position);
+    }
+
+    if (end - begin == 1) {
+        node.light = *begin;
+        _light_nodes[*begin] = index;
+        _nodes[index] = node;
+        return;
+    }
+
+    // Median split along the longest extent of the centroids.
+    vec3 extent = centroid_upper - centroid_lower;
+    int axis = extent.x < extent.y
+        ? (extent.y < extent.z ? 2 : 1)
+        : (extent.x < extent.z ? 2 : 0);
+
+    int32_t* middle = begin + (end - begin) / 2;
+
+    std::nth_element(begin, middle, end, [&](int32_t a, int32_t b) {
+        return _lights[a].position[axis] < _lights[b].position[axis];
+    });
+
+    // The children are allocated next to each other.
+    node.child = int32_t(_nodes.size());
+    _nodes[index] = node;
+    _nodes.emplace_back();
+    _nodes.emplace_back();
+
+    _buildNode(node.child, begin, middle, index);
+    _buildNode(node.child + 1, middle, end, index);
+}
+
+float AreaLights::_importance(
+    const light_node_t& node,
+    const vec3& point,
+    const vec3& normal) const
+{
+    const vec3 center = (node.lower + node.upper) * 0.5f;
+    const float radius = length(node.upper - node.lower) * 0.5f;
+
+    vec3 omega = point - center;
+    float distance2 = dot(omega, omega);
+
+    // Points inside the bounds may be reached from any direction.
+    if (distance2 <= radius * radius) {
+        return node.power / max(radius * radius, FLT_MIN);
+    }
+
+    float distance = sqrt(distance2);
+    omega /= distance;
+
+    float theta_u = asin(radius / distance);
+    float theta = acos(clamp(dot(node.axis, omega), -1.0f, 1.0f));
+    float theta_p = max(theta - node.theta_o - theta_u, 0.0f);
+
+    if (half_pi<float>() <= theta_p) {
+        return 0.0f;
+    }
+
+    float importance = node.power * cos(theta_p) / distance2;
+
+    // Both sides of the surface, the transmissive materials are lit from
+    // behind.
+    if (normal != vec3(0.0f)) {
+        float theta_i = acos(clamp(abs(dot(normal, omega)), 0.0f, 1.0f));
+        importance *= cos(max(theta_i - theta_u, 0.0f));
+    }
+
+    return importance;
+}
+
+float AreaLights::_treeDensity(
+    size_t light_id,
+    const vec3& point,
+    const vec3& normal) const
+{
+    runtime_assert(!_nodes.empty());
+
+    float density = 1.0f;
+    int32_t index = _light_nodes[light_id];
+
+    while (_nodes[index].parent >= 0) {
+        const int32_t child = _nodes[_nodes[index].parent].child;
+        const float left = _importance(_nodes[child], point, normal);
+        const float right = _importance(_nodes[child + 1], point, normal);
+        const float current = index == child ? left : right;
+
+        if (current == 0.0f) {
+            return 0.0f;
+        }
+
+        density *= current / (left + right);
+        index = _nodes[index].parent;
+    }
+
+    return density;
 }
 
 const vec3 AreaLights::_samplePosition(size_t lightId, RandomEngine& engine) const {
@@ -205,4 +458,62 @@ const vec3 AreaLights::_samplePosition(size_t lightId, RandomEngine& engine) con
     return _lights[lightId].position + uniform.x * left + uniform.y * up;
 }
 
+unittest() {
+    // Lights on the ceiling facing down and a few facing up. The sampled
+    // frequencies at a point on the floor follow the densities of the tree,
+    // and the lights that face away are never sampled.
+    AreaLights lights;
+
+    for (int i = 0; i < 24; ++i) {
+        float x = float(i % 6) - 2.5f;
+        float z = float(i / 6) * 1.5f - 2.0f;
+        vec3 direction = i % 7 == 3 ? vec3(0.0f, 1.0f, 0.0f) : vec3(0.0f, -1.0f, 0.0f);
+
+        lights.addLight(
+            "light",
+            -1 - i,
+            vec3(x, 2.0f, z),
+            direction,
+            vec3(1.0f, 0.0f, 0.0f),
+            vec3(float(i % 3 + 1)),
+            vec2(0.5f, 0.25f));
+    }
+
+    lights.init(nullptr, bounding_sphere_t { vec3(0.0f), 10.0f });
+
+    const vec3 point = vec3(0.5f, 0.0f, 0.25f);
+    const vec3 normal = vec3(0.0f, 1.0f, 0.0f);
+
+    vector<float> densities(lights.num_lights());
+    float sum = 0.0f;
+
+    for (size_t i = 0; i < lights.num_lights(); ++i) {
+        densities[i] = lights._treeDensity(i, point, normal);
+        sum += densities[i];
+
+        if (i % 7 == 3) {
+            assert_true(densities[i] == 0.0f);
+        }
+    }
+
+    assert_true(abs(sum - 1.0f) < 1e-4f);
+
+    const size_t num_samples = 100000;
+    vector<size_t> counts(lights.num_lights(), 0);
+    RandomEngine engine(1);
+
+    for (size_t i = 0; i < num_samples; ++i) {
+        LightSample sample = lights.sample(engine, point, normal);
+        size_t light_id = size_t(-1 - sample.surface.materialId());
+        float density = densities[light_id] / lights.light(light_id).area();
+
+        assert_true(abs(sample.areaDensity() - density) < density * 1e-4f);
+        ++counts[light_id];
+    }
+
+    for (size_t i = 0; i < lights.num_lights(); ++i) {
+        assert_true(abs(float(counts[i]) / num_samples - densities[i]) < 0.01f);
+    }
+}
+
 }
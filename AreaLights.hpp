@@ -39,6 +39,21 @@ struct AreaLight {
     std::unique_ptr<BSDF> create_bsdf(const bounding_sphere_t&) const;
 };
 
+// Node of the light tree: the bounds of the quads below it, the cone of
+// their normals (the axis and the spread angle, the emission is limited
+// to the hemisphere around every normal) and their total power. An inner
+// node has the children `child` and `child + 1`, a leaf holds `light`.
+struct light_node_t {
+    vec3 lower;
+    vec3 upper;
+    vec3 axis;
+    float theta_o;
+    float power;
+    int32_t parent;
+    int32_t child;
+    int32_t light;
+};
+
 class AreaLights : public Geometry {
 public:
     void init(const Intersector* intersector, bounding_sphere_t sphere);
@@ -61,10 +76,19 @@ public:
 
     LightSample sample(RandomEngine& engine) const;
 
+    // Samples a light for the point by traversing the light tree, every
+    // node is chosen in proportion to an upper bound of its contribution to
+    // the point. The normal may be zero for points that aren't on a
+    // surface. The area density is zero if no light reaches the point.
+    LightSample sample(RandomEngine& engine, const vec3& point, const vec3& normal) const;
+
     vec3 queryRadiance(size_t lightId, const vec3& omega) const;
 
     LSDFQuery queryLSDF(size_t lightId, const vec3& omega) const;
 
+    // The density of the light as sampled by sample(engine, point, normal).
+    LSDFQuery queryLSDF(size_t lightId, const vec3& omega, const vec3& point, const vec3& normal) const;
+
     const mat3 light_to_world_mat3(size_t lightId) const;
 
     const bool castShadow() const override;
@@ -73,16 +97,22 @@ public:
     void updateBuffers(int* indices, vec4* vertices) const override;
 public:
     const Intersector* _intersector = nullptr;
-    mutable PiecewiseSampler lightSampler;
+    alias_table_t _light_sampler;
 
     vector<string> _names;
     vector<AreaLight> _lights;
-    vector<float> _weights;
     float _totalPower = 0.0f;
     float _totalArea = 0.0f;
     bounding_sphere_t _scene_bound;
 
+    vector<light_node_t> _nodes;
+    vector<int32_t> _light_nodes;
+
     void _updateSampler();
+    void _buildTree();
+    void _buildNode(int32_t index, int32_t* begin, int32_t* end, int32_t parent);
+    float _importance(const light_node_t& node, const vec3& point, const vec3& normal) const;
+    float _treeDensity(size_t lightId, const vec3& point, const vec3& normal) const;
     const size_t _sampleLight(RandomEngine& engine) const;
     const vec3 _samplePosition(size_t lightId, RandomEngine& engine) const;
 };
@@ -3,8 +3,8 @@
 
 namespace haste {
 
-template <class Beta> BPTBase<Beta>::BPTBase(const shared<const Scene>& scene, float lights, float roulette, float beta, size_t num_threads)
-    : Technique(scene, num_threads)
+template <class Beta> BPTBase<Beta>::BPTBase(const shared<const Scene>& scene, float lights, float roulette, float beta, threadpool_t& threadpool)
+    : Technique(scene, threadpool)
     , _roulette(roulette)
     , _lights(lights) {
     _metadata.roulette = roulette;
@@ -15,6 +15,10 @@ template <class Beta> string BPTBase<Beta>::name() const {
     return Beta::name();
 }
 
+template <class Beta> bool BPTBase<Beta>::_splats() const {
+    return true;
+}
+
 template <class Beta>
 vec3 BPTBase<Beta>::_traceEye(render_context_t& context, Ray ray) {
     light_path_t light_path;
@@ -24,7 +28,9 @@ vec3 BPTBase<Beta>::_traceEye(render_context_t& context, Ray ray) {
         return radiance;
     }
 
+    uint32_t dimension = context.generator->dimension();
     _traceLight(*context.generator, light_path);
+    context.generator->seek_dimension(dimension);
 
     EyeVertex eye[2];
     size_t itr = 0, prv = 1;
@@ -38,7 +44,7 @@ vec3 BPTBase<Beta>::_traceEye(render_context_t& context, Ray ray) {
 
     radiance += _connect_eye(context, eye[prv], light_path);
 
-    SurfacePoint surface = _scene->intersect(eye[prv].surface, ray.direction);
+    SurfacePoint surface = _intersect_primary(context, ray);
 
     while (surface.is_light()) {
         radiance += eye[prv].throughput * _lights * _scene->queryRadiance(surface, -ray.direction);
@@ -65,7 +71,10 @@ vec3 BPTBase<Beta>::_traceEye(render_context_t& context, Ray ray) {
 
     std::swap(itr, prv);
 
+    size_t vertex = 0;
+
     while (true) {
+        context.generator->seek_dimension(eye_dimension(++vertex));
         radiance += _connect(eye[prv], light_path);
 
         auto bsdf = _scene->sampleBSDF(*context.generator, eye[prv].surface, eye[prv].omega);
@@ -114,11 +123,13 @@ vec3 BPTBase<Beta>::_traceEye(render_context_t& context, Ray ray) {
 
         std::swap(itr, prv);
 
-        if (_russian_roulette(*context.generator)) {
+        float survival = _russian_roulette(context, eye[prv].throughput);
+
+        if (survival == 0.0f) {
             return radiance;
         }
 
-        eye[prv].throughput /= _roulette;
+        eye[prv].throughput /= survival;
     }
 
     return radiance;
@@ -127,6 +138,9 @@ vec3 BPTBase<Beta>::_traceEye(render_context_t& context, Ray ray) {
 template <class Beta>
 void BPTBase<Beta>::_traceLight(RandomEngine& generator, light_path_t& path) {
     size_t itr = path.size() + 1, prv = path.size();
+    size_t vertex = 0;
+
+    generator.seek_dimension(light_dimension(vertex));
 
     if (_russian_roulette(generator)) {
         return;
@@ -134,6 +148,11 @@ void BPTBase<Beta>::_traceLight(RandomEngine& generator, light_path_t& path) {
 
     LightSample light = _scene->sampleLight(generator);
 
+    // None of the lights emits.
+    if (light.areaDensity() == 0.0f) {
+        return;
+    }
+
     path.emplace_back();
     path[prv].surface = light.surface;
     path[prv].omega = path[prv].surface.normal();
@@ -142,7 +161,13 @@ void BPTBase<Beta>::_traceLight(RandomEngine& generator, light_path_t& path) {
     path[prv].a = 1.0f / Beta::beta(light.areaDensity());
     path[prv].A = 0.0f;
 
-    while (!_russian_roulette(generator)) {
+    while (true) {
+        generator.seek_dimension(light_dimension(++vertex));
+
+        if (_russian_roulette(generator)) {
+            break;
+        }
+
         auto bsdf = _scene->sampleBSDF(generator, path[prv].surface, path[prv].omega);
 
         auto surface = _scene->intersectMesh(path[prv].surface, bsdf.omega);
@@ -296,8 +321,18 @@ bool BPTBase<Beta>::_russian_roulette(random_generator_t& generator) const {
     return _roulette < generator.sample();
 }
 
-BPTb::BPTb(const shared<const Scene>& scene, float lights, float roulette, float beta, size_t num_threads)
-    : BPTBase<VariableBeta>(scene, lights, roulette, beta, num_threads)
+template <class Beta>
+float BPTBase<Beta>::_russian_roulette(render_context_t& context, vec3 throughput) const {
+    // The eye subpath doesn't branch, it is only killed, never split.
+    float probability = min(
+        _adaptive_roulette.expected(throughput, context.pixel_position, _roulette),
+        1.0f);
+
+    return context.generator->sample() < probability ? probability : 0.0f;
+}
+
+BPTb::BPTb(const shared<const Scene>& scene, float lights, float roulette, float beta, threadpool_t& threadpool)
+    : BPTBase<VariableBeta>(scene, lights, roulette, beta, threadpool)
 {
     VariableBeta::init(beta);
 }
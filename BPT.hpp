@@ -7,7 +7,7 @@ namespace haste {
 
 template <class Beta> class BPTBase : public Technique, protected Beta {
 public:
-    BPTBase(const shared<const Scene>& scene, float lights, float roulette, float beta, size_t num_threads);
+    BPTBase(const shared<const Scene>& scene, float lights, float roulette, float beta, threadpool_t& threadpool);
 
     string name() const override;
 
@@ -34,6 +34,7 @@ private:
     const float _lights;
 
     vec3 _traceEye(render_context_t& context, Ray ray) override;
+    bool _splats() const override;
     void _traceLight(random_generator_t& generator, light_path_t& path);
     vec3 _connect(const EyeVertex& eye, const LightVertex& light);
 
@@ -42,6 +43,10 @@ private:
     vec3 _connect_eye(render_context_t& context, const EyeVertex& eye, const light_path_t& path);
 
     bool _russian_roulette(random_generator_t& generator) const;
+
+    // Roulette of the eye subpaths, adaptive if enabled. The probability
+    // of survival, zero if the path is killed.
+    float _russian_roulette(render_context_t& context, vec3 throughput) const;
 };
 
 typedef BPTBase<FixedBeta<0>> BPT0;
@@ -50,7 +55,7 @@ typedef BPTBase<FixedBeta<2>> BPT2;
 
 class BPTb : public BPTBase<VariableBeta> {
 public:
-    BPTb(const shared<const Scene>& scene, float lights, float roulette, float beta, size_t num_threads);
+    BPTb(const shared<const Scene>& scene, float lights, float roulette, float beta, threadpool_t& threadpool);
 };
 
 }
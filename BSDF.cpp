@@ -15,6 +15,10 @@ BSDFBoundedSample BSDF::sample_bounded(random_generator_t& generator,
   return BSDFBoundedSample();
 }
 
+vec3 BSDF::albedo() const { return vec3(1.0f); }
+
+bool BSDF::delta() const { return false; }
+
 float BSDF::gathering_density(random_generator_t& generator,
                               const Intersector* intersector,
                               const SurfacePoint& surface,
@@ -157,6 +161,8 @@ BSDFBoundedSample DiffuseBSDF::sample_bounded(random_generator_t& generator,
   return result;
 }
 
+vec3 DiffuseBSDF::albedo() const { return _diffuse; }
+
 BSDFQuery DiffuseBSDF::_query(vec3 incident, vec3 outgoing) const {
   float same_side = incident.y * outgoing.y > 0.0f ? 1.0f : 0.0f;
 
@@ -180,6 +186,8 @@ PhongBSDF::PhongBSDF(vec3 diffuse, vec3 specular, float power)
   _diffuse_probability = diffuse_reflectivity / reflectivity_sum;
 }
 
+vec3 PhongBSDF::albedo() const { return min(_diffuse + _specular, vec3(1.0f)); }
+
 BSDFQuery PhongBSDF::query(const SurfacePoint& surface, vec3 incident,
                            vec3 outgoing) const {
   return _query(surface.toSurface(incident), surface.toSurface(outgoing));
@@ -282,6 +290,8 @@ BSDFQuery DeltaBSDF::query(const SurfacePoint& surface, vec3 incident,
   return query;
 }
 
+bool DeltaBSDF::delta() const { return true; }
+
 BSDFSample ReflectionBSDF::sample(random_generator_t& generator,
                                   const SurfacePoint& surface,
                                   vec3 omega) const {
@@ -47,6 +47,12 @@ class BSDF {
                                   const SurfacePoint& surface,
                                   bounding_sphere_t target, vec3 omega) const;
 
+  // Reflectance used as a feature by the denoiser, white if not overridden.
+  virtual vec3 albedo() const;
+
+  // True if the BSDF is a Dirac delta, it can't be queried nor guided.
+  virtual bool delta() const;
+
   BSDF(const BSDF&) = delete;
   BSDF& operator=(const BSDF&) = delete;
 };
@@ -87,6 +93,8 @@ class DiffuseBSDF : public BSDF {
                                    bounding_sphere_t target,
                                    vec3 omega) const override;
 
+  vec3 albedo() const override;
+
  private:
   BSDFQuery _query(vec3 incident, vec3 outgoing) const;
 
@@ -107,6 +115,8 @@ class PhongBSDF : public BSDF {
                                    bounding_sphere_t target,
                                    vec3 omega) const override;
 
+  vec3 albedo() const override;
+
  private:
   BSDFQuery _query(vec3 incident, vec3 outgoing) const;
 
@@ -120,6 +130,8 @@ class DeltaBSDF : public BSDF {
  public:
   BSDFQuery query(const SurfacePoint& surface, vec3 incident,
                   vec3 outgoing) const override;
+
+  bool delta() const override;
 };
 
 class ReflectionBSDF : public DeltaBSDF {
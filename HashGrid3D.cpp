@@ -0,0 +1,101 @@
+#include <random>
+#include <unittest>
+#include <HashGrid3D.hpp>
+
+namespace haste {
+
+namespace {
+
+struct grid_point_t {
+    vec3 point;
+    uint32_t id;
+
+    const vec3& position() const {
+        return point;
+    }
+};
+
+vector<grid_point_t> random_grid_points(std::mt19937& engine, size_t size) {
+    std::uniform_real_distribution<float> distribution(-2.0f, 2.0f);
+    vector<grid_point_t> result(size);
+
+    for (size_t i = 0; i < size; ++i) {
+        result[i].point = vec3(distribution(engine), distribution(engine), distribution(engine));
+        result[i].id = uint32_t(i);
+    }
+
+    return result;
+}
+
+// The ids the grid finds around the queries are the ones a linear search
+// finds.
+bool grid_matches(
+    const v3::HashGrid3D<grid_point_t>& grid,
+    const vector<grid_point_t>& points,
+    float radius,
+    std::mt19937& engine) {
+    std::uniform_real_distribution<float> distribution(-2.5f, 2.5f);
+
+    for (size_t i = 0; i < 64; ++i) {
+        vec3 query = vec3(distribution(engine), distribution(engine), distribution(engine));
+
+        vector<uint32_t> expected;
+
+        for (auto&& point : points) {
+            if (distance2(query, point.point) < radius * radius) {
+                expected.push_back(point.id);
+            }
+        }
+
+        vector<uint32_t> found;
+
+        grid.rQuery(
+            [&](const grid_point_t& point) { found.push_back(point.id); },
+            query,
+            radius);
+
+        std::sort(expected.begin(), expected.end());
+        std::sort(found.begin(), found.end());
+
+        if (found != expected) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+}
+
+unittest() {
+    // The cells live in the arena of the grid. The grids of UPG are swapped
+    // and rebuilt every pass, the queries have to survive both.
+    std::mt19937 engine(7);
+    const float radius = 0.3f;
+
+    vector<grid_point_t> first = random_grid_points(engine, 2000);
+    vector<grid_point_t> second = random_grid_points(engine, 500);
+
+    v3::HashGrid3D<grid_point_t> source(first, radius);
+    assert_true(grid_matches(source, first, radius, engine));
+
+    v3::HashGrid3D<grid_point_t> target(std::move(source));
+    assert_true(grid_matches(target, first, radius, engine));
+    assert_true(grid_matches(source, vector<grid_point_t>(), radius, engine));
+
+    target.rebuild(second, radius);
+    assert_true(grid_matches(target, second, radius, engine));
+
+    source.rebuild(first, radius);
+    assert_true(grid_matches(source, first, radius, engine));
+
+    source.swap(target);
+    assert_true(grid_matches(source, second, radius, engine));
+    assert_true(grid_matches(target, first, radius, engine));
+
+    source = std::move(target);
+    source.rebuild(second, radius);
+    assert_true(grid_matches(source, second, radius, engine));
+}
+
+}
@@ -7,6 +7,8 @@
 #include <vector>
 #include <algorithm>
 #include <cstdint>
+#include <arena.hpp>
+#include <Prerequisites.hpp>
 
 namespace std
 {
@@ -293,16 +295,53 @@ namespace v3 {
 
 template <class T> class HashGrid3D {
 public:
-    HashGrid3D() { }
+    HashGrid3D()
+        : _arena(new arena_t())
+        , _ranges(0, std::hash<vec3>(), std::equal_to<vec3>(), _arena.get()) { }
 
-    HashGrid3D(vector<T>&& that, float radius) {
+    HashGrid3D(vector<T>&& that, float radius) : HashGrid3D() {
         build(that, radius);
     }
 
-    HashGrid3D(const vector<T>& that, float radius) {
+    HashGrid3D(const vector<T>& that, float radius) : HashGrid3D() {
+        build(that, radius);
+    }
+
+    // Any random access sequence of T, e.g. the segments of generate, the
+    // grid keeps its own (sorted) copy of the data.
+    template <class Data> HashGrid3D(const Data& that, float radius) : HashGrid3D() {
         build(that, radius);
     }
 
+    // The cells live in the arena, so the two are only ever exchanged
+    // together, a memberwise move would free the arena under the cells.
+    HashGrid3D(HashGrid3D&& that) : HashGrid3D() {
+        swap(that);
+    }
+
+    HashGrid3D& operator=(HashGrid3D&& that) {
+        swap(that);
+        return *this;
+    }
+
+    HashGrid3D(const HashGrid3D&) = delete;
+    HashGrid3D& operator=(const HashGrid3D&) = delete;
+
+    void swap(HashGrid3D& that) {
+        std::swap(_data, that._data);
+        std::swap(_points, that._points);
+        std::swap(_radius, that._radius);
+        std::swap(_radius_inv, that._radius_inv);
+        std::swap(_arena, that._arena);
+        std::swap(_ranges, that._ranges);
+    }
+
+    // Builds the grid again in place, reusing the memory of the previous
+    // build, so a grid rebuilt every pass doesn't allocate once it's warm.
+    template <class Data> void rebuild(const Data& data, float radius) {
+        build(data, radius);
+    }
+
     template <class Callback> void rQuery(
         Callback callback,
         const vec3& query,
@@ -344,15 +383,24 @@ public:
 private:
     vector<T> _data;
     vector<vec3> _points;
-    float _radius;
-    float _radius_inv;
+    float _radius = 0.0f;
+    float _radius_inv = 0.0f;
 
     struct Range {
         uint32_t begin;
         uint32_t end;
     };
 
-    unordered_map<vec3, Range> _ranges;
+    using ranges_t = unordered_map<
+        vec3,
+        Range,
+        std::hash<vec3>,
+        std::equal_to<vec3>,
+        arena_allocator_t<std::pair<const vec3, Range>>>;
+
+    // The cells and the build temporaries.
+    std::unique_ptr<arena_t> _arena;
+    ranges_t _ranges;
 
     struct Point {
         vec3 cell;
@@ -360,7 +408,7 @@ private:
     };
 
     template <class L, class C, class R> void iterate_ranges(
-        const vector<Point>& points,
+        const arena_vector_t<Point>& points,
         const L& left, const C& center, const R& right) {
         uint32_t fst = 0, snd = 0, trd = 0, fth = 0;
 
@@ -421,20 +469,25 @@ private:
     }
 
 
-    void build(const vector<T>& data, float radius) {
+    template <class Data> void build(const Data& data, float radius) {
         struct Comparator {
             bool operator()(const vec3& a, const vec3& b) const {
                 return a.z != b.z ? a.z < b.z : (a.y != b.y ? a.y < b.y : a.x < b.x);
             }
         };
 
+        _ranges = ranges_t(0, std::hash<vec3>(), std::equal_to<vec3>(), _arena.get());
+        _arena->reset();
+
         if (data.empty()) {
+            _data.clear();
+            _points.clear();
             return;
         }
 
         const float radius_inv = 1.0f / radius;
 
-        vector<Point> points(data.size());
+        arena_vector_t<Point> points(data.size(), Point(), _arena.get());
 
         for (size_t i = 0; i < data.size(); ++i) {
             points[i].cell = floor(data[i].position() * radius_inv);
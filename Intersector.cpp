@@ -25,4 +25,21 @@ SurfacePoint Intersector::intersectMesh(const SurfacePoint& origin,
 	return Intersector::intersectMesh(origin, direction, INFINITY);
 }
 
+void Intersector::intersect_n(SurfacePoint* result, const vec3* origins,
+                              const vec3* directions, size_t num_rays) const {
+  for (size_t i = 0; i < num_rays; ++i) {
+    SurfacePoint origin;
+    origin._position = origins[i];
+    result[i] = intersect(origin, directions[i]);
+  }
+}
+
+void Intersector::occluded_n(float* result, const SurfacePoint* origins,
+                             const SurfacePoint* targets,
+                             size_t num_rays) const {
+  for (size_t i = 0; i < num_rays; ++i) {
+    result[i] = occluded(origins[i], targets[i]);
+  }
+}
+
 }
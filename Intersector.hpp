@@ -22,5 +22,11 @@ class Intersector {
                              float tfar) const;
 
   SurfacePoint intersectMesh(const SurfacePoint& origin, vec3 direction) const;
+
+  virtual void intersect_n(SurfacePoint* result, const vec3* origins,
+                           const vec3* directions, size_t num_rays) const;
+
+  virtual void occluded_n(float* result, const SurfacePoint* origins,
+                          const SurfacePoint* targets, size_t num_rays) const;
 };
 }
@@ -1,11 +1,14 @@
 #include <iostream>
 #include <map>
+#include <cstdlib>
 #include <cstring>
+#include <random>
 #include <Options.hpp>
 #include <loader.hpp>
 
 #include <BPT.hpp>
 #include <PT.hpp>
+#include <WPT.hpp>
 #include <UPG.hpp>
 #include <Viewer.hpp>
 
@@ -22,34 +25,47 @@ R"(
       master (-h | --help)
       master --version
       master avg <x>         Compute average value of pixels in <x>.
-      master errors <x> <y>  Compute abs and rms (in this order) error between <x> and <y>.
+      master errors <x> <y>  Compute abs and rms error between <x> and <y>, the render time of <x> and its mse * time (in this order).
       master sub <x> <y>     Compute difference between <x> and <y>.
 
     Options:
       -h --help              Show this screen.
       --version              Show version.
       --PT                   Use path tracing for rendering (this is default one).
+      --WPT                  Use wavefront (stream) path tracing.
       --BPT                  Use bidirectional path tracing (balance heuristics).
       --VCM                  Use vertex connection and merging.
       --UPG                  Use unbiased photon gathering.
       --num-photons=<n>      Use n photons. [default: 1 000 000]
       --max-radius=<n>       Use n as maximum gather radius. [default: 0.1]
       --roulette=<n>         Russian roulette coefficient. [default: 0.5]
+      --adaptive-roulette    Kill and split the eye paths by their expected contribution to the image.
       --beta=<n>             MIS beta. [default: 1]
       --alpha=<n>            VCM alpha. [default: 0.75]
+      --adaptive=<n>         Sample only the tiles with relative error above n (disabled by default).
+      --aovs                 Write the albedo, normal and depth of the first hits to the output.
+      --denoise              Also save a denoised output (<output>.denoised.exr), implies --aovs.
+      --guiding              Guide the path tracing with the incident radiance learned during the render.
+      --guiding-memory=<n>   Memory budget of the guiding in megabytes. [default: 64]
       --batch                Run in batch mode (interactive otherwise).
       --quiet                Do not output anything to console.
       --no-vc                Disable vertex connection.
       --no-vm                Disable vertex merging.
       --no-lights            Do not draw the lights.
       --no-reload            Disable auto-reload (input file is reloaded on modification in interactive mode).
+      --no-packets           Trace primary rays one by one instead of in ray streams.
+      --no-pipeline          Do not scatter the photons of the next pass during the current one.
       --num-samples=<n>      Terminate after n samples.
       --num-seconds=<n>      Terminate after n seconds.
       --num-minutes=<n>      Terminate after n minutes.
       --parallel             Use multi-threading.
+      --pin-threads          Bind the worker threads to cores, one NUMA node after another.
+      --sampler=<name>       Sample sequence, random, sobol (Owen-scrambled) or halton. [default: random]
+      --seed=<n>             Seed of the random number generator, renders with the same seed are identical. [default: random]
       --snapshot=<n>         Save output every n samples (adds number of samples to output file).
       --output=<path>        Output file. <input>.<width>.<height>.<samples>.<technique>.exr if not specified.
       --reference=<path>     Reference file for comparison.
+      --resume=<path>        Continue the render from a checkpoint (written with every snapshot).
       --camera=<id>          Use camera with given id. [default: 0]
       --resolution=<WxH>     Resolution of output image. [default: 512x512]
 
@@ -315,6 +331,7 @@ Options parseArgs(int argc, char const* const* argv) {
         size_t numTechniqes =
             dict.count("--BPT") +
             dict.count("--PT") +
+            dict.count("--WPT") +
             dict.count("--PM") +
             dict.count("--VCM") +
             dict.count("--UPG");
@@ -332,6 +349,10 @@ Options parseArgs(int argc, char const* const* argv) {
             options.technique = Options::PT;
             dict.erase("--PT");
         }
+        else if (dict.count("--WPT")) {
+            options.technique = Options::WPT;
+            dict.erase("--WPT");
+        }
         else if (dict.count("--VCM")) {
             options.technique = Options::VCM;
             dict.erase("--VCM");
@@ -381,7 +402,8 @@ Options parseArgs(int argc, char const* const* argv) {
         }
 
         if (dict.count("--max-path")) {
-            if (options.technique != Options::PT) {
+            if (options.technique != Options::PT &&
+                options.technique != Options::WPT) {
                 options.displayHelp = true;
                 options.displayMessage = "--max-path in not available for specified technique.";
                 return options;
@@ -400,6 +422,7 @@ Options parseArgs(int argc, char const* const* argv) {
         if (dict.count("--beta")) {
             if (options.technique != Options::BPT &&
                 options.technique != Options::PT &&
+                options.technique != Options::WPT &&
                 options.technique != Options::VCM &&
                 options.technique != Options::UPG) {
                 options.displayHelp = true;
@@ -434,9 +457,37 @@ Options parseArgs(int argc, char const* const* argv) {
             }
         }
 
+        if (dict.count("--adaptive-roulette")) {
+            if (options.technique != Options::BPT &&
+                options.technique != Options::PT &&
+                options.technique != Options::VCM &&
+                options.technique != Options::UPG) {
+                options.displayHelp = true;
+                options.displayMessage = "--adaptive-roulette in not available for specified technique.";
+                return options;
+            }
+            else {
+                options.adaptiveRoulette = true;
+                dict.erase("--adaptive-roulette");
+            }
+        }
+
+        if (dict.count("--adaptive")) {
+            if (!isReal(dict["--adaptive"])) {
+                options.displayHelp = true;
+                options.displayMessage = "Invalid value for --adaptive.";
+                return options;
+            }
+            else {
+                options.adaptive = atof(dict["--adaptive"].c_str());
+                dict.erase("--adaptive");
+            }
+        }
+
         if (dict.count("--roulette")) {
             if (options.technique != Options::BPT &&
                 options.technique != Options::PT &&
+                options.technique != Options::WPT &&
                 options.technique != Options::VCM &&
                 options.technique != Options::UPG) {
                 options.displayHelp = true;
@@ -505,6 +556,16 @@ Options parseArgs(int argc, char const* const* argv) {
             dict.erase("--no-reload");
         }
 
+        if (dict.count("--no-packets")) {
+            options.packets = false;
+            dict.erase("--no-packets");
+        }
+
+        if (dict.count("--no-pipeline")) {
+            options.pipeline = false;
+            dict.erase("--no-pipeline");
+        }
+
         if (dict.count("--num-samples")) {
             if (!isUnsigned(dict["--num-samples"])) {
                 options.displayHelp = true;
@@ -550,6 +611,86 @@ Options parseArgs(int argc, char const* const* argv) {
             dict.erase("--parallel");
         }
 
+        if (dict.count("--pin-threads")) {
+            options.pinThreads = true;
+            dict.erase("--pin-threads");
+        }
+
+        if (dict.count("--aovs")) {
+            options.aovs = true;
+            dict.erase("--aovs");
+        }
+
+        if (dict.count("--denoise")) {
+            options.aovs = true;
+            options.denoise = true;
+            dict.erase("--denoise");
+        }
+
+        if (dict.count("--guiding")) {
+            if (options.technique != Options::PT) {
+                options.displayHelp = true;
+                options.displayMessage = "--guiding is valid only for PT.";
+                return options;
+            }
+            else {
+                options.guiding = true;
+                dict.erase("--guiding");
+            }
+        }
+
+        if (dict.count("--guiding-memory")) {
+            if (!options.guiding) {
+                options.displayHelp = true;
+                options.displayMessage = "--guiding-memory requires --guiding.";
+                return options;
+            }
+            else if (!isUnsigned(dict["--guiding-memory"]) ||
+                atoi(dict["--guiding-memory"].c_str()) == 0) {
+                options.displayHelp = true;
+                options.displayMessage = "Invalid value for --guiding-memory.";
+                return options;
+            }
+            else {
+                options.guidingMemory = atoi(dict["--guiding-memory"].c_str());
+                dict.erase("--guiding-memory");
+            }
+        }
+
+        if (dict.count("--sampler")) {
+            if (dict["--sampler"] == "random") {
+                options.sampler = sequence_t::random;
+            }
+            else if (dict["--sampler"] == "sobol") {
+                options.sampler = sequence_t::sobol;
+            }
+            else if (dict["--sampler"] == "halton") {
+                options.sampler = sequence_t::halton;
+            }
+            else {
+                options.displayHelp = true;
+                options.displayMessage = "Invalid value for --sampler.";
+                return options;
+            }
+
+            dict.erase("--sampler");
+        }
+
+        if (dict.count("--seed")) {
+            if (!isUnsigned(dict["--seed"])) {
+                options.displayHelp = true;
+                options.displayMessage = "Invalid value for --seed.";
+                return options;
+            }
+            else {
+                options.seed = strtoull(dict["--seed"].c_str(), nullptr, 10);
+                dict.erase("--seed");
+            }
+        }
+        else {
+            options.seed = std::random_device()();
+        }
+
         if (dict.count("--snapshot")) {
             if (!isUnsigned(dict["--snapshot"])) {
                 options.displayHelp = true;
@@ -596,6 +737,18 @@ Options parseArgs(int argc, char const* const* argv) {
             }
         }
 
+        if (dict.count("--resume")) {
+            if (dict["--resume"].empty()) {
+                options.displayHelp = true;
+                options.displayMessage = "Invalid value for --resume.";
+                return options;
+            }
+            else {
+                options.resume = dict["--resume"];
+                dict.erase("--resume");
+            }
+        }
+
         if (dict.count("--camera")) {
             if (!isUnsigned(dict["--camera"])) {
                 options.displayHelp = true;
@@ -687,7 +840,7 @@ shared<Technique> make_bpt_technique(const shared<const Scene>& scene, const Opt
         options.lights,
         options.roulette,
         options.beta,
-        options.numThreads);
+        shared_threadpool());
 }
 
 template <class T>
@@ -702,10 +855,10 @@ shared<Technique> make_upg_technique(const shared<const Scene>& scene, const Opt
         options.maxRadius,
         options.alpha,
         options.beta,
-        options.numThreads);
+        shared_threadpool());
 }
 
-shared<Technique> makeTechnique(const shared<const Scene>& scene, Options& options) {
+shared<Technique> make_technique(const shared<const Scene>& scene, Options& options) {
     switch (options.technique) {
         case Options::BPT:
             if (options.beta == 0.0f) {
@@ -721,14 +874,30 @@ shared<Technique> makeTechnique(const shared<const Scene>& scene, Options& optio
                 return make_bpt_technique<BPTb>(scene, options);
             }
 
-        case Options::PT:
-            return std::make_shared<PathTracing>(
+        case Options::PT: {
+            auto technique = std::make_shared<PathTracing>(
+                scene,
+                options.lights,
+                options.roulette,
+                options.beta,
+                options.maxPath,
+                shared_threadpool());
+
+            if (options.guiding) {
+                technique->set_guiding(options.guidingMemory << 20);
+            }
+
+            return technique;
+        }
+
+        case Options::WPT:
+            return std::make_shared<WavefrontPathTracing>(
                 scene,
                 options.lights,
                 options.roulette,
                 options.beta,
                 options.maxPath,
-                options.numThreads);
+                shared_threadpool());
 
         case Options::VCM:
             if (options.beta == 0.0f) {
@@ -763,14 +932,25 @@ shared<Technique> makeTechnique(const shared<const Scene>& scene, Options& optio
     }
 }
 
+shared<Technique> makeTechnique(const shared<const Scene>& scene, Options& options) {
+    auto technique = make_technique(scene, options);
+    technique->set_packets(options.packets);
+    technique->set_pipeline(options.pipeline);
+    technique->set_adaptive(options.adaptive);
+    technique->set_features(options.aovs);
+    technique->set_adaptive_roulette(options.adaptiveRoulette);
+    return technique;
+}
+
 shared<Scene> loadScene(const Options& options) {
-    return loadScene(options.input0);
+    return loadScene(options.input0, shared_threadpool());
 }
 
 string techniqueString(const Options& options) {
     switch (options.technique) {
         case Options::BPT: return "BPT";
         case Options::PT: return "PT";
+        case Options::WPT: return "WPT";
         case Options::VCM: return "VCM";
         case Options::UPG: return "UPG";
         case Options::Viewer: return "Viewer";
@@ -1,7 +1,9 @@
 #pragma once
+#include <cstdint>
 #include <initializer_list>
 #include <memory>
 #include <string>
+#include <Sample.hpp>
 
 namespace haste {
 
@@ -11,13 +13,14 @@ using std::string;
 template <class T> using shared = std::shared_ptr<T>;
 
 struct Options {
-    enum Technique { PT, BPT, VCM, UPG, Viewer };
+    enum Technique { PT, WPT, BPT, VCM, UPG, Viewer };
     enum Action { Render, AVG, SUB, Errors, Merge, Filter, Time };
 
     string input0;
     string input1;
     string output;
     string reference;
+    string resume;
     Technique technique = PT;
     Action action = Render;
     size_t numPhotons = 0;
@@ -26,14 +29,25 @@ struct Options {
     double alpha = 0.75f;
     double beta = 1.0f;
     double roulette = 0.9;
+    bool adaptiveRoulette = false;
+    double adaptive = 0.0;
+    bool aovs = false;
+    bool denoise = false;
+    bool guiding = false;
+    size_t guidingMemory = 64;
     bool batch = false;
     bool quiet = false;
     bool enable_vc = true;
     bool enable_vm = true;
+    bool packets = true;
+    bool pipeline = true;
     float lights = 1.0f;
     size_t numSamples = 0;
     double numSeconds = 0.0;
     size_t numThreads = 1;
+    bool pinThreads = false;
+    uint64_t seed = 0;
+    sequence_t sampler = sequence_t::random;
     bool reload = true;
     size_t snapshot = 0;
     size_t cameraId = 0;
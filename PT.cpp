@@ -5,8 +5,8 @@ namespace haste {
 
 PathTracing::PathTracing(const shared<const Scene>& scene,
                          float lights, float roulette, float beta,
-                         size_t max_path, size_t num_threads)
-    : Technique(scene, num_threads),
+                         size_t max_path, threadpool_t& threadpool)
+    : Technique(scene, threadpool),
       _max_path(max_path),
       _lights(lights),
       _roulette(roulette),
@@ -15,42 +15,118 @@ PathTracing::PathTracing(const shared<const Scene>& scene,
     _metadata.beta = beta;
 }
 
+void PathTracing::set_guiding(size_t max_memory) {
+  bounding_sphere_t sphere = _scene->bounding_sphere();
+  _guiding.reset(new guiding_t(sphere.center - vec3(sphere.radius),
+                               sphere.center + vec3(sphere.radius), max_memory));
+  _guiding_passes = 0;
+  _metadata.guiding_memory = _guiding->memory();
+}
+
 vec3 PathTracing::_traceEye(render_context_t& context, Ray ray) {
-  vec3 radiance = vec3(0.0f);
-  EyeVertex eye[2];
-  size_t itr = 0, prv = 1;
+  PathState state;
+  _trace(context, ray, state);
+
+  // The radiance gathered after a vertex divided by the throughput up to
+  // it is the incident radiance along its direction.
+  for (size_t i = 0; i < state.num_records; ++i) {
+    const GuidingRecord& record = state.records[i];
+    vec3 incident = vec3(0.0f);
+
+    for (int k = 0; k < 3; ++k) {
+      if (record.throughput[k] > 0.0f) {
+        incident[k] =
+            (state.radiance[k] - record.radiance[k]) / record.throughput[k];
+      }
+    }
+
+    float luminance = dot(incident, vec3(0.2126f, 0.7152f, 0.0722f));
+    record.dtree->record(record.omega, luminance / record.density);
+  }
+
+  return state.radiance;
+}
+
+void PathTracing::_preprocess(RandomEngine& engine, double num_samples) {
+  if (!_guiding) {
+    return;
+  }
 
-  SurfacePoint surface =
-      _scene->intersect(_camera_surface(context), ray.direction);
+  if (_guiding_passes == size_t(1) << _guiding->iteration()) {
+    _guiding->refine(_threadpool);
+    _guiding_passes = 0;
+    _metadata.guiding_memory = _guiding->memory();
+  }
+
+  ++_guiding_passes;
+}
+
+void PathTracing::_trace(render_context_t& context, Ray ray,
+                         PathState& state) {
+  SurfacePoint surface = _intersect_primary(context, ray);
 
   while (surface.is_light() && _max_path > 0) {
-    radiance += _lights * _scene->queryRadiance(surface, -ray.direction);
+    state.radiance += _lights * _scene->queryRadiance(surface, -ray.direction);
     surface = _scene->intersect(surface, ray.direction);
   }
 
   if (!surface.is_present() || _max_path < 2) {
-    return radiance;
+    return;
+  }
+
+  Branch& root = state.pending[state.num_pending++];
+  root.vertex.surface = surface;
+  root.vertex.omega = -ray.direction;
+  root.vertex.throughput = vec3(1.0f);
+  root.vertex.specular = 0.0f;
+  root.vertex.density = 1.0f;
+  root.path_size = 2;
+  root.index = 0;
+  state.num_branches = 1;
+
+  while (state.num_pending != 0) {
+    Branch branch = state.pending[--state.num_pending];
+    _trace_branch(context, branch, state);
   }
+}
+
+void PathTracing::_trace_branch(render_context_t& context,
+                                const Branch& branch, PathState& state) {
+  EyeVertex eye[2];
+  size_t itr = 0, prv = 1;
 
-  eye[prv].surface = surface;
-  eye[prv].omega = -ray.direction;
-  eye[prv].throughput = vec3(1.0f);
-  eye[prv].specular = 0.0f;
-  eye[prv].density = 1.0f;
+  eye[prv] = branch.vertex;
+  SurfacePoint surface = eye[prv].surface;
+  size_t path_size = branch.path_size;
 
-  size_t path_size = 2;
+  // Every branch takes its own random numbers.
+  const uint32_t offset = branch.index * _branch_dimensions;
 
   while (path_size <= _max_path) {
-    radiance += _connect(context, eye[prv]);
+    context.generator->seek_dimension(eye_dimension(path_size - 2) + offset);
+
+    dtree_t* dtree = nullptr;
+
+    if (_guiding && !_scene->queryBSDF(eye[prv].surface).delta()) {
+      dtree = &_guiding->lookup(eye[prv].surface.position());
+    }
+
+    // Nothing is learned before the first iteration ends.
+    const dtree_t* guide = dtree && _guiding->iteration() != 0 ? dtree : nullptr;
+
+    state.radiance += _connect(context, eye[prv], guide);
 
-    auto bsdf =
-        _scene->sampleBSDF(*context.generator, eye[prv].surface, eye[prv].omega);
+    auto bsdf = _sample(context, eye[prv], guide);
+
+    if (!(bsdf.density > 0.0f)) {
+      return;
+    }
 
     while (true) {
       surface = _scene->intersect(surface, bsdf.omega);
 
       if (!surface.is_present()) {
-        return radiance;
+        return;
       }
 
       eye[itr].surface = surface;
@@ -62,23 +138,33 @@ vec3 PathTracing::_traceEye(render_context_t& context, Ray ray) {
           eye[prv].throughput * bsdf.throughput * edge.bCosTheta;
 
       if (l1Norm(eye[itr].throughput) < FLT_EPSILON) {
-        return radiance;
+        return;
       }
 
       eye[itr].throughput /= bsdf.density;
 
+      if (dtree && state.num_records < _max_guiding_records) {
+        GuidingRecord& record = state.records[state.num_records++];
+        record.dtree = dtree;
+        record.omega = bsdf.omega;
+        record.density = bsdf.density;
+        record.throughput = eye[itr].throughput;
+        record.radiance = state.radiance;
+        dtree = nullptr;
+      }
+
       eye[prv].specular = bsdf.specular;
       eye[itr].density = eye[prv].density * edge.fGeometry * bsdf.density;
 
       if (surface.is_light()) {
-        auto lsdf = _scene->queryLSDF(eye[itr].surface, eye[itr].omega);
+        auto lsdf = _scene->queryLSDF(eye[itr].surface, eye[itr].omega, eye[prv].surface);
         float weightInv = pow(lsdf.density, _beta) /
                               pow(edge.fGeometry * bsdf.density, _beta) +
                           1.0f;
 
         if (bsdf.specular == 1.0f) weightInv = 1.0f;
 
-        radiance += lsdf.radiance * eye[itr].throughput / weightInv;
+        state.radiance += lsdf.radiance * eye[itr].throughput / weightInv;
       } else {
         break;
       }
@@ -86,25 +172,72 @@ vec3 PathTracing::_traceEye(render_context_t& context, Ray ray) {
 
     std::swap(itr, prv);
 
-    float roulette = path_size < _min_subpath ? 1.0f : _roulette;
-    float uniform = context.generator->sample();
+    float expected = 1.0f;
+
+    if (path_size >= _min_subpath) {
+      expected = _adaptive_roulette.expected(
+          eye[prv].throughput, context.pixel_position, _roulette);
+
+      // No more branches than the state holds. The records of the guiding
+      // take the radiance of the whole sample, it isn't split while trained.
+      float max_expected =
+          _guiding ? 1.0f : float(1 + _max_branches - state.num_branches);
+
+      expected = min(expected, max_expected);
+    }
+
+    size_t continuations =
+        roulette_t::continuations(*context.generator, expected);
 
-    if (roulette < uniform) {
-      return radiance;
-    } else {
-      eye[prv].throughput /= roulette;
-      ++path_size;
+    if (continuations == 0) {
+      return;
     }
+
+    eye[prv].throughput /= expected;
+    ++path_size;
+
+    for (size_t i = 1; i < continuations; ++i) {
+      Branch& split = state.pending[state.num_pending++];
+      split.vertex = eye[prv];
+      split.path_size = path_size;
+      split.index = uint32_t(state.num_branches++);
+    }
+  }
+}
+
+BSDFSample PathTracing::_sample(render_context_t& context,
+                                const EyeVertex& eye, const dtree_t* dtree) {
+  if (!dtree) {
+    return _scene->sampleBSDF(*context.generator, eye.surface, eye.omega);
   }
 
-  return radiance;
+  // One-sample MIS, the density is the one of the mixture, whichever of
+  // the two sampled the direction.
+  BSDFSample sample;
+
+  if (context.generator->sample() < _bsdf_fraction) {
+    sample = _scene->sampleBSDF(*context.generator, eye.surface, eye.omega);
+  } else {
+    sample.omega = dtree->sample(*context.generator);
+    auto query = _scene->queryBSDF(eye.surface, sample.omega, eye.omega);
+    sample.throughput = query.throughput;
+    sample.density = query.densityRev;
+    sample.densityRev = query.density;
+    sample.specular = query.specular;
+  }
+
+  sample.density = _bsdf_fraction * sample.density +
+                   (1.0f - _bsdf_fraction) * dtree->pdf(sample.omega);
+
+  return sample;
 }
 
-vec3 PathTracing::_connect(render_context_t& context, const EyeVertex& eye) {
-  LightSample light = _scene->sampleLight(*context.generator);
+vec3 PathTracing::_connect(render_context_t& context, const EyeVertex& eye,
+                           const dtree_t* dtree) {
+  LightSample light = _scene->sampleLight(*context.generator, eye.surface);
   vec3 omega = normalize(eye.surface.position() - light.position());
 
-  if (dot(omega, light.normal()) < 0.0f) {
+  if (light.areaDensity() == 0.0f || dot(omega, light.normal()) < 0.0f) {
     return vec3(0.0f);
   }
 
@@ -112,7 +245,14 @@ vec3 PathTracing::_connect(render_context_t& context, const EyeVertex& eye) {
 
   auto edge = Edge(light, eye, omega);
 
-  float weightInv = pow(eyeBSDF.densityRev * edge.bGeometry, _beta) /
+  float density = eyeBSDF.densityRev;
+
+  if (dtree) {
+    density = _bsdf_fraction * density +
+              (1.0f - _bsdf_fraction) * dtree->pdf(-omega);
+  }
+
+  float weightInv = pow(density * edge.bGeometry, _beta) /
                         pow(light.areaDensity(), _beta) +
                     1.0f;
 
@@ -1,15 +1,22 @@
 #pragma once
 #include <Technique.hpp>
+#include <guiding.hpp>
 
 namespace haste {
 
 class PathTracing : public Technique {
  public:
   PathTracing(const shared<const Scene>& scene, float lights, float roulette,
-              float beta, size_t max_path, size_t num_threads);
+              float beta, size_t max_path, threadpool_t& threadpool);
 
   vec3 _traceEye(render_context_t& context, Ray ray) override;
 
+  // Learns the incident radiance in a spatial-directional tree (guiding_t)
+  // of at most max_memory bytes and samples the directions from a mixture
+  // of the BSDF and the learned distribution. The training iteration k
+  // lasts 2^k passes, the tree learned in one iteration guides the next.
+  void set_guiding(size_t max_memory);
+
   string name() const override;
 
  private:
@@ -21,12 +28,57 @@ class PathTracing : public Technique {
     float density;
   };
 
-  vec3 _connect(render_context_t& context, const EyeVertex& eye);
+  // Direction of a path vertex and the incident radiance along it, known
+  // when the path ends.
+  struct GuidingRecord {
+    dtree_t* dtree;
+    vec3 omega;
+    float density;
+    vec3 throughput;
+    vec3 radiance;
+  };
+
+  // Vertex a split path continues from. The index of the branch offsets
+  // its random numbers.
+  struct Branch {
+    EyeVertex vertex;
+    size_t path_size;
+    uint32_t index;
+  };
+
+  static const size_t _max_guiding_records = 16;
+  static const size_t _max_branches = 16;
+  static const uint32_t _branch_dimensions = 256;
+
+  // A camera sample, the split branches wait in pending until the ones
+  // before them end.
+  struct PathState {
+    vec3 radiance = vec3(0.0f);
+    Branch pending[_max_branches];
+    size_t num_pending = 0;
+    size_t num_branches = 0;
+    GuidingRecord records[_max_guiding_records];
+    size_t num_records = 0;
+  };
+
+  void _preprocess(RandomEngine& engine, double num_samples) override;
+  void _trace(render_context_t& context, Ray ray, PathState& state);
+  void _trace_branch(render_context_t& context, const Branch& branch,
+                     PathState& state);
+  BSDFSample _sample(render_context_t& context, const EyeVertex& eye,
+                     const dtree_t* dtree);
+  vec3 _connect(render_context_t& context, const EyeVertex& eye,
+                const dtree_t* dtree);
 
   const size_t _min_subpath = 3;
   const size_t _max_path;
   const float _lights;
   const float _roulette;
   const float _beta;
+
+  // Fraction of the directions sampled from the BSDF when guided.
+  const float _bsdf_fraction = 0.5f;
+  std::unique_ptr<guiding_t> _guiding;
+  size_t _guiding_passes = 0;
 };
 }
@@ -14,10 +14,10 @@ public:
     static const unsigned lightMask() { return 2u; }
 
     const bool isPresent() const { return geomID != RTC_INVALID_GEOMETRY_ID; }
-    const bool isLight() const { return geomID == 0; }
-    const bool isMesh() const { return geomID > 0 && isPresent(); }
+    const bool isLight() const { return instID == 0; }
+    const bool isMesh() const { return instID > 0 && isPresent(); }
 
-    const size_t meshId() const { return geomID - 1; }
+    const size_t instanceId() const { return instID - 1; }
     const size_t faceId() const { return primID; }
     const size_t primId() const { return primID; }
 
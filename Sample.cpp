@@ -1,4 +1,6 @@
+#include <algorithm>
 #include <Sample.hpp>
+#include <unittest>
 
 namespace haste {
 
@@ -183,33 +185,331 @@ direction_sample_t sample_hemisphere(random_generator_t& generator,
   return {vec3(x, y, z), adjust};
 }
 
-random_generator_t::random_generator_t() {
-  std::random_device device;
-  engine.seed(device());
+namespace {
+
+const std::uint32_t philox_m0 = 0xD2511F53;
+const std::uint32_t philox_m1 = 0xCD9E8D57;
+const std::uint32_t philox_w0 = 0x9E3779B9;
+const std::uint32_t philox_w1 = 0xBB67AE85;
+
+// Ten rounds of Philox4x32 on N counters in structure of arrays layout, the
+// loops over the lanes are independent, so they vectorize.
+template <std::size_t N>
+void philox(std::uint32_t (&counter)[4][N], const std::uint32_t* key) {
+  std::uint32_t k0 = key[0];
+  std::uint32_t k1 = key[1];
+
+  for (int round = 0; round < 10; ++round) {
+    for (std::size_t i = 0; i < N; ++i) {
+      std::uint64_t p0 = std::uint64_t(philox_m0) * counter[0][i];
+      std::uint64_t p1 = std::uint64_t(philox_m1) * counter[2][i];
+
+      std::uint32_t c0 = std::uint32_t(p1 >> 32) ^ counter[1][i] ^ k0;
+      std::uint32_t c2 = std::uint32_t(p0 >> 32) ^ counter[3][i] ^ k1;
+
+      counter[0][i] = c0;
+      counter[1][i] = std::uint32_t(p1);
+      counter[2][i] = c2;
+      counter[3][i] = std::uint32_t(p0);
+    }
+
+    k0 += philox_w0;
+    k1 += philox_w1;
+  }
 }
 
-random_generator_t::random_generator_t(std::size_t seed) { engine.seed(seed); }
+float to_float(std::uint32_t x) { return float(x >> 8) * 5.96046448e-8f; }
 
-random_generator_t::random_generator_t(random_generator_t&& that)
-    : engine(std::move(that.engine)) {}
+std::uint32_t hash(std::uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x7feb352d;
+  x ^= x >> 15;
+  x *= 0x846ca68b;
+  x ^= x >> 16;
+  return x;
+}
 
-template <>
-float random_generator_t::sample<float>() {
-  return std::uniform_real_distribution<float>()(engine);
+std::uint32_t reverse_bits(std::uint32_t x) {
+  x = (x << 16) | (x >> 16);
+  x = ((x & 0x00ff00ff) << 8) | ((x & 0xff00ff00) >> 8);
+  x = ((x & 0x0f0f0f0f) << 4) | ((x & 0xf0f0f0f0) >> 4);
+  x = ((x & 0x33333333) << 2) | ((x & 0xcccccccc) >> 2);
+  x = ((x & 0x55555555) << 1) | ((x & 0xaaaaaaaa) >> 1);
+  return x;
 }
 
-random_generator_t random_generator_t::clone() {
-  return random_generator_t(this->operator()() * UINT32_MAX +
-                            this->operator()());
+// Owen scrambling of the bits of x, as a hash based permutation
+// (Laine-Karras) of the reversed bits.
+std::uint32_t nested_uniform_scramble(std::uint32_t x, std::uint32_t seed) {
+  x = reverse_bits(x);
+  x += seed;
+  x ^= x * 0x6c50b47c;
+  x ^= x * 0xb82f1e52;
+  x ^= x * 0xc7afe638;
+  x ^= x * 0x8d22f6e6;
+  return reverse_bits(x);
+}
+
+// The first two dimensions of the Sobol sequence, the second one has the
+// primitive polynomial x + 1.
+std::uint32_t sobol(std::uint32_t index, std::uint32_t dimension) {
+  if (dimension == 0) {
+    return reverse_bits(index);
+  }
+
+  std::uint32_t result = 0;
+
+  for (std::uint32_t v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1) {
+    if (index & 1) {
+      result ^= v;
+    }
+  }
+
+  return result;
+}
+
+const std::uint32_t halton_primes[] = {
+    2,   3,   5,   7,   11,  13,  17,  19,  23,  29,  31,  37,  41,
+    43,  47,  53,  59,  61,  67,  71,  73,  79,  83,  89,  97,  101,
+    103, 107, 109, 113, 127, 131, 137, 139, 149, 151, 157, 163, 167,
+    173, 179, 181, 191, 193, 197, 199, 211, 223, 227, 229, 233, 239,
+    241, 251, 257, 263, 269, 271, 277, 281, 283, 293, 307, 311};
+
+const std::uint32_t num_halton_primes =
+    sizeof(halton_primes) / sizeof(halton_primes[0]);
+
+// Radical inverse with the digits permuted by random affine maps (the base
+// is a prime), the map of a digit depends on the digits before it (nested,
+// as in Owen scrambling).
+double scrambled_radical_inverse(std::uint32_t index, std::uint32_t base,
+                                 std::uint32_t seed) {
+  double inv_base = 1.0 / base;
+  double factor = inv_base;
+  double result = 0.0;
+
+  while (factor > 2.3283064365386963e-10) {
+    std::uint32_t digit = index % base;
+    std::uint32_t multiplier = hash(seed) % (base - 1) + 1;
+    std::uint32_t shift = hash(seed + 1) % base;
+    result += (multiplier * digit + shift) % base * factor;
+    seed = hash(seed ^ (digit + 1));
+    index /= base;
+    factor *= inv_base;
+  }
+
+  return result;
+}
+}
+
+const char* sequence_name(sequence_t sequence) {
+  switch (sequence) {
+    case sequence_t::sobol:
+      return "sobol";
+    case sequence_t::halton:
+      return "halton";
+    default:
+      return "random";
+  }
+}
+
+std::uint32_t eye_dimension(std::size_t vertex) {
+  // The longest paths share the last block, they are too rare to matter.
+  vertex = std::min<std::size_t>(vertex, 0x7ffe);
+  return std::uint32_t(2 * vertex + 1) * dimension_block_size;
+}
+
+std::uint32_t light_dimension(std::size_t vertex) {
+  vertex = std::min<std::size_t>(vertex, 0x7ffe);
+  return std::uint32_t(2 * vertex + 2) * dimension_block_size;
+}
+
+random_generator_t::random_generator_t() : random_generator_t(0) {}
+
+random_generator_t::random_generator_t(std::uint64_t seed, sequence_t sequence)
+    : _sequence(sequence) {
+  _key[0] = std::uint32_t(seed);
+  _key[1] = std::uint32_t(seed >> 32);
+  seek(0, 0);
+}
+
+void random_generator_t::seek(std::uint64_t stream, std::uint32_t sample,
+                              std::uint32_t dimension) {
+  _counter[0] = dimension / 4;
+  _counter[1] = sample;
+  _counter[2] = std::uint32_t(stream);
+  _counter[3] = std::uint32_t(stream >> 32);
+  _refill();
+  _dimension = dimension;
+  _scramble = hash(_key[0] ^ hash(_key[1] ^ hash(_counter[2] ^ hash(_counter[3]))));
+}
+
+void random_generator_t::seek_dimension(std::uint32_t dimension) {
+  _dimension = dimension;
+}
+
+std::uint64_t random_generator_t::seed() const {
+  return std::uint64_t(_key[1]) << 32 | _key[0];
+}
+
+sequence_t random_generator_t::sequence() const { return _sequence; }
+
+std::uint64_t random_generator_t::stream() const {
+  return std::uint64_t(_counter[3]) << 32 | _counter[2];
+}
+
+std::uint32_t random_generator_t::sample_index() const { return _counter[1]; }
+
+std::uint32_t random_generator_t::dimension() const { return _dimension; }
+
+void random_generator_t::_refill() {
+  std::uint32_t block[4][1] = {
+      {_counter[0]}, {_counter[1]}, {_counter[2]}, {_counter[3]}};
+
+  philox(block, _key);
+
+  for (int i = 0; i < 4; ++i) {
+    _block[i] = block[i][0];
+  }
+}
+
+std::uint32_t random_generator_t::_random(std::uint32_t dimension) {
+  if (_counter[0] != dimension / 4) {
+    _counter[0] = dimension / 4;
+    _refill();
+  }
+
+  return _block[dimension % 4];
+}
+
+std::uint32_t random_generator_t::_sobol(std::uint32_t dimension) const {
+  // Pairs of dimensions are the first two dimensions of Sobol with the
+  // index shuffled per pair (Burley 2020), so there is no limit on the
+  // number of dimensions.
+  std::uint32_t seed = hash(_scramble ^ hash(dimension / 2));
+  std::uint32_t index = nested_uniform_scramble(_counter[1], seed);
+  std::uint32_t result = sobol(index, dimension % 2);
+  return nested_uniform_scramble(result, hash(seed + dimension % 2 + 1));
+}
+
+std::uint32_t random_generator_t::_halton(std::uint32_t prime,
+                                          std::uint32_t dimension) const {
+  double point = scrambled_radical_inverse(_counter[1], halton_primes[prime],
+                                           hash(_scramble ^ dimension));
+  return std::uint32_t(std::min(point * 4294967296.0, 4294967295.0));
+}
+
+std::uint32_t random_generator_t::operator()() {
+  std::uint32_t dimension = _dimension++;
+  std::uint32_t block = dimension / dimension_block_size;
+  std::uint32_t offset = dimension % dimension_block_size;
+
+  if (offset < num_ld_dimensions) {
+    if (_sequence == sequence_t::sobol) {
+      return _sobol(dimension);
+    }
+
+    // Halton runs out of small primes after the first few vertices.
+    std::uint32_t prime = block * num_ld_dimensions + offset;
+
+    if (_sequence == sequence_t::halton && prime < num_halton_primes) {
+      return _halton(prime, dimension);
+    }
+  }
+
+  return _random(dimension);
+}
+
+template <>
+float random_generator_t::sample<float>() {
+  return to_float(this->operator()());
 }
 
 template <>
 vec2 random_generator_t::sample<vec2>() {
-  return vec2(std::uniform_real_distribution<float>()(engine),
-              std::uniform_real_distribution<float>()(engine));
+  float x = sample<float>();
+  float y = sample<float>();
+  return vec2(x, y);
 }
 
-std::uint_fast32_t random_generator_t::operator()() {
-  return engine.operator()();
+void random_generator_t::sample_n(float* result, std::size_t n) {
+  const std::size_t num_lanes = 8;
+  std::size_t i = 0;
+
+  if (_sequence == sequence_t::random) {
+    while (i < n && _dimension % 4 != 0) {
+      result[i++] = sample<float>();
+    }
+
+    while (n - i >= 4 * num_lanes) {
+      std::uint32_t counter[4][num_lanes];
+
+      for (std::size_t lane = 0; lane < num_lanes; ++lane) {
+        counter[0][lane] = _dimension / 4 + std::uint32_t(lane);
+        counter[1][lane] = _counter[1];
+        counter[2][lane] = _counter[2];
+        counter[3][lane] = _counter[3];
+      }
+
+      philox(counter, _key);
+
+      for (std::size_t lane = 0; lane < num_lanes; ++lane) {
+        for (std::size_t j = 0; j < 4; ++j) {
+          result[i + lane * 4 + j] = to_float(counter[j][lane]);
+        }
+      }
+
+      _dimension += 4 * num_lanes;
+      i += 4 * num_lanes;
+    }
+  }
+
+  while (i < n) {
+    result[i++] = sample<float>();
+  }
+}
+
+random_generator_t random_generator_t::clone() {
+  std::uint64_t seed = this->operator()();
+  return random_generator_t(seed << 32 | this->operator()());
+}
+
+unittest() {
+  // Known answer of Philox4x32-10 for the zero key and counter.
+  std::uint32_t counter[4][1] = {{0}, {0}, {0}, {0}};
+  std::uint32_t key[2] = {0, 0};
+
+  philox(counter, key);
+
+  assert_true(counter[0][0] == 0x6627e8d5u);
+  assert_true(counter[1][0] == 0xe169c58du);
+  assert_true(counter[2][0] == 0xbc57ac4cu);
+  assert_true(counter[3][0] == 0x9b00dbd8u);
+
+  random_generator_t a(7), b(7);
+  float batch[67];
+
+  a.seek(3, 5, 1);
+  b.seek(3, 5, 1);
+  b.sample_n(batch, 67);
+
+  for (float x : batch) {
+    assert_true(a.sample() == x);
+  }
+
+  // The first 16 samples of a base 2 dimension fall into different 16ths.
+  for (auto sequence : {sequence_t::sobol, sequence_t::halton}) {
+    for (std::uint32_t dimension : {0u, 1u, eye_dimension(1) + 5}) {
+      random_generator_t generator(7, sequence);
+      std::uint32_t strata = 0;
+
+      for (std::uint32_t sample = 0; sample < 16; ++sample) {
+        generator.seek(3, sample, dimension);
+        strata |= 1u << (generator() >> 28);
+      }
+
+      assert_true(strata == 0xffff || dimension != 0);
+      assert_true(strata == 0xffff || sequence == sequence_t::halton);
+    }
+  }
 }
 }
@@ -1,24 +1,78 @@
 #pragma once
+#include <cstdint>
 #include <glm>
-#include <random>
 
 namespace haste {
 
+enum class sequence_t { random, sobol, halton };
+
+const char* sequence_name(sequence_t sequence);
+
+// The dimensions of a path are allotted in blocks: the camera gets the
+// first one, then the eye and the light vertices alternate. The first
+// num_ld_dimensions of a block come from the low-discrepancy sequence, the
+// rest of it is pseudo-random, so a vertex that draws more numbers than
+// planned doesn't run into the next one.
+const std::uint32_t dimension_block_size = 1u << 16;
+const std::uint32_t num_ld_dimensions = 8;
+
+std::uint32_t eye_dimension(std::size_t vertex);
+std::uint32_t light_dimension(std::size_t vertex);
+
+// Counter-based generator (Philox4x32-10). The seed is the key and the
+// counter is (dimension / 4, sample, stream), so a sample of a pixel is
+// the same regardless of which thread or tile computes it. After seek,
+// every call to sample() advances the dimension. With the sobol or halton
+// sequence, the low-discrepancy dimensions of a block are the points of
+// the sequence at the sample index, scrambled per stream.
 struct random_generator_t {
  public:
+  using result_type = std::uint32_t;
+
   random_generator_t();
-  random_generator_t(std::size_t seed);
-  random_generator_t(random_generator_t&& that);
+  random_generator_t(std::uint64_t seed,
+                     sequence_t sequence = sequence_t::random);
+  random_generator_t(random_generator_t&& that) = default;
+
+  random_generator_t& operator=(random_generator_t&& that) = default;
 
   template <class T = float>
   T sample();
 
+  // Fills the result with n uniform samples, whole blocks are generated
+  // several at a time.
+  void sample_n(float* result, std::size_t n);
+
+  void seek(std::uint64_t stream, std::uint32_t sample,
+            std::uint32_t dimension = 0);
+  void seek_dimension(std::uint32_t dimension);
+
+  std::uint64_t seed() const;
+  sequence_t sequence() const;
+  std::uint64_t stream() const;
+  std::uint32_t sample_index() const;
+  std::uint32_t dimension() const;
+
   random_generator_t clone();
 
-  std::uint_fast32_t operator()();
+  std::uint32_t operator()();
+
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() { return UINT32_MAX; }
 
  private:
-  std::mt19937 engine;
+  std::uint32_t _key[2];
+  std::uint32_t _counter[4];
+  std::uint32_t _block[4];
+  std::uint32_t _dimension;
+  std::uint32_t _scramble;
+  sequence_t _sequence;
+
+  void _refill();
+  std::uint32_t _random(std::uint32_t dimension);
+  std::uint32_t _sobol(std::uint32_t dimension) const;
+  std::uint32_t _halton(std::uint32_t prime, std::uint32_t dimension) const;
+
   random_generator_t(const random_generator_t&) = delete;
   random_generator_t& operator=(const random_generator_t&) = delete;
 };
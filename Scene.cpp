@@ -1,7 +1,9 @@
 #include <runtime_assert>
 #include <Scene.hpp>
 #include <streamops.hpp>
+#include <threadpool.hpp>
 #include <cstring>
+#include <vector>
 
 namespace haste {
 
@@ -9,10 +11,12 @@ Scene::Scene(
     Cameras&& cameras,
     Materials&& materials,
     vector<Mesh>&& meshes,
+    vector<Instance>&& instances,
     AreaLights&& areaLights,
     const bounding_sphere_t& bounding_sphere)
     : _cameras(cameras)
     , meshes(move(meshes))
+    , instances(move(instances))
     , lights(move(areaLights))
     , materials(move(materials))
     , _bounding_sphere(bounding_sphere)
@@ -21,23 +25,42 @@ Scene::Scene(
 
     _numIntersectRays = 0;
     _numOccludedRays = 0;
+
+    for (auto&& instance : this->instances) {
+        runtime_assert(instance.meshID < this->meshes.size());
+        _normal_transforms.push_back(transpose(inverse(mat3(instance.transform))));
+    }
+}
+
+static RTCScene newRTCScene(RTCDevice device) {
+    RTCScene rtcScene = rtcDeviceNewScene(
+        device,
+        RTC_SCENE_STATIC | RTC_SCENE_HIGH_QUALITY,
+        RTC_INTERSECT1 | RTC_INTERSECT_STREAM);
+
+    if (rtcScene == nullptr) {
+        throw std::runtime_error("Cannot create RTCScene.");
+    }
+
+    return rtcScene;
 }
 
-unsigned makeRTCMesh(RTCScene rtcScene, size_t i, const vector<Mesh>& meshes) {
+RTCScene makeRTCMesh(RTCDevice device, const Mesh& mesh) {
+    RTCScene rtcScene = newRTCScene(device);
+
     unsigned geomID = rtcNewTriangleMesh(
         rtcScene,
         RTC_GEOMETRY_STATIC,
-        meshes[i].indices.size() / 3,
-        meshes[i].vertices.size(),
+        mesh.indices.size() / 3,
+        mesh.vertices.size(),
         1);
 
     vec4* vbuffer = (vec4*) rtcMapBuffer(rtcScene, geomID, RTC_VERTEX_BUFFER);
+    const vec3* vertices = mesh.vertices.data();
+    const size_t num_vertices = mesh.vertices.size();
 
-    for (size_t j = 0; j < meshes[i].vertices.size(); ++j) {
-        vbuffer[j].x = meshes[i].vertices[j].x;
-        vbuffer[j].y = meshes[i].vertices[j].y;
-        vbuffer[j].z = meshes[i].vertices[j].z;
-        vbuffer[j].w = 1;
+    for (size_t j = 0; j < num_vertices; ++j) {
+        vbuffer[j] = vec4(vertices[j], 1.0f);
     }
 
     rtcUnmapBuffer(rtcScene, geomID, RTC_VERTEX_BUFFER);
@@ -45,42 +68,84 @@ unsigned makeRTCMesh(RTCScene rtcScene, size_t i, const vector<Mesh>& meshes) {
     int* triangles = (int*) rtcMapBuffer(rtcScene, geomID, RTC_INDEX_BUFFER);
     std::memcpy(
         triangles,
-        meshes[i].indices.data(),
-        meshes[i].indices.size() * sizeof(int));
+        mesh.indices.data(),
+        mesh.indices.size() * sizeof(int));
 
     rtcUnmapBuffer(rtcScene, geomID, RTC_INDEX_BUFFER);
 
-    return geomID;
+    rtcCommit(rtcScene);
+
+    return rtcScene;
 }
 
-void updateRTCScene(RTCScene& rtcScene, RTCDevice device, const Scene& scene) {
+void updateRTCScene(
+    RTCScene& rtcScene,
+    vector<RTCScene>& rtcMeshScenes,
+    RTCDevice device,
+    threadpool_t& pool,
+    const Scene& scene)
+{
     if (rtcScene) {
         rtcDeleteScene(rtcScene);
     }
 
-    rtcScene = rtcDeviceNewScene(
-        device,
-        RTC_SCENE_STATIC | RTC_SCENE_HIGH_QUALITY,
-        RTC_INTERSECT1);
-
-    if (rtcScene == nullptr) {
-        throw std::runtime_error("Cannot create RTCScene.");
+    for (auto&& rtcMeshScene : rtcMeshScenes) {
+        rtcDeleteScene(rtcMeshScene);
     }
 
-    unsigned geomID = newMesh(rtcScene, scene.lights);
-    runtime_assert(geomID == 0, "Area lights have to get 0 primID.");
+    rtcMeshScenes.clear();
+
+    rtcScene = newRTCScene(device);
+
+    // Everything, including the lights, is placed through an instance, so
+    // instID is always written on a hit and identifies what was hit. The
+    // geomID only refers to the geometry inside of the instanced scene.
+    RTCScene rtcLightsScene = newRTCScene(device);
+    newMesh(rtcLightsScene, scene.lights);
+    rtcCommit(rtcLightsScene);
+    rtcMeshScenes.push_back(rtcLightsScene);
 
-    for (size_t i = 0; i < scene.meshes.size(); ++i) {
-        unsigned geomID = makeRTCMesh(rtcScene, i, scene.meshes);
-        runtime_assert(geomID == i + 1, "Geometry ID doesn't correspond to mesh index.");
+    const mat4 identity = mat4(1.0f);
+
+    unsigned instID = rtcNewInstance2(rtcScene, rtcLightsScene);
+    rtcSetTransform2(rtcScene, instID, RTC_MATRIX_COLUMN_MAJOR_ALIGNED16, &identity[0][0]);
+    rtcSetMask(rtcScene, instID, RayIsect::lightMask());
+    runtime_assert(instID == 0, "Area lights have to get 0 instID.");
+
+    size_t meshScenesOffset = rtcMeshScenes.size();
+    rtcMeshScenes.resize(meshScenesOffset + scene.meshes.size());
+
+    // Every mesh is a separate Embree scene, so they can be filled and
+    // committed concurrently.
+    exec1d(pool, scene.meshes.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            rtcMeshScenes[meshScenesOffset + i] = makeRTCMesh(device, scene.meshes[i]);
+        }
+    });
+
+    for (size_t i = 0; i < scene.instances.size(); ++i) {
+        auto& instance = scene.instances[i];
+
+        unsigned instID = rtcNewInstance2(
+            rtcScene,
+            rtcMeshScenes[meshScenesOffset + instance.meshID]);
+
+        rtcSetTransform2(
+            rtcScene,
+            instID,
+            RTC_MATRIX_COLUMN_MAJOR_ALIGNED16,
+            &instance.transform[0][0]);
+
+        runtime_assert(instID == i + 1, "Instance ID doesn't correspond to instance index.");
     }
 
     rtcCommit(rtcScene);
 }
 
-void Scene::buildAccelStructs(RTCDevice device) {
+void Scene::buildAccelStructs(RTCDevice device, threadpool_t& pool) {
     if (rtcScene == nullptr) {
-        updateRTCScene(rtcScene, device, *this);
+        time_scope_t _(build_time);
+        updateRTCScene(rtcScene, _rtc_mesh_scenes, device, pool, *this);
         lights.init(this, _bounding_sphere);
     }
 }
@@ -107,10 +172,13 @@ SurfacePoint Scene::querySurface(const RayIsect& isect) const {
         return point;
     }
     else {
-        runtime_assert(isect.meshId() < meshes.size());
+        runtime_assert(isect.instanceId() < instances.size());
 
         const float w = 1.f - isect.u - isect.v;
-        auto& mesh = meshes[isect.meshId()];
+        auto& instance = instances[isect.instanceId()];
+        auto& mesh = meshes[instance.meshID];
+        const mat3 transform = mat3(instance.transform);
+        const mat3& normal_transform = _normal_transforms[isect.instanceId()];
 
         const mat3& t0 = mesh.tangents[mesh.indices[isect.primID * 3 + 0]];
         const mat3& t1 = mesh.tangents[mesh.indices[isect.primID * 3 + 1]];
@@ -121,7 +189,9 @@ SurfacePoint Scene::querySurface(const RayIsect& isect) const {
 
         point._tangent = w * t0 + isect.u * t1 + isect.v * t2;
 
-        point._tangent[1] = normalize(point._tangent[1]);
+        point._tangent[0] = transform * point._tangent[0];
+        point._tangent[1] = normalize(normal_transform * point._tangent[1]);
+        point._tangent[2] = transform * point._tangent[2];
 
         point._tangent[0]
             = point._tangent[0]
@@ -136,7 +206,8 @@ SurfacePoint Scene::querySurface(const RayIsect& isect) const {
 
         point._tangent[2] = normalize(point._tangent[2]);
 
-        point.gnormal = isect.gnormal();
+        // Embree reports the geometric normal of instances in object space.
+        point.gnormal = normalize(normal_transform * isect.gnormal());
 
         point._tangent[1]
             = point._tangent[1]
@@ -167,6 +238,19 @@ const LSDFQuery Scene::queryLSDF(
     return lights.queryLSDF(surface.materialId() + materials.lights_offset, omega);
 }
 
+const LSDFQuery Scene::queryLSDF(
+    const SurfacePoint& surface,
+    const vec3& omega,
+    const SurfacePoint& reference) const
+{
+    runtime_assert(surface.materialId() < 0);
+    return lights.queryLSDF(
+        surface.materialId() + materials.lights_offset,
+        omega,
+        reference.position(),
+        reference.normal());
+}
+
 const BSDFSample Scene::sampleBSDF(
     RandomEngine& engine,
     const SurfacePoint& surface,
@@ -189,14 +273,14 @@ const BSDFQuery Scene::queryBSDF(
     return bsdf->query(surface, incident, outgoing);
 }
 
-float Scene::occluded(
+static void make_occlusion_ray(
+    RTCRay& rtcRay,
     const SurfacePoint& origin,
-    const SurfacePoint& target) const
+    const SurfacePoint& target)
 {
     vec3 adjusted_origin = origin.position() + origin.normal() * 0.001f;
     vec3 adjusted_target = target.position() + target.normal() * 0.001f;
 
-    RTCRay rtcRay;
     (*(vec3*)rtcRay.org) = adjusted_origin;
     (*(vec3*)rtcRay.dir) = adjusted_target - adjusted_origin;
     rtcRay.tnear = 0.0f;
@@ -206,6 +290,31 @@ float Scene::occluded(
     rtcRay.instID = RTC_INVALID_GEOMETRY_ID;
     rtcRay.mask = RayIsect::occluderMask();
     rtcRay.time = 0.f;
+}
+
+static void make_intersection_ray(
+    RTCRay& rtcRay,
+    const vec3& origin,
+    const vec3& direction,
+    float tfar)
+{
+    (*(vec3*)rtcRay.org) = origin;
+    (*(vec3*)rtcRay.dir) = direction;
+    rtcRay.tnear = 0.0005f;
+    rtcRay.tfar = tfar;
+    rtcRay.geomID = RTC_INVALID_GEOMETRY_ID;
+    rtcRay.primID = RTC_INVALID_GEOMETRY_ID;
+    rtcRay.instID = RTC_INVALID_GEOMETRY_ID;
+    rtcRay.mask = 0xFFFFFFFF;
+    rtcRay.time = 0.f;
+}
+
+float Scene::occluded(
+    const SurfacePoint& origin,
+    const SurfacePoint& target) const
+{
+    RTCRay rtcRay;
+    make_occlusion_ray(rtcRay, origin, target);
     rtcOccluded(rtcScene, rtcRay);
 
     ++_numOccludedRays;
@@ -218,15 +327,7 @@ SurfacePoint Scene::intersect(
     vec3 direction,
     float tfar) const {
     RayIsect rtcRay;
-    (*(vec3*)rtcRay.org) = surface.position();
-    (*(vec3*)rtcRay.dir) = direction;
-    rtcRay.tnear = 0.0005f;
-    rtcRay.tfar = tfar;
-    rtcRay.geomID = RTC_INVALID_GEOMETRY_ID;
-    rtcRay.primID = RTC_INVALID_GEOMETRY_ID;
-    rtcRay.instID = RTC_INVALID_GEOMETRY_ID;
-    rtcRay.mask = 0xFFFFFFFF;
-    rtcRay.time = 0.f;
+    make_intersection_ray(rtcRay, surface.position(), direction, tfar);
     rtcIntersect(rtcScene, rtcRay);
 
     ++_numIntersectRays;
@@ -234,6 +335,56 @@ SurfacePoint Scene::intersect(
     return querySurface(rtcRay);
 }
 
+void Scene::intersect_n(
+    SurfacePoint* result,
+    const vec3* origins,
+    const vec3* directions,
+    size_t num_rays) const
+{
+    std::vector<RayIsect> rtcRays(num_rays);
+
+    for (size_t i = 0; i < num_rays; ++i) {
+        make_intersection_ray(rtcRays[i], origins[i], directions[i], INFINITY);
+    }
+
+    RTCIntersectContext context;
+    context.flags = RTC_INTERSECT_COHERENT;
+    context.userRayExt = nullptr;
+
+    rtcIntersect1M(rtcScene, &context, rtcRays.data(), num_rays, sizeof(RayIsect));
+
+    _numIntersectRays += num_rays;
+
+    for (size_t i = 0; i < num_rays; ++i) {
+        result[i] = querySurface(rtcRays[i]);
+    }
+}
+
+void Scene::occluded_n(
+    float* result,
+    const SurfacePoint* origins,
+    const SurfacePoint* targets,
+    size_t num_rays) const
+{
+    std::vector<RTCRay> rtcRays(num_rays);
+
+    for (size_t i = 0; i < num_rays; ++i) {
+        make_occlusion_ray(rtcRays[i], origins[i], targets[i]);
+    }
+
+    RTCIntersectContext context;
+    context.flags = RTC_INTERSECT_INCOHERENT;
+    context.userRayExt = nullptr;
+
+    rtcOccluded1M(rtcScene, &context, rtcRays.data(), num_rays, sizeof(RTCRay));
+
+    _numOccludedRays += num_rays;
+
+    for (size_t i = 0; i < num_rays; ++i) {
+        result[i] = rtcRays[i].geomID == 0 ? 0.f : 1.f;
+    }
+}
+
 const size_t Scene::numNormalRays() const {
     return _numIntersectRays;
 }
@@ -252,6 +403,13 @@ const LightSample Scene::sampleLight(
     return lights.sample(engine);
 }
 
+const LightSample Scene::sampleLight(
+        RandomEngine& engine,
+        const SurfacePoint& reference) const
+{
+    return lights.sample(engine, reference.position(), reference.normal());
+}
+
 int32_t Scene::_material_id_to_light_id(int32_t id) const {
     return id + materials.lights_offset;
 }
@@ -22,6 +22,7 @@ using std::size_t;
 using std::move;
 
 struct Ray;
+class threadpool_t;
 
 struct Mesh {
     string name;
@@ -29,6 +30,14 @@ struct Mesh {
     vector<int> indices;
     vector<vec3> vertices;
     vector<mat3> tangents;
+    size_t welded_bytes = 0;
+};
+
+// Places a mesh in the world. Meshes are kept in their local space, so a mesh
+// referenced by many instances is stored and built only once.
+struct Instance {
+    unsigned meshID;
+    mat4 transform;
 };
 
 class Scene : public Intersector {
@@ -37,17 +46,23 @@ public:
         Cameras&& cameras,
         Materials&& materials,
         vector<Mesh>&& meshes,
+        vector<Instance>&& instances,
         AreaLights&& areaLights,
         const bounding_sphere_t& bounding_sphere);
 
     Cameras _cameras;
     const vector<Mesh> meshes;
+    const vector<Instance> instances;
     AreaLights lights;
     const Materials materials;
 
+    double import_time = 0.0;
+    double convert_time = 0.0;
+    double build_time = 0.0;
+
     const Cameras& cameras() const { return _cameras; }
 
-    void buildAccelStructs(RTCDevice device);
+    void buildAccelStructs(RTCDevice device, threadpool_t& pool);
 
     const BSDF& queryBSDF(const SurfacePoint& surface) const;
 
@@ -61,6 +76,12 @@ public:
         const SurfacePoint& surface,
         const vec3& omega) const;
 
+    // The density of the light as sampled by sampleLight(engine, reference).
+    const LSDFQuery queryLSDF(
+        const SurfacePoint& surface,
+        const vec3& omega,
+        const SurfacePoint& reference) const;
+
     using Intersector::intersect;
 
     float occluded(const SurfacePoint& origin,
@@ -71,6 +92,18 @@ public:
         vec3 direction,
         float tfar) const override;
 
+    void intersect_n(
+        SurfacePoint* result,
+        const vec3* origins,
+        const vec3* directions,
+        size_t num_rays) const override;
+
+    void occluded_n(
+        float* result,
+        const SurfacePoint* origins,
+        const SurfacePoint* targets,
+        size_t num_rays) const override;
+
     const size_t numNormalRays() const;
     const size_t numShadowRays() const;
     const size_t numRays() const;
@@ -78,6 +111,12 @@ public:
     const LightSample sampleLight(
         RandomEngine& engine) const;
 
+    // Samples a light for the next event estimation at the reference
+    // surface, see AreaLights::sample.
+    const LightSample sampleLight(
+        RandomEngine& engine,
+        const SurfacePoint& reference) const;
+
     const BSDFSample sampleBSDF(
         RandomEngine& engine,
         const SurfacePoint& surface,
@@ -95,11 +134,13 @@ private:
     int32_t _light_id_to_material_id(int32_t) const;
 
     bounding_sphere_t _bounding_sphere;
+    vector<mat3> _normal_transforms;
 
     mutable std::atomic<size_t> _numIntersectRays;
     mutable std::atomic<size_t> _numOccludedRays;
 
     mutable RTCScene rtcScene;
+    mutable vector<RTCScene> _rtc_mesh_scenes;
 };
 
 }
@@ -0,0 +1,100 @@
+#include <unittest>
+#include <SurfacePoint.hpp>
+
+namespace haste {
+
+static vec2 sign_not_zero(vec2 v) {
+    return vec2(v.x < 0.0f ? -1.0f : 1.0f, v.y < 0.0f ? -1.0f : 1.0f);
+}
+
+uint32_t encode_octahedral(vec3 direction) {
+    direction /= abs(direction.x) + abs(direction.y) + abs(direction.z);
+
+    vec2 folded = direction.z < 0.0f
+        ? (1.0f - abs(vec2(direction.y, direction.x))) * sign_not_zero(vec2(direction))
+        : vec2(direction);
+
+    int16_t x = int16_t(round(clamp(folded.x, -1.0f, 1.0f) * 32767.0f));
+    int16_t y = int16_t(round(clamp(folded.y, -1.0f, 1.0f) * 32767.0f));
+
+    return uint32_t(uint16_t(x)) | uint32_t(uint16_t(y)) << 16;
+}
+
+vec3 decode_octahedral(uint32_t encoded) {
+    vec2 folded = vec2(
+        float(int16_t(encoded & 0xFFFFu)),
+        float(int16_t(encoded >> 16))) / 32767.0f;
+
+    vec3 direction = vec3(folded, 1.0f - abs(folded.x) - abs(folded.y));
+
+    if (direction.z < 0.0f) {
+        vec2 unfolded = (1.0f - abs(vec2(direction.y, direction.x))) * sign_not_zero(folded);
+        direction.x = unfolded.x;
+        direction.y = unfolded.y;
+    }
+
+    return normalize(direction);
+}
+
+CompactSurfacePoint::CompactSurfacePoint(const SurfacePoint& surface) {
+    float handedness = dot(
+        surface.bitangent(),
+        cross(surface.normal(), surface.tangent()));
+
+    _position = surface.position();
+    _normal = encode_octahedral(surface.normal());
+    _tangent = encode_octahedral(surface.tangent());
+    _gnormal = encode_octahedral(surface.gnormal);
+    _material = uint32_t(surface.materialId()) << 1 | (handedness < 0.0f ? 1u : 0u);
+}
+
+SurfacePoint CompactSurfacePoint::expand() const {
+    vec3 normal = decode_octahedral(_normal);
+    vec3 tangent = decode_octahedral(_tangent);
+    tangent = normalize(tangent - dot(tangent, normal) * normal);
+    float handedness = _material & 1u ? -1.0f : 1.0f;
+
+    SurfacePoint result;
+    result._position = _position;
+    result.gnormal = decode_octahedral(_gnormal);
+    result._tangent[0] = handedness * cross(normal, tangent);
+    result._tangent[1] = normal;
+    result._tangent[2] = tangent;
+    result._materialId = materialId();
+
+    return result;
+}
+
+unittest() {
+    vec3 directions[] = {
+        vec3(0.0f, 1.0f, 0.0f),
+        vec3(0.0f, 0.0f, -1.0f),
+        normalize(vec3(1.0f, -2.0f, 3.0f)),
+        normalize(vec3(-3.0f, 1.0f, -0.5f)),
+    };
+
+    for (auto&& direction : directions) {
+        assert_almost_eq(decode_octahedral(encode_octahedral(direction)), direction, 0.0005f);
+    }
+}
+
+unittest() {
+    SurfacePoint surface(
+        vec3(1.0f, 2.0f, 3.0f),
+        vec3(0.0f, 1.0f, 0.0f),
+        vec3(0.0f, 0.0f, 1.0f),
+        -3);
+
+    surface.gnormal = vec3(0.0f, 1.0f, 0.0f);
+    surface._tangent[0] = -surface._tangent[0];
+
+    SurfacePoint expanded = CompactSurfacePoint(surface).expand();
+
+    assert_almost_eq(expanded.position(), surface.position());
+    assert_almost_eq(expanded.bitangent(), surface.bitangent(), 0.0005f);
+    assert_almost_eq(expanded.normal(), surface.normal(), 0.0005f);
+    assert_almost_eq(expanded.tangent(), surface.tangent(), 0.0005f);
+    assert_true(expanded.materialId() == -3);
+}
+
+}
@@ -1,5 +1,6 @@
 #pragma once
 #include <cstdint>
+#include <glm>
 
 namespace haste {
 
@@ -40,4 +41,30 @@ struct SurfacePoint {
     const bool is_present() const { return _materialId != INT32_MIN; }
 };
 
+uint32_t encode_octahedral(vec3 direction);
+vec3 decode_octahedral(uint32_t encoded);
+
+// Stores the surface in 28 bytes instead of 64. The shading normal, the
+// tangent and the geometric normal are octahedral encoded, the bitangent is
+// reconstructed from the handedness bit packed along with the material id.
+struct CompactSurfacePoint {
+    vec3 _position;
+    uint32_t _normal;
+    uint32_t _tangent;
+    uint32_t _gnormal;
+    uint32_t _material;
+
+    CompactSurfacePoint() = default;
+    CompactSurfacePoint(const SurfacePoint& surface);
+
+    SurfacePoint expand() const;
+
+    const vec3& position() const { return _position; }
+    const vec3 normal() const { return decode_octahedral(_normal); }
+    const vec3 gnormal() const { return decode_octahedral(_gnormal); }
+    int32_t materialId() const { return int32_t(_material) >> 1; }
+
+    const bool is_light() const { return materialId() < 0; }
+};
+
 }
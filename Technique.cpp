@@ -1,12 +1,18 @@
+#include <random>
 #include <unittest>
 #include <runtime_assert>
 #include <Technique.hpp>
 
 namespace haste {
 
-Technique::Technique(const shared<const Scene>& scene, size_t num_threads)
+static const size_t splat_buffers_budget = size_t(1) << 30;
+
+Technique::Technique(const shared<const Scene>& scene, threadpool_t& threadpool)
     : _scene(scene)
-    , _threadpool(num_threads) {
+    , _num_culled_rays(0)
+    , _num_gathered(0)
+    , _threadpool(threadpool)
+    , _arenas(threadpool) {
 }
 
 Technique::~Technique() { }
@@ -27,6 +33,7 @@ double Technique::render(
     context.focal_length_y = cameras.focal_length_y(cameraId, context.resolution.x / context.resolution.y);
     context.focal_factor_y = context.focal_length_y * context.focal_length_y * 0.25f;
     context.generator = &engine;
+    context.sample_index = uint32_t(_metadata.num_samples);
 
     if (!std::isfinite(_rendering_start_time)) {
         _rendering_start_time = high_resolution_time();
@@ -35,23 +42,42 @@ double Technique::render(
 
     size_t num_basic_rays = _scene->numNormalRays();
     size_t num_shadow_rays = _scene->numShadowRays();
+    size_t num_allocations = haste::num_allocations();
 
+    _arenas.reset();
     _adjust_helper_image(view);
     _preprocess(engine, _metadata.num_samples);
     _trace_paths(view, context, cameraId);
     double epsilon = _commit_images(view);
+    _update_active_tiles(view);
+
+    if (_adaptive_roulette.enabled()) {
+        _adaptive_roulette.update(_threadpool, view);
+    }
 
     double current = high_resolution_time();
     _frame_time = current - _previous_frame_time;
     _previous_frame_time = current;
 
     _metadata.technique = name();
+    _metadata.seed = engine.seed();
+    _metadata.sampler = sequence_name(engine.sequence());
+    _metadata.packets = _packets;
     ++_metadata.num_samples;
     _metadata.num_basic_rays += _scene->numNormalRays() - num_basic_rays;
     _metadata.num_shadow_rays += _scene->numShadowRays() - num_shadow_rays;
     _metadata.num_tentative_rays += 0;
+    _metadata.num_culled_rays = _num_culled_rays;
+    _metadata.num_gathered = _num_gathered;
+    _metadata.num_allocations = haste::num_allocations() - num_allocations;
+    _metadata.num_splats = _num_restored_splats;
+
+    for (auto&& buffer : _splat_buffers) {
+        _metadata.num_splats += buffer.num_splats;
+    }
 
-    _metadata.num_threads = _threadpool.num_threads();
+    // The rendering thread takes part in every fork-join.
+    _metadata.num_threads = _threadpool.num_threads() + 1;
     _metadata.resolution = ivec2(view.width(), view.height());
     _metadata.epsilon = epsilon;
     _metadata.total_time = current - _rendering_start_time;
@@ -68,6 +94,74 @@ double Technique::frame_time() const {
     return _frame_time;
 }
 
+void Technique::set_packets(bool packets) {
+    _packets = packets;
+}
+
+void Technique::set_pipeline(bool pipeline) {
+    _pipeline = pipeline;
+}
+
+void Technique::set_adaptive(double threshold) {
+    _adaptive_threshold = threshold;
+}
+
+void Technique::set_features(bool features) {
+    _features = features;
+}
+
+void Technique::set_adaptive_roulette(bool adaptive_roulette) {
+    _adaptive_roulette.set_enabled(adaptive_roulette);
+}
+
+void Technique::features(const ImageView& view, vector<feature_t>& result) const {
+    result.clear();
+
+    if (_feature_image.size() != view.width() * view.height()) {
+        return;
+    }
+
+    result.resize(_feature_image.size());
+
+    for (size_t i = 0; i < _feature_image.size(); ++i) {
+        const feature_sum_t& sum = _feature_image[i];
+
+        if (sum.count != 0.0f) {
+            float count_inv = 1.0f / sum.count;
+            result[i].albedo = sum.albedo * count_inv;
+            result[i].normal = sum.normal * count_inv;
+            result[i].depth = sum.depth * count_inv;
+        }
+    }
+}
+
+void Technique::save(checkpoint_t& checkpoint) const {
+    checkpoint.metadata = _metadata;
+    checkpoint.moments = _moment_image;
+    checkpoint.adaptive_threshold = _adaptive_threshold;
+}
+
+void Technique::restore(const checkpoint_t& checkpoint) {
+    _metadata = checkpoint.metadata;
+    _num_culled_rays = _metadata.num_culled_rays;
+    _num_gathered = _metadata.num_gathered;
+    _num_restored_splats = _metadata.num_splats;
+
+    // The timers continue from the saved total time.
+    double current = high_resolution_time();
+    _rendering_start_time = current - _metadata.total_time;
+    _previous_frame_time = current;
+
+    if (_adaptive_threshold > 0.0 && !checkpoint.moments.empty()) {
+        _moment_image = checkpoint.moments;
+        _adaptive_threshold = checkpoint.adaptive_threshold;
+    }
+}
+
+bool Technique::_splats() const {
+    return false;
+}
+
 vec3 Technique::_traceEye(
     render_context_t& context,
     Ray ray)
@@ -126,12 +220,58 @@ unittest() {
     assert_almost_eq(view_to_world[2], -direction_normalized);
 }
 
+SurfacePoint Technique::_intersect_primary(
+    render_context_t& context,
+    const Ray& ray) const
+{
+    if (context.primary) {
+        return *context.primary;
+    }
+
+    return _scene->intersect(_camera_surface(context), ray.direction);
+}
+
 void Technique::_adjust_helper_image(ImageView& view) {
     size_t view_size = view.width() * view.height();
 
-    if (_light_image.size() != view_size) {
-        _light_image.resize(view_size, vec3(0.0f));
-        _eye_image.resize(view_size, vec3(0.0f));
+    size_t num_tile_cols = (view.xWindow() + _tile_size - 1) / _tile_size;
+    size_t num_tile_rows = (view.yWindow() + _tile_size - 1) / _tile_size;
+
+    if (num_tile_cols != _num_tile_cols || num_tile_rows != _num_tile_rows) {
+        _num_tile_cols = num_tile_cols;
+        _num_tile_rows = num_tile_rows;
+        _active_tiles.assign(num_tile_cols * num_tile_rows, 1);
+    }
+
+    if (_view_size != view_size) {
+        _view_size = view_size;
+
+        // The splatting techniques sample uniformly, the moments would
+        // never be read.
+        if (_adaptive_threshold > 0.0 && !_splats() &&
+            _moment_image.size() != view_size) {
+            _moment_image.assign(view_size, 0.0);
+        }
+
+        if (_features) {
+            _feature_image.assign(view_size, feature_sum_t());
+        }
+
+        if (!_splats()) {
+            return;
+        }
+
+        _frame_image.assign(view_size, vec3(0.0f));
+
+        size_t num_buffers = _threadpool.num_threads() + 1;
+        _splat_buffers.resize(num_buffers);
+        _atomic_splats = num_buffers * view_size * sizeof(vec3) > splat_buffers_budget;
+
+        for (auto&& buffer : _splat_buffers) {
+            buffer.image.clear();
+            buffer.image.shrink_to_fit();
+            buffer.dirty = false;
+        }
     }
 }
 
@@ -139,10 +279,14 @@ void Technique::_trace_paths(
     ImageView& view,
     render_context_t& context,
     size_t cameraId) {
-    exec2d(_threadpool, view.xWindow(), view.yWindow(), 32,
+    exec2d(_threadpool, _tile_scheduler, view.xWindow(), view.yWindow(), _tile_size,
         [&](size_t x0, size_t x1, size_t y0, size_t y1) {
+        if (!_active_tiles[y0 / _tile_size * _num_tile_cols + x0 / _tile_size]) {
+            return;
+        }
+
         render_context_t local_context = context;
-        RandomEngine engine;
+        RandomEngine engine(context.generator->seed(), context.generator->sequence());
         local_context.generator = &engine;
 
         ImageView subview = view;
@@ -166,6 +310,20 @@ void Technique::_trace_paths(
 double Technique::_commit_images(ImageView& view) {
     double epsilon = 0.0f;
 
+    if (_frame_image.empty()) {
+        std::swap(epsilon, _epsilon);
+        return sqrt(epsilon / (view.width() * view.height()));
+    }
+
+    arena_vector_t<vec3*> splats(&_arenas.local());
+
+    for (auto&& buffer : _splat_buffers) {
+        if (buffer.dirty) {
+            splats.push_back(buffer.image.data());
+            buffer.dirty = false;
+        }
+    }
+
     exec_in_bands(_threadpool, view.xWindow(), view.yWindow(), 128,
         [&](size_t x0, size_t x1, size_t y0, size_t y1) {
         ImageView subview = view;
@@ -185,23 +343,25 @@ double Technique::_commit_images(ImageView& view) {
         double local_epsilon = 0.0f;
 
         for (size_t y = subview.yBegin(); y < subview.yEnd(); ++y) {
-            dvec4* dst_begin = subview.data() + y * subview.width() + subview.xBegin();
-            dvec4* dst_end = dst_begin + subview.xWindow();
-            dvec3* light_itr = _light_image.data() + y * subview.width() + subview.xBegin();
-            dvec3* eye_itr = _eye_image.data() + y * subview.width() + subview.xBegin();
+            vec3* frame_itr = _frame_image.data() + y * subview.width() + subview.xBegin();
 
-            for (dvec4* dst_itr = dst_begin; dst_itr < dst_end; ++dst_itr) {
-                dvec4 new_dst = *dst_itr + dvec4(*light_itr + *eye_itr, 1.0f);
+            for (auto&& splat : splats) {
+                vec3* splat_begin = splat + y * subview.width() + subview.xBegin();
+                vec3* splat_end = splat_begin + subview.xWindow();
 
-                dvec3 delta = new_dst.rgb() / new_dst.a - dst_itr->rgb() / dst_itr->a;
-                local_epsilon += l1Norm(delta * delta);
+                for (vec3* splat_itr = splat_begin; splat_itr < splat_end; ++splat_itr) {
+                    frame_itr[splat_itr - splat_begin] += *splat_itr;
+                    *splat_itr = vec3(0.0f);
+                }
+            }
 
-                *dst_itr = new_dst;
+            for (size_t x = subview.xBegin(); x < subview.xEnd(); ++x) {
+                if (_is_active(view, x, y)) {
+                    local_epsilon += _commit_pixel(view, x, y, dvec3(*frame_itr));
+                }
 
-                *light_itr = dvec3(0.0f);
-                *eye_itr = dvec3(0.0f);
-                ++light_itr;
-                ++eye_itr;
+                *frame_itr = vec3(0.0f);
+                ++frame_itr;
             }
         }
 
@@ -212,6 +372,157 @@ double Technique::_commit_images(ImageView& view) {
     return sqrt(epsilon / (view.width() * view.height()));
 }
 
+double Technique::_commit_pixel(ImageView& view, size_t x, size_t y, const dvec3& sample) {
+    dvec4& dst = view.absAt(x, y);
+    dvec4 new_dst = dst + dvec4(sample, 1.0f);
+
+    dvec3 delta = new_dst.rgb() / new_dst.a - dst.rgb() / dst.a;
+    dst = new_dst;
+
+    if (!_moment_image.empty()) {
+        double luminance = dot(sample, dvec3(0.2126, 0.7152, 0.0722));
+        _moment_image[y * view.width() + x] += luminance * luminance;
+    }
+
+    return l1Norm(delta * delta);
+}
+
+void Technique::_add_sample(ImageView& view, size_t x, size_t y, vec3 radiance, double& epsilon) {
+    if (_frame_image.empty()) {
+        epsilon += _commit_pixel(view, x, y, dvec3(radiance));
+    }
+    else {
+        _frame_image[y * view.width() + x] += radiance;
+    }
+}
+
+void Technique::_add_feature(
+    const ImageView& view,
+    size_t x,
+    size_t y,
+    const render_context_t& context,
+    const SurfacePoint& surface) {
+    if (_feature_image.empty()) {
+        return;
+    }
+
+    feature_sum_t& sum = _feature_image[y * view.width() + x];
+    sum.count += 1.0f;
+
+    if (surface.is_present()) {
+        sum.albedo += _scene->queryBSDF(surface).albedo();
+        sum.normal += surface.normal();
+        sum.depth += distance(context.camera_position, surface.position());
+    }
+}
+
+unittest() {
+    // Error of the estimate after 1M samples committed to the view, compared
+    // to the mean of the exact double samples. The samples are rounded to
+    // float as in _frame_image, the sums of the view are double, so the
+    // relative error stays within a few 1e-11, while a float accumulator
+    // drifts by about 1e-4.
+    struct commit_test_t : public Technique {
+        commit_test_t(threadpool_t& threadpool) : Technique(nullptr, threadpool) { }
+        string name() const override { return "commit test"; }
+        using Technique::_commit_pixel;
+    };
+
+    threadpool_t threadpool(0);
+    commit_test_t technique(threadpool);
+
+    vector<dvec4> data(2, dvec4(0.0));
+    ImageView view(data.data(), 2, 1);
+
+    std::mt19937 engine(1);
+    std::exponential_distribution<double> distribution(0.1);
+
+    const size_t num_samples = 1000000;
+    double exact = 0.0;
+    float naive = 0.0f;
+
+    for (size_t i = 0; i < num_samples; ++i) {
+        double sample = distribution(engine);
+        technique._commit_pixel(view, 1, 0, dvec3(vec3(float(sample))));
+        exact += sample;
+        naive += float(sample);
+    }
+
+    const double mean = exact / num_samples;
+    const dvec4& pixel = view.absAt(1, 0);
+
+    assert_true(pixel.a == double(num_samples));
+    assert_true(std::abs(pixel.r / pixel.a - mean) / mean < 5e-11);
+    assert_true(std::abs(naive / num_samples - mean) / mean > 1e-5);
+}
+
+bool Technique::_is_active(const ImageView& view, size_t x, size_t y) const {
+    size_t col = (x - view.xBegin()) / _tile_size;
+    size_t row = (y - view.yBegin()) / _tile_size;
+    return _active_tiles[row * _num_tile_cols + col] != 0;
+}
+
+void Technique::_update_active_tiles(const ImageView& view) {
+    size_t num_tiles = _active_tiles.size();
+
+    if (_moment_image.empty() || _splats()) {
+        _active_tiles.assign(num_tiles, 1);
+        _metadata.num_active_tiles = num_tiles;
+        _metadata.num_tiles = num_tiles;
+        return;
+    }
+
+    const dvec3 weights = dvec3(0.2126, 0.7152, 0.0722);
+    std::atomic<size_t> num_active(0);
+
+    exec1d(_threadpool, num_tiles, 1, [&](size_t begin, size_t end) {
+        for (size_t tile = begin; tile < end; ++tile) {
+            size_t xBegin = view.xBegin() + tile % _num_tile_cols * _tile_size;
+            size_t yBegin = view.yBegin() + tile / _num_tile_cols * _tile_size;
+            size_t xEnd = std::min(xBegin + _tile_size, view.xEnd());
+            size_t yEnd = std::min(yBegin + _tile_size, view.yEnd());
+
+            double sum_mean = 0.0;
+            double sum_variance = 0.0;
+            double min_samples = INFINITY;
+
+            for (size_t y = yBegin; y < yEnd; ++y) {
+                for (size_t x = xBegin; x < xEnd; ++x) {
+                    const dvec4& pixel = view.absAt(x, y);
+                    double n = pixel.a;
+                    double mean = dot(pixel.rgb(), weights) / n;
+                    double moment = _moment_image[y * view.width() + x] / n;
+
+                    // The variance of the pixel estimate, not of the samples.
+                    sum_mean += mean;
+                    sum_variance += n > 1.0 ? max(0.0, moment - mean * mean) / (n - 1.0) : INFINITY;
+                    min_samples = std::min(min_samples, n);
+                }
+            }
+
+            double num_pixels = double((xEnd - xBegin) * (yEnd - yBegin));
+            double error = sqrt(sum_variance / num_pixels) / (sum_mean / num_pixels + 1e-4);
+
+            bool active = min_samples < _adaptive_min_samples || error > _adaptive_threshold;
+            _active_tiles[tile] = active;
+
+            if (active) {
+                ++num_active;
+            }
+        }
+    });
+
+    if (num_active == 0) {
+        _adaptive_threshold *= 0.5;
+        _active_tiles.assign(num_tiles, 1);
+        num_active = num_tiles;
+    }
+
+    _metadata.num_active_tiles = num_active;
+    _metadata.num_tiles = num_tiles;
+    _metadata.adaptive_threshold = _adaptive_threshold;
+}
+
 vec3 Technique::_accumulate(
         render_context_t& context,
         vec3 direction,
@@ -234,8 +545,24 @@ vec3 Technique::_accumulate(
         int width = int(context.resolution.x);
 
         vec3 result = callback(closure);
-        std::unique_lock<std::mutex> lock(_light_mutex);
-        _light_image[iposition.y * width + iposition.x] += result;
+        size_t index = iposition.y * width + iposition.x;
+        auto& buffer = _splat_buffers[_threadpool.thread_index()];
+
+        if (_atomic_splats) {
+            atomic_add(_frame_image[index].x, result.x);
+            atomic_add(_frame_image[index].y, result.y);
+            atomic_add(_frame_image[index].z, result.z);
+        }
+        else {
+            if (buffer.image.empty()) {
+                buffer.image.resize(_frame_image.size(), vec3(0.0f));
+            }
+
+            buffer.image[index] += result;
+            buffer.dirty = true;
+        }
+
+        ++buffer.num_splats;
 
         return vec3(0.0f, 0.0f, 0.0f);
     }
@@ -269,23 +596,84 @@ void Technique::_for_each_ray(
         return { context.camera_position, context.view_to_world_mat3 * direction };
     };
 
+    const size_t num_rays = size_t(xEnd - xBegin) * size_t(yEnd - yBegin);
+
+    arena_t& arena = _arenas.local();
+    arena_scope_t scope(arena);
+
+    arena_vector_t<ivec2> pixels(&arena);
+    arena_vector_t<vec3> origins(&arena);
+    arena_vector_t<vec3> directions(&arena);
+    pixels.reserve(num_rays);
+    origins.reserve(num_rays);
+    directions.reserve(num_rays);
+
+    // Every pixel has its own stream, the first two dimensions jitter the
+    // primary ray, the path starts at the block of the first eye vertex.
+    auto stream = [&](int x, int y) {
+        return uint64_t(y) * view.width() + uint64_t(x);
+    };
+
+    auto push = [&](int x, int y) {
+        context.generator->seek(stream(x, y), context.sample_index);
+        const Ray ray = shoot(float(x), float(y));
+        pixels.push_back(ivec2(x, y));
+        origins.push_back(ray.origin);
+        directions.push_back(ray.direction);
+    };
+
     for (int y = yBegin; y < yEnd; ++y) {
         for (int x = xBegin; x < xEnd; ++x) {
-            const Ray ray = shoot(float(x), float(y));
-            context.pixel_position = vec2(x, y);
-            _eye_image[y * view.width() + x] += _traceEye(context, ray);
+            push(x, y);
         }
 
         ++y;
 
         if (y < yEnd) {
             for (int x = rXBegin; x > rXEnd; --x) {
-                const Ray ray = shoot(float(x), float(y));
-                context.pixel_position = vec2(x, y);
-                _eye_image[y * view.width() + x] += _traceEye(context, ray);
+                push(x, y);
             }
         }
     }
+
+    arena_vector_t<SurfacePoint> primary(num_rays, SurfacePoint(), &arena);
+
+    double primary_time = high_resolution_time();
+
+    if (_packets) {
+        _scene->intersect_n(primary.data(), origins.data(), directions.data(), num_rays);
+    }
+    else {
+        SurfacePoint camera = _camera_surface(context);
+
+        for (size_t i = 0; i < num_rays; ++i) {
+            primary[i] = _scene->intersect(camera, directions[i]);
+        }
+    }
+
+    primary_time = high_resolution_time() - primary_time;
+
+    {
+        std::unique_lock<std::mutex> lock(_metadata_mutex);
+        _metadata.num_primary_rays += num_rays;
+        _metadata.primary_time += primary_time;
+    }
+
+    double epsilon = 0.0;
+
+    for (size_t i = 0; i < num_rays; ++i) {
+        const Ray ray = { origins[i], directions[i] };
+        context.pixel_position = vec2(pixels[i]);
+        context.primary = &primary[i];
+        context.generator->seek(stream(pixels[i].x, pixels[i].y), context.sample_index, eye_dimension(0));
+        _add_feature(view, pixels[i].x, pixels[i].y, context, primary[i]);
+        _add_sample(view, pixels[i].x, pixels[i].y, _traceEye(context, ray), epsilon);
+    }
+
+    context.primary = nullptr;
+
+    std::unique_lock<std::mutex> lock(_light_mutex);
+    _epsilon += epsilon;
 }
 
 }
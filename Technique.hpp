@@ -6,6 +6,9 @@
 #include <ImageView.hpp>
 #include <Scene.hpp>
 #include <threadpool.hpp>
+#include <arena.hpp>
+#include <checkpoint.hpp>
+#include <roulette.hpp>
 #include <mutex>
 
 namespace haste {
@@ -21,12 +24,14 @@ struct render_context_t {
     int32_t camera_id;
 
     RandomEngine* generator;
+    uint32_t sample_index = 0;
     vec2 pixel_position;
+    const SurfacePoint* primary = nullptr;
 };
 
 class Technique {
 public:
-    Technique(const shared<const Scene>& scene, size_t num_threads);
+    Technique(const shared<const Scene>& scene, threadpool_t& threadpool);
     virtual ~Technique();
 
     virtual double render(
@@ -38,26 +43,111 @@ public:
 
     const metadata_t& metadata() const;
     double frame_time() const;
+
+    void set_packets(bool packets);
+    void set_pipeline(bool pipeline);
+    void set_adaptive(double threshold);
+    void set_features(bool features);
+    void set_adaptive_roulette(bool adaptive_roulette);
+
+    // Averages of the first-hit features of every pixel, empty unless
+    // enabled with set_features.
+    void features(const ImageView& view, vector<feature_t>& result) const;
+
+    // The technique's part of a checkpoint: the metadata and the state of
+    // adaptive sampling. The accumulated image belongs to the caller.
+    void save(checkpoint_t& checkpoint) const;
+    void restore(const checkpoint_t& checkpoint);
 protected:
     double _previous_frame_time = NAN;
     double _rendering_start_time = NAN;
     double _frame_time = NAN;
     metadata_t _metadata;
     shared<const Scene> _scene;
-    std::vector<dvec3> _eye_image;
-    std::vector<dvec3> _light_image;
+
+    // The samples are accumulated in the double precision view. Techniques
+    // that don't splat add every sample to the view straight from the tile
+    // that traced it. The others gather the eye and the light contributions
+    // of a pass in _frame_image, which is flushed to the view in
+    // _commit_images. A sample is the sum of a few float terms, so it is
+    // rounded to a relative error of about 2^-24 per term, and since the
+    // running sums are double, the error of the estimate doesn't grow with
+    // the number of samples (see the unittest in Technique.cpp).
+    std::vector<vec3> _frame_image;
+    size_t _view_size = 0;
+    double _epsilon = 0.0;
+
+    // Adaptive sampling. The sums of the squared luminances of the samples
+    // give the variance of every pixel, a tile is skipped once its relative
+    // error drops below the threshold. When all the tiles are below it, the
+    // threshold is halved. Techniques that splat light paths to the film
+    // need every pixel in every pass, for them it stays uniform.
+    static const size_t _tile_size = 32;
+    static const size_t _adaptive_min_samples = 16;
+    double _adaptive_threshold = 0.0;
+    std::vector<double> _moment_image;
+    std::vector<char> _active_tiles;
+    size_t _num_tile_cols = 0;
+    size_t _num_tile_rows = 0;
+    // Sums of the first-hit features and their number per pixel. A pixel is
+    // only written by the tile that owns it, so no locking is needed.
+    struct feature_sum_t {
+        vec3 albedo = vec3(0.0f);
+        vec3 normal = vec3(0.0f);
+        float depth = 0.0f;
+        float count = 0.0f;
+    };
+
+    bool _features = false;
+    std::vector<feature_sum_t> _feature_image;
+
+    // Estimates of the image for the adaptive roulette and splitting of the
+    // eye paths, updated after every pass.
+    roulette_t _adaptive_roulette;
+
     std::mutex _light_mutex;
+    std::mutex _metadata_mutex;
+    bool _packets = true;
+    bool _pipeline = true;
+    std::atomic<size_t> _num_culled_rays;
+    std::atomic<size_t> _num_gathered;
+    size_t _num_restored_splats = 0;
+
+    // Every thread splats the light tracing contributions to its own buffer,
+    // the buffers are summed into _frame_image in _commit_images. If the
+    // buffers don't fit in the budget, the splats are added to _frame_image
+    // atomically instead.
+    struct splat_buffer_t {
+        std::vector<vec3> image;
+        size_t num_splats = 0;
+        bool dirty = false;
+        char padding[64];
+    };
+
+    std::vector<splat_buffer_t> _splat_buffers;
+    bool _atomic_splats = false;
+
+    threadpool_t& _threadpool;
+    tile_scheduler_t _tile_scheduler;
 
-    threadpool_t _threadpool;
+    // Temporaries of the render loop, reset at the start of every frame.
+    thread_arenas_t _arenas;
 
     virtual vec3 _traceEye(render_context_t& context, Ray ray);
+    virtual bool _splats() const;
     virtual void _preprocess(RandomEngine& engine, double num_samples);
     static SurfacePoint _camera_surface(render_context_t& context);
     static vec3 _camera_direction(render_context_t& context);
+    SurfacePoint _intersect_primary(render_context_t& context, const Ray& ray) const;
 
     void _adjust_helper_image(ImageView& view);
     void _trace_paths(ImageView& view, render_context_t& context, size_t cameraId);
     double _commit_images(ImageView& view);
+    double _commit_pixel(ImageView& view, size_t x, size_t y, const dvec3& sample);
+    void _add_sample(ImageView& view, size_t x, size_t y, vec3 radiance, double& epsilon);
+    void _add_feature(const ImageView& view, size_t x, size_t y, const render_context_t& context, const SurfacePoint& surface);
+    void _update_active_tiles(const ImageView& view);
+    bool _is_active(const ImageView& view, size_t x, size_t y) const;
 
     template <class F>
     vec3 _accumulate(
@@ -77,7 +167,7 @@ protected:
         void* closure,
         vec3 (*)(void*));
 
-    void _for_each_ray(
+    virtual void _for_each_ray(
         ImageView& view,
         render_context_t& context);
 
@@ -14,8 +14,8 @@ UPGBase<Beta, Mode>::UPGBase(
     float radius,
     float alpha,
     float beta,
-    size_t num_threads)
-    : Technique(scene, num_threads)
+    threadpool_t& threadpool)
+    : Technique(scene, threadpool)
     , _num_photons(numPhotons)
     , _enable_vc(enable_vc)
     , _enable_vm(enable_vm)
@@ -26,7 +26,8 @@ UPGBase<Beta, Mode>::UPGBase(
     , _num_scattered(0)
     , _num_scattered_inv(0.0f)
     , _radius(radius)
-    , _circle(pi<float>() * radius * radius) {
+    , _circle(pi<float>() * radius * radius)
+    , _scatter_arenas(_threadpool) {
     _metadata.num_photons = _num_photons;
     _metadata.roulette = _roulette;
     _metadata.radius = _radius;
@@ -34,11 +35,26 @@ UPGBase<Beta, Mode>::UPGBase(
     _metadata.beta = beta;
 }
 
+template <class Beta, GatherMode Mode>
+UPGBase<Beta, Mode>::~UPGBase() {
+    // The pass is dropped, so is its error.
+    try {
+        _next_future.wait();
+    }
+    catch (...) {
+    }
+}
+
 template <class Beta, GatherMode Mode>
 string UPGBase<Beta, Mode>::name() const {
     return Mode == GatherMode::Unbiased ? "Unbiased Photon Gathering" : "Vertex Connection and Merging";
 }
 
+template <class Beta, GatherMode Mode>
+bool UPGBase<Beta, Mode>::_splats() const {
+    return true;
+}
+
 template <class Beta, GatherMode Mode>
 vec3 UPGBase<Beta, Mode>::_traceEye(render_context_t& context, Ray ray) {
     time_scope_t _0(_metadata.trace_eye_time);
@@ -52,7 +68,9 @@ vec3 UPGBase<Beta, Mode>::_traceEye(render_context_t& context, Ray ray) {
 
     if (_enable_vc) {
         time_scope_t _1(_metadata.trace_light_time);
+        uint32_t dimension = context.generator->dimension();
         _traceLight(*context.generator, light_path);
+        context.generator->seek_dimension(dimension);
     }
 
     EyeVertex eye[2];
@@ -67,7 +85,10 @@ vec3 UPGBase<Beta, Mode>::_traceEye(render_context_t& context, Ray ray) {
     eye[prv].d = 0;
     eye[prv].D = 0;
 
+    // The photons merged at the camera count as gathered, so their time
+    // counts as gather time too.
     if (_enable_vm) {
+        time_scope_t _(_metadata.gather_time);
         radiance += _gather_eye(context, eye[prv]);
     }
 
@@ -75,7 +96,7 @@ vec3 UPGBase<Beta, Mode>::_traceEye(render_context_t& context, Ray ray) {
         radiance += _connect_eye(context, eye[prv], light_path);
     }
 
-    SurfacePoint surface = _scene->intersect(eye[prv].surface, ray.direction);
+    SurfacePoint surface = _intersect_primary(context, ray);
 
     while (surface.is_light()) {
         radiance += eye[prv].throughput * _lights * _scene->queryRadiance(surface, -ray.direction);
@@ -105,9 +126,16 @@ vec3 UPGBase<Beta, Mode>::_traceEye(render_context_t& context, Ray ray) {
 
     std::swap(itr, prv);
 
+    size_t vertex = 0;
+
     while (true) {
+        uint32_t dimension = eye_dimension(++vertex);
+
+        // The gather draws a varying number of samples, it takes them from
+        // the pseudo-random part of the block.
         if (_enable_vm) {
             time_scope_t _2(_metadata.gather_time);
+            context.generator->seek_dimension(dimension + num_ld_dimensions);
             radiance += _gather(*context.generator, eye[prv]);
         }
 
@@ -115,6 +143,8 @@ vec3 UPGBase<Beta, Mode>::_traceEye(render_context_t& context, Ray ray) {
             radiance += _connect(eye[prv], light_path);
         }
 
+        context.generator->seek_dimension(dimension);
+
         auto bsdf = _scene->sampleBSDF(*context.generator, eye[prv].surface, eye[prv].omega);
 
         while (true) {
@@ -174,11 +204,13 @@ vec3 UPGBase<Beta, Mode>::_traceEye(render_context_t& context, Ray ray) {
 
         std::swap(itr, prv);
 
-        if (_russian_roulette(*context.generator)) {
+        float survival = _russian_roulette(context, eye[prv].throughput);
+
+        if (survival == 0.0f) {
             return radiance;
         }
 
-        eye[prv].throughput /= _roulette;
+        eye[prv].throughput /= survival;
     }
 
     return radiance;
@@ -186,19 +218,63 @@ vec3 UPGBase<Beta, Mode>::_traceEye(render_context_t& context, Ray ray) {
 
 template <class Beta, GatherMode Mode>
 void UPGBase<Beta, Mode>::_preprocess(random_generator_t& generator, double num_samples) {
-    time_scope_t _0(_metadata.scatter_time);
+    photon_map_t& map = _next_map;
 
-    if (Mode == GatherMode::Biased) {
-        _radius = _initial_radius * pow((num_samples + 1.0f), _alpha * 0.5f - 0.5f);
+    // The time the trace waits for the photons of the pass. Without the
+    // pipeline it is the whole scatter time, with it only the part the
+    // trace of the previous pass didn't hide.
+    double wait_time = high_resolution_time();
+
+    if (_next_future.valid()) {
+        _next_future.wait();
+    }
+    else {
+        _scatter(generator, _pass_radius(num_samples), map);
     }
 
-    _scatter(generator);
+    _metadata.scatter_wait_time += high_resolution_time() - wait_time;
+
+    // The grids are swapped rather than moved, so both keep their memory.
+    _vertices.swap(map.vertices);
+    _num_scattered = map.num_scattered;
+    _num_scattered_inv = 1.0f / float(_num_scattered);
+    _radius = map.radius;
+
+    _metadata.num_scattered += map.num_scattered;
+    _metadata.photon_size = sizeof(LightVertex) + sizeof(vec3);
+    _metadata.scatter_time += map.scatter_time;
+    _metadata.build_time += map.build_time;
+    _metadata.pipeline = _pipeline;
+
+    // The next pass is scattered during the gather of this one, its
+    // scatter and build times overlap with the trace eye time.
+    if (_pipeline) {
+        float radius = _pass_radius(num_samples + 1.0);
+        _next_generator = generator.clone();
+
+        _next_future = async(_threadpool, [this, radius] {
+            _scatter(_next_generator, radius, _next_map);
+        });
+    }
+}
+
+template <class Beta, GatherMode Mode>
+float UPGBase<Beta, Mode>::_pass_radius(double num_samples) const {
+    if (Mode == GatherMode::Biased) {
+        return _initial_radius * pow((num_samples + 1.0f), _alpha * 0.5f - 0.5f);
+    }
+    else {
+        return _initial_radius;
+    }
 }
 
 template <class Beta, GatherMode Mode> template <bool First, class Appender>
 void UPGBase<Beta, Mode>::_traceLight(random_generator_t& generator, Appender& path) {
     size_t begin = path.size();
     size_t itr = path.size() + 1, prv = path.size();
+    size_t vertex = 0;
+
+    generator.seek_dimension(light_dimension(vertex));
 
     if (_russian_roulette(generator)) {
         return;
@@ -206,9 +282,18 @@ void UPGBase<Beta, Mode>::_traceLight(random_generator_t& generator, Appender& p
 
     LightSample light = _scene->sampleLight(generator);
 
+    // None of the lights emits.
+    if (light.areaDensity() == 0.0f) {
+        return;
+    }
+
+    // The vertices keep a compact copy of the surface, the full one is kept
+    // aside so the path is extended without the quantization error.
+    SurfacePoint current = light.surface;
+
     path.emplace_back();
-    path[prv].surface = light.surface;
-    path[prv].omega = path[prv].surface.normal();
+    path[prv].surface = current;
+    path[prv].omega = current.normal();
     path[prv].throughput = light.radiance() / light.areaDensity() / _roulette;
     path[prv].specular = 0.0f;
     path[prv].a = 1.0f / Beta::beta(light.areaDensity());
@@ -216,10 +301,16 @@ void UPGBase<Beta, Mode>::_traceLight(random_generator_t& generator, Appender& p
     path[prv].b = 0.0f;
     path[prv].B = 0.0f;
 
-    while (!_russian_roulette(generator)) {
-        auto bsdf = _scene->sampleBSDF(generator, path[prv].surface, path[prv].omega);
+    while (true) {
+        generator.seek_dimension(light_dimension(++vertex));
+
+        if (_russian_roulette(generator)) {
+            break;
+        }
+
+        auto bsdf = _scene->sampleBSDF(generator, current, path[prv].omega);
 
-        auto surface = _scene->intersectMesh(path[prv].surface, bsdf.omega);
+        auto surface = _scene->intersectMesh(current, bsdf.omega);
 
         if (!surface.is_present()) {
             break;
@@ -269,6 +360,7 @@ void UPGBase<Beta, Mode>::_traceLight(random_generator_t& generator, Appender& p
             * path[itr].b;
 
         path[itr].bGeometry = edge.bGeometry;
+        current = surface;
 
         if (bsdf.specular == 1.0f) {
             path[prv] = path[itr];
@@ -282,7 +374,7 @@ void UPGBase<Beta, Mode>::_traceLight(random_generator_t& generator, Appender& p
 
     auto bsdf = _scene->sampleBSDF(
         generator,
-        path[prv].surface,
+        current,
         path[prv].omega);
 
     if (bsdf.specular == 1.0f) {
@@ -298,8 +390,8 @@ void UPGBase<Beta, Mode>::_traceLight(random_generator_t& generator, Appender& p
 template <class Beta, GatherMode Mode>
 void UPGBase<Beta, Mode>::_traceLight(
     random_generator_t& generator,
-    vector<LightVertex>& path) {
-    _traceLight<false, vector<LightVertex>>(generator, path);
+    arena_vector_t<LightVertex>& path) {
+    _traceLight<false, arena_vector_t<LightVertex>>(generator, path);
 }
 
 template <class Beta, GatherMode Mode>
@@ -400,40 +492,75 @@ vec3 UPGBase<Beta, Mode>::_connect_light(const EyeVertex& eye) {
 
 template <class Beta, GatherMode Mode> template <bool SkipDirectVM>
 vec3 UPGBase<Beta, Mode>::_connect(const LightVertex& light, const EyeVertex& eye) {
-    vec3 omega = normalize(eye.surface.position() - light.surface.position());
+    float weight;
+    SurfacePoint light_surface = light.surface.expand();
+    vec3 throughput = _connect_unoccluded<SkipDirectVM>(light, light_surface, eye, weight);
+
+    return _combine(_scene->occluded(eye.surface, light_surface) * throughput, weight);
+}
 
-    auto lightBSDF = _scene->queryBSDF(light.surface, light.omega, omega);
+template <class Beta, GatherMode Mode> template <bool SkipDirectVM>
+vec3 UPGBase<Beta, Mode>::_connect_unoccluded(
+    const LightVertex& light,
+    const SurfacePoint& light_surface,
+    const EyeVertex& eye,
+    float& weight) {
+    vec3 omega = normalize(eye.surface.position() - light_surface.position());
+
+    auto lightBSDF = _scene->queryBSDF(light_surface, light.omega, omega);
     auto eyeBSDF = _scene->queryBSDF(eye.surface, -omega, eye.omega);
 
     auto edge = Edge(light, eye, omega);
 
-    auto weight = _weightVC<SkipDirectVM>(light, lightBSDF, eye, eyeBSDF, edge);
-
-    vec3 radiance = _combine(
-        _scene->occluded(eye.surface, light.surface)
-            * light.throughput
-            * lightBSDF.throughput
-            * eye.throughput
-            * eyeBSDF.throughput
-            * edge.bCosTheta
-            * edge.fGeometry,
-        weight);
+    weight = _weightVC<SkipDirectVM>(light, lightBSDF, eye, eyeBSDF, edge);
 
-    return radiance;
+    return light.throughput
+        * lightBSDF.throughput
+        * eye.throughput
+        * eyeBSDF.throughput
+        * edge.bCosTheta
+        * edge.fGeometry;
 }
 
 template <class Beta, GatherMode Mode>
 vec3 UPGBase<Beta, Mode>::_connect(
     const EyeVertex& eye,
     const light_path_t& path) {
-    vec3 radiance = vec3(0.0f);
+    // The visibility is either 0 or 1, so scaling the unoccluded contribution
+    // by it afterwards gives exactly the same result as the scalar version.
+    fixed_vector<SurfacePoint, _maxSubpath> origins;
+    fixed_vector<SurfacePoint, _maxSubpath> targets;
+    fixed_vector<vec3, _maxSubpath> throughputs;
+    fixed_vector<float, _maxSubpath> weights;
+    size_t num_culled_rays = 0;
+
+    for (size_t i = 0; i < path.size(); ++i) {
+        float weight;
+        SurfacePoint light_surface = path[i].surface.expand();
+        vec3 throughput = i == 0
+            ? _connect_unoccluded<true>(path[i], light_surface, eye, weight)
+            : _connect_unoccluded<false>(path[i], light_surface, eye, weight);
+
+        if (l1Norm(throughput) < FLT_EPSILON) {
+            ++num_culled_rays;
+            continue;
+        }
 
-    if (path.size() != 0) {
-        radiance += _connect<true>(path[0], eye);
+        origins.push_back(eye.surface);
+        targets.push_back(light_surface);
+        throughputs.push_back(throughput);
+        weights.push_back(weight);
     }
 
-    for (size_t i = 1; i < path.size(); ++i) {
-        radiance += _connect<false>(path[i], eye);
+    _num_culled_rays += num_culled_rays;
+
+    float visibility[_maxSubpath];
+    _scene->occluded_n(visibility, origins.data(), targets.data(), throughputs.size());
+
+    vec3 radiance = vec3(0.0f);
+
+    for (size_t i = 0; i < throughputs.size(); ++i) {
+        radiance += _combine(visibility[i] * throughputs[i], weights[i]);
     }
 
     return radiance;
@@ -453,7 +580,7 @@ vec3 UPGBase<Beta, Mode>::_connect_eye(
             context,
             omega,
             [&] {
-                float correct_normal = abs(dot(omega, path[i].surface.gnormal)
+                float correct_normal = abs(dot(omega, path[i].surface.gnormal())
                     / dot(omega, path[i].surface.normal()));
 
                 vec3 camera = eye.surface.toSurface(omega);
@@ -482,10 +609,12 @@ vec3 UPGBase<Beta, Mode>::_gather_eye(
     }
 
     vec3 radiance = vec3(0.0f);
+    size_t num_gathered = 0;
 
     _vertices.rQuery(
         [&](const LightVertex& light) {
             time_scope_t _(_metadata.merge_time);
+            ++num_gathered;
 
             vec3 omega = normalize(light.surface.position() - eye.surface.position());
 
@@ -493,7 +622,7 @@ vec3 UPGBase<Beta, Mode>::_gather_eye(
             context,
             omega,
             [&] {
-                float correct_normal = abs(dot(omega, light.surface.gnormal)
+                float correct_normal = abs(dot(omega, light.surface.gnormal())
                     / dot(omega, light.surface.normal()));
 
                 if (Mode == GatherMode::Unbiased) {
@@ -514,24 +643,41 @@ vec3 UPGBase<Beta, Mode>::_gather_eye(
         surface.position(),
         _radius);
 
+    _num_gathered += num_gathered;
+
     return radiance;
 }
 
 template <class Beta, GatherMode Mode>
-void UPGBase<Beta, Mode>::_scatter(random_generator_t& generator) {
-    _num_scattered = 0;
+void UPGBase<Beta, Mode>::_scatter(
+    random_generator_t& generator,
+    float radius,
+    photon_map_t& map) {
+    double start = high_resolution_time();
+
+    map.radius = radius;
+
+    // The previous pass is done, its paths were copied into the grid.
+    _scatter_arenas.reset();
 
     std::atomic<size_t> total_num_scattered(0);
+    std::mutex generator_mutex;
 
-    vector<LightVertex> vertices = generate<LightVertex>(_threadpool, _num_photons,
-        [this, &total_num_scattered, &generator](size_t num_photons) {
+    auto vertices = generate_segments<LightVertex, arena_allocator_t<LightVertex>>(
+        _threadpool, _num_photons,
+        [this, &total_num_scattered, &generator, &generator_mutex](size_t num_photons) {
+        std::unique_lock<std::mutex> lock(generator_mutex);
         auto local_generator = generator.clone();
+        lock.unlock();
 
         size_t num_scattered = 0;
 
-        vector<LightVertex> vertices;
+        arena_vector_t<LightVertex> vertices(&_scatter_arenas.local());
+        vertices.reserve(num_photons + _maxSubpath);
 
         while (vertices.size() < num_photons) {
+            // Every light path has its own stream of the task's generator.
+            local_generator.seek(num_scattered, 0);
             _traceLight(local_generator, vertices);
             ++num_scattered;
         }
@@ -541,13 +687,14 @@ void UPGBase<Beta, Mode>::_scatter(random_generator_t& generator) {
         return vertices;
     });
 
-    _num_scattered = total_num_scattered;
-    _num_scattered_inv = 1.0f / float(_num_scattered);
+    map.num_scattered = total_num_scattered;
 
-    _metadata.num_scattered += total_num_scattered;
+    {
+        time_scope_t _1(map.build_time);
+        map.vertices.rebuild(vertices, radius);
+    }
 
-    time_scope_t _(_metadata.build_time);
-    _vertices = v3::HashGrid3D<LightVertex>(move(vertices), _radius);
+    map.scatter_time = high_resolution_time() - start;
 }
 
 template <class Beta, GatherMode Mode>
@@ -565,10 +712,12 @@ vec3 UPGBase<Beta, Mode>::_gather(random_generator_t& generator, const EyeVertex
     }
 
     vec3 radiance = vec3(0.0f);
+    size_t num_gathered = 0;
 
     _vertices.rQuery(
         [&](const LightVertex& light) {
             time_scope_t _(_metadata.merge_time);
+            ++num_gathered;
 
             if (Mode == GatherMode::Unbiased) {
                 radiance += _merge(generator, light, eye) * _num_scattered_inv;
@@ -584,6 +733,8 @@ vec3 UPGBase<Beta, Mode>::_gather(random_generator_t& generator, const EyeVertex
         surface.position(),
         _radius);
 
+    _num_gathered += num_gathered;
+
     return radiance;
 }
 
@@ -592,14 +743,15 @@ vec3 UPGBase<Beta, Mode>::_merge(
     random_generator_t& generator,
     const LightVertex& light,
     const EyeVertex& eye) {
-    vec3 omega = normalize(eye.surface.position() - light.surface.position());
+    SurfacePoint light_surface = light.surface.expand();
+    vec3 omega = normalize(eye.surface.position() - light_surface.position());
 
-    auto lightBSDF = _scene->queryBSDF(light.surface, light.omega, omega);
+    auto lightBSDF = _scene->queryBSDF(light_surface, light.omega, omega);
     auto eyeBSDF = _scene->queryBSDF(eye.surface, -omega, eye.omega);
 
     auto edge = Edge(light, eye, omega);
 
-    vec3 result = _scene->occluded(eye.surface, light.surface)
+    vec3 result = _scene->occluded(eye.surface, light_surface)
         * light.throughput
         * lightBSDF.throughput
         * eye.throughput
@@ -625,16 +777,17 @@ vec3 UPGBase<Beta, Mode>::_merge(
     const LightVertex& light,
     const EyeVertex& eye,
     const BSDFQuery& eyeBSDF) {
-    vec3 omega = normalize(eye.surface.position() - light.surface.position());
+    SurfacePoint light_surface = light.surface.expand();
+    vec3 omega = normalize(eye.surface.position() - light_surface.position());
 
-    auto lightBSDF = _scene->queryBSDF(light.surface, light.omega, omega);
+    auto lightBSDF = _scene->queryBSDF(light_surface, light.omega, omega);
 
     auto edge = Edge(light, eye, omega);
 
     auto weight = _weightVM(light, lightBSDF, eye, eyeBSDF, edge);
     auto density = 1.0f / (eyeBSDF.densityRev * _circle);
 
-    vec3 result = _scene->occluded(light.surface, eye.surface)
+    vec3 result = _scene->occluded(light_surface, eye.surface)
         * light.throughput
         * lightBSDF.throughput
         * eye.throughput
@@ -654,6 +807,16 @@ bool UPGBase<Beta, Mode>::_russian_roulette(random_generator_t& generator) const
     return _roulette < generator.sample();
 }
 
+template <class Beta, GatherMode Mode>
+float UPGBase<Beta, Mode>::_russian_roulette(render_context_t& context, vec3 throughput) const {
+    // The eye subpath doesn't branch, it is only killed, never split.
+    float probability = min(
+        _adaptive_roulette.expected(throughput, context.pixel_position, _roulette),
+        1.0f);
+
+    return context.generator->sample() < probability ? probability : 0.0f;
+}
+
 UPGb::UPGb(
     const shared<const Scene>& scene,
     bool enable_vc,
@@ -664,7 +827,7 @@ UPGb::UPGb(
     float radius,
     float alpha,
     float beta,
-    size_t num_threads)
+    threadpool_t& threadpool)
     : UPGBase<VariableBeta, GatherMode::Unbiased>(
         scene,
         enable_vc,
@@ -675,7 +838,7 @@ UPGb::UPGb(
         radius,
         alpha,
         beta,
-        num_threads) {
+        threadpool) {
     VariableBeta::init(beta);
 }
 
@@ -694,7 +857,7 @@ VCMb::VCMb(
     float radius,
     float alpha,
     float beta,
-    size_t num_threads)
+    threadpool_t& threadpool)
     : UPGBase<VariableBeta, GatherMode::Biased>(
         scene,
         enable_vc,
@@ -705,7 +868,7 @@ VCMb::VCMb(
         radius,
         alpha,
         beta,
-        num_threads) {
+        threadpool) {
     VariableBeta::init(beta);
 }
 
@@ -25,13 +25,15 @@ public:
         float radius,
         float alpha,
         float beta,
-        size_t numThreads);
+        threadpool_t& threadpool);
+
+    ~UPGBase();
 
     string name() const override;
 
 private:
     struct LightVertex {
-        SurfacePoint surface;
+        CompactSurfacePoint surface;
         vec3 omega;
         vec3 throughput;
         float specular;
@@ -55,11 +57,12 @@ private:
     using light_path_t = fixed_vector<LightVertex, _maxSubpath>;
 
     vec3 _traceEye(render_context_t& context, Ray ray) override;
+    bool _splats() const override;
     void _preprocess(random_generator_t& generator, double num_samples) override;
 
     template <bool First, class Appender>
     void _traceLight(random_generator_t& generator, Appender& path);
-    void _traceLight(random_generator_t& generator, vector<LightVertex>& path);
+    void _traceLight(random_generator_t& generator, arena_vector_t<LightVertex>& path);
     void _traceLight(
         random_generator_t& generator,
         light_path_t& path);
@@ -90,6 +93,13 @@ private:
     template <bool SkipDirectVM>
     vec3 _connect(const LightVertex& light, const EyeVertex& eye);
 
+    template <bool SkipDirectVM>
+    vec3 _connect_unoccluded(
+        const LightVertex& light,
+        const SurfacePoint& light_surface,
+        const EyeVertex& eye,
+        float& weight);
+
     vec3 _connect(
         const EyeVertex& eye,
         const light_path_t& path);
@@ -97,7 +107,18 @@ private:
     vec3 _connect_eye(render_context_t& context, const EyeVertex& eye, const light_path_t& path);
     vec3 _gather_eye(render_context_t& context, const EyeVertex& eye);
 
-    void _scatter(random_generator_t& generator);
+    // The photons of a single pass. With pipelining the next one is scattered
+    // while the current one is gathered from.
+    struct photon_map_t {
+        v3::HashGrid3D<LightVertex> vertices;
+        size_t num_scattered = 0;
+        float radius = 0.0f;
+        double scatter_time = 0.0;
+        double build_time = 0.0;
+    };
+
+    float _pass_radius(double num_samples) const;
+    void _scatter(random_generator_t& generator, float radius, photon_map_t& map);
 
     vec3 _gather(random_generator_t& generator, const EyeVertex& eye);
 
@@ -116,6 +137,10 @@ private:
 
     bool _russian_roulette(random_generator_t& generator) const;
 
+    // Roulette of the eye subpaths, adaptive if enabled. The probability
+    // of survival, zero if the path is killed.
+    float _russian_roulette(render_context_t& context, vec3 throughput) const;
+
     const size_t _num_photons;
     const bool _enable_vc;
     const bool _enable_vm;
@@ -130,6 +155,11 @@ private:
     float _circle;
 
     v3::HashGrid3D<LightVertex> _vertices;
+
+    photon_map_t _next_map;
+    future_t _next_future;
+    random_generator_t _next_generator;
+    thread_arenas_t _scatter_arenas;
 };
 
 using UPG0 = UPGBase<FixedBeta<0>, GatherMode::Unbiased>;
@@ -148,7 +178,7 @@ public:
         float radius,
         float alpha,
         float beta,
-        size_t numThreads);
+        threadpool_t& threadpool);
 };
 
 using VCM0 = UPGBase<FixedBeta<0>, GatherMode::Biased>;
@@ -167,7 +197,7 @@ public:
         float radius,
         float alpha,
         float beta,
-        size_t numThreads);
+        threadpool_t& threadpool);
 };
 
 
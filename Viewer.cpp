@@ -5,7 +5,7 @@
 namespace haste {
 
 Viewer::Viewer(const vector<dvec4>& data, size_t width, size_t height)
-    : Technique(nullptr, 1) {
+    : Technique(nullptr, shared_threadpool()) {
     _data = data;
     _width = width;
     _height = height;
@@ -0,0 +1,299 @@
+#include <algorithm>
+#include <Edge.hpp>
+#include <WPT.hpp>
+
+namespace haste {
+
+WavefrontPathTracing::WavefrontPathTracing(const shared<const Scene>& scene,
+                                           float lights, float roulette,
+                                           float beta, size_t max_path,
+                                           threadpool_t& threadpool)
+    : Technique(scene, threadpool),
+      _max_path(max_path),
+      _lights(lights),
+      _roulette(roulette),
+      _beta(beta),
+      _queues(threadpool.num_threads() + 1) {
+  _metadata.roulette = roulette;
+  _metadata.beta = beta;
+}
+
+string WavefrontPathTracing::name() const {
+  return "Wavefront Path Tracing";
+}
+
+void WavefrontPathTracing::queue_t::resize(size_t size) {
+  pixels.resize(size);
+  generators.resize(size);
+  radiance.assign(size, vec3(0.0f));
+  eyes.resize(size);
+  origins.resize(size);
+  bsdfs.resize(size);
+  path_sizes.assign(size, 0);
+  passing.assign(size, false);
+  alive.assign(size, false);
+
+  live.clear();
+  live.reserve(size);
+
+  contributions.resize(size);
+  shadow_origins.resize(size);
+  shadow_targets.resize(size);
+  shadow_slots.resize(size);
+  visibility.resize(size);
+
+  extend_origins.resize(size);
+  extend_directions.resize(size);
+  hits.resize(size);
+}
+
+void WavefrontPathTracing::_for_each_ray(ImageView& view,
+                                         render_context_t& context) {
+  queue_t& queue = _queues[_threadpool.thread_index()];
+
+  _generate(view, context, queue);
+
+  while (!queue.live.empty()) {
+    _shade(context, queue);
+    _connect(queue);
+    _extend(queue);
+    _advance(context, queue);
+    _compact(queue);
+  }
+
+  double epsilon = 0.0;
+
+  for (size_t i = 0; i < queue.pixels.size(); ++i) {
+    _add_sample(view, queue.pixels[i].x, queue.pixels[i].y, queue.radiance[i],
+                epsilon);
+  }
+
+  std::unique_lock<std::mutex> lock(_light_mutex);
+  _epsilon += epsilon;
+}
+
+void WavefrontPathTracing::_generate(ImageView& view,
+                                     render_context_t& context,
+                                     queue_t& queue) {
+  const int xBegin = int(view.xBegin());
+  const int xEnd = int(view.xEnd());
+  const int yBegin = int(view.yBegin());
+  const int yEnd = int(view.yEnd());
+
+  runtime_assert(0 <= xBegin && xEnd <= (int)view.width());
+  runtime_assert(0 <= yBegin && yEnd <= (int)view.height());
+
+  queue.resize(size_t(xEnd - xBegin) * size_t(yEnd - yBegin));
+
+  size_t slot = 0;
+
+  for (int y = yBegin; y < yEnd; ++y) {
+    for (int x = xBegin; x < xEnd; ++x) {
+      // The same streams as in Technique::_for_each_ray.
+      random_generator_t& generator = queue.generators[slot];
+      generator = random_generator_t(context.generator->seed(),
+                                     context.generator->sequence());
+      generator.seek(uint64_t(y) * view.width() + uint64_t(x),
+                     context.sample_index);
+
+      vec2 position = vec2(float(x) + generator.sample(),
+                           float(y) + generator.sample());
+
+      vec3 direction =
+          ray_direction(position, context.resolution,
+                        context.resolution_y_inv, context.focal_length_y);
+
+      queue.pixels[slot] = ivec2(x, y);
+      queue.extend_origins[slot] = context.camera_position;
+      queue.extend_directions[slot] = context.view_to_world_mat3 * direction;
+      ++slot;
+    }
+  }
+
+  double primary_time = high_resolution_time();
+
+  _scene->intersect_n(queue.hits.data(), queue.extend_origins.data(),
+                      queue.extend_directions.data(), slot);
+
+  primary_time = high_resolution_time() - primary_time;
+
+  {
+    std::unique_lock<std::mutex> lock(_metadata_mutex);
+    _metadata.num_primary_rays += slot;
+    _metadata.primary_time += primary_time;
+  }
+
+  for (size_t i = 0; i < slot; ++i) {
+    const vec3 direction = queue.extend_directions[i];
+    SurfacePoint surface = queue.hits[i];
+
+    _add_feature(view, queue.pixels[i].x, queue.pixels[i].y, context, surface);
+
+    while (surface.is_light() && _max_path > 0) {
+      queue.radiance[i] += _lights * _scene->queryRadiance(surface, -direction);
+      surface = _scene->intersect(surface, direction);
+    }
+
+    if (!surface.is_present() || _max_path < 2) {
+      continue;
+    }
+
+    EyeVertex& eye = queue.eyes[i];
+    eye.surface = surface;
+    eye.omega = -direction;
+    eye.throughput = vec3(1.0f);
+    eye.specular = 0.0f;
+    eye.density = 1.0f;
+
+    queue.path_sizes[i] = 2;
+    queue.alive[i] = true;
+    queue.live.push_back(uint32_t(i));
+  }
+
+  _compact(queue);
+}
+
+void WavefrontPathTracing::_shade(render_context_t& context, queue_t& queue) {
+  size_t& num_shadow_rays = queue.num_shadow_rays;
+  num_shadow_rays = 0;
+
+  for (uint32_t slot : queue.live) {
+    if (queue.passing[slot]) {
+      continue;
+    }
+
+    const EyeVertex& eye = queue.eyes[slot];
+
+    random_generator_t& generator = queue.generators[slot];
+    generator.seek_dimension(eye_dimension(queue.path_sizes[slot] - 2));
+    LightSample light = _scene->sampleLight(generator, eye.surface);
+    vec3 omega = normalize(eye.surface.position() - light.position());
+
+    if (light.areaDensity() != 0.0f && 0.0f <= dot(omega, light.normal())) {
+      auto eyeBSDF = _scene->queryBSDF(eye.surface, -omega, eye.omega);
+
+      auto edge = Edge(light, eye, omega);
+
+      float weightInv = pow(eyeBSDF.densityRev * edge.bGeometry, _beta) /
+                            pow(light.areaDensity(), _beta) +
+                        1.0f;
+
+      queue.contributions[num_shadow_rays] =
+          light.radiance() / light.areaDensity() * eye.throughput *
+          eyeBSDF.throughput * edge.bCosTheta * edge.fGeometry / weightInv;
+      queue.shadow_origins[num_shadow_rays] = eye.surface;
+      queue.shadow_targets[num_shadow_rays] = light.surface;
+      queue.shadow_slots[num_shadow_rays] = slot;
+      ++num_shadow_rays;
+    }
+
+    queue.bsdfs[slot] =
+        _scene->sampleBSDF(generator, eye.surface, eye.omega);
+    queue.origins[slot] = eye.surface;
+  }
+}
+
+void WavefrontPathTracing::_connect(queue_t& queue) {
+  const size_t num_shadow_rays = queue.num_shadow_rays;
+
+  _scene->occluded_n(queue.visibility.data(), queue.shadow_origins.data(),
+                     queue.shadow_targets.data(), num_shadow_rays);
+
+  for (size_t i = 0; i < num_shadow_rays; ++i) {
+    queue.radiance[queue.shadow_slots[i]] +=
+        queue.visibility[i] * queue.contributions[i];
+  }
+}
+
+void WavefrontPathTracing::_extend(queue_t& queue) {
+  const size_t num_rays = queue.live.size();
+
+  for (size_t i = 0; i < num_rays; ++i) {
+    uint32_t slot = queue.live[i];
+    queue.extend_origins[i] = queue.origins[slot].position();
+    queue.extend_directions[i] = queue.bsdfs[slot].omega;
+  }
+
+  _scene->intersect_n(queue.hits.data(), queue.extend_origins.data(),
+                      queue.extend_directions.data(), num_rays);
+}
+
+void WavefrontPathTracing::_advance(render_context_t& context,
+                                   queue_t& queue) {
+  for (size_t i = 0; i < queue.live.size(); ++i) {
+    const uint32_t slot = queue.live[i];
+    const SurfacePoint& surface = queue.hits[i];
+    const BSDFSample& bsdf = queue.bsdfs[slot];
+    EyeVertex& prv = queue.eyes[slot];
+
+    if (!surface.is_present()) {
+      queue.alive[slot] = false;
+      continue;
+    }
+
+    EyeVertex itr;
+    itr.surface = surface;
+    itr.omega = -bsdf.omega;
+
+    auto edge = Edge(prv, itr);
+
+    itr.throughput = prv.throughput * bsdf.throughput * edge.bCosTheta;
+
+    if (l1Norm(itr.throughput) < FLT_EPSILON) {
+      queue.alive[slot] = false;
+      continue;
+    }
+
+    itr.throughput /= bsdf.density;
+    itr.specular = 0.0f;
+
+    prv.specular = bsdf.specular;
+    itr.density = prv.density * edge.fGeometry * bsdf.density;
+
+    if (surface.is_light()) {
+      auto lsdf = _scene->queryLSDF(itr.surface, itr.omega, prv.surface);
+      float weightInv = pow(lsdf.density, _beta) /
+                            pow(edge.fGeometry * bsdf.density, _beta) +
+                        1.0f;
+
+      if (bsdf.specular == 1.0f) weightInv = 1.0f;
+
+      queue.radiance[slot] += lsdf.radiance * itr.throughput / weightInv;
+
+      // Continue through the light in the same direction without shading.
+      queue.passing[slot] = true;
+      queue.origins[slot] = surface;
+      continue;
+    }
+
+    queue.passing[slot] = false;
+    prv = itr;
+
+    float roulette =
+        queue.path_sizes[slot] < _min_subpath ? 1.0f : _roulette;
+    float uniform = queue.generators[slot].sample();
+
+    if (roulette < uniform || _max_path < queue.path_sizes[slot] + 1) {
+      queue.alive[slot] = false;
+    } else {
+      prv.throughput /= roulette;
+      ++queue.path_sizes[slot];
+    }
+  }
+}
+
+void WavefrontPathTracing::_compact(queue_t& queue) {
+  auto end = std::remove_if(queue.live.begin(), queue.live.end(),
+                            [&](uint32_t slot) { return !queue.alive[slot]; });
+
+  queue.live.erase(end, queue.live.end());
+
+  // Group the paths by material, so the shading stage runs the same BSDF
+  // code for long runs of consecutive paths.
+  std::stable_sort(queue.live.begin(), queue.live.end(),
+                   [&](uint32_t a, uint32_t b) {
+                     return queue.eyes[a].surface.materialId() <
+                            queue.eyes[b].surface.materialId();
+                   });
+}
+}
@@ -0,0 +1,71 @@
+#pragma once
+#include <Technique.hpp>
+
+namespace haste {
+
+class WavefrontPathTracing : public Technique {
+ public:
+  WavefrontPathTracing(const shared<const Scene>& scene, float lights,
+                       float roulette, float beta, size_t max_path,
+                       threadpool_t& threadpool);
+
+  string name() const override;
+
+ private:
+  struct EyeVertex {
+    SurfacePoint surface;
+    vec3 omega;
+    vec3 throughput;
+    float specular;
+    float density;
+  };
+
+  // Paths of a single tile in structure of arrays layout. The arrays are
+  // indexed by path slot, `live` holds the slots of paths still in flight.
+  struct queue_t {
+    vector<ivec2> pixels;
+    vector<random_generator_t> generators;
+    vector<vec3> radiance;
+    vector<EyeVertex> eyes;
+    vector<SurfacePoint> origins;
+    vector<BSDFSample> bsdfs;
+    vector<size_t> path_sizes;
+    vector<bool> passing;
+    vector<bool> alive;
+
+    vector<uint32_t> live;
+
+    vector<vec3> contributions;
+    vector<SurfacePoint> shadow_origins;
+    vector<SurfacePoint> shadow_targets;
+    vector<uint32_t> shadow_slots;
+    vector<float> visibility;
+    size_t num_shadow_rays = 0;
+
+    vector<vec3> extend_origins;
+    vector<vec3> extend_directions;
+    vector<SurfacePoint> hits;
+
+    void resize(size_t size);
+  };
+
+  void _for_each_ray(ImageView& view, render_context_t& context) override;
+
+  void _generate(ImageView& view, render_context_t& context, queue_t& queue);
+  void _shade(render_context_t& context, queue_t& queue);
+  void _connect(queue_t& queue);
+  void _extend(queue_t& queue);
+  void _advance(render_context_t& context, queue_t& queue);
+  void _compact(queue_t& queue);
+
+  const size_t _min_subpath = 3;
+  const size_t _max_path;
+  const float _lights;
+  const float _roulette;
+  const float _beta;
+
+  // A queue for every worker of the pool and one for the thread outside of
+  // it, the arrays keep their capacity from tile to tile.
+  vector<queue_t> _queues;
+};
+}
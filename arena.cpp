@@ -0,0 +1,190 @@
+#include <arena.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <unittest>
+
+#ifdef HASTE_COUNT_ALLOCATIONS
+// Diagnostic builds count every allocation of the process. The array and
+// the sized forms end up here too. The operators aren't inlined, GCC would
+// take the malloc and free in them for mismatched with new and delete.
+__attribute__((noinline)) void* operator new(std::size_t size) {
+  haste::count_allocation();
+
+  if (void* result = std::malloc(size == 0 ? 1 : size)) {
+    return result;
+  }
+
+  throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void* operator new(
+    std::size_t size, const std::nothrow_t&) noexcept {
+  haste::count_allocation();
+  return std::malloc(size == 0 ? 1 : size);
+}
+
+__attribute__((noinline)) void operator delete(void* pointer) noexcept {
+  std::free(pointer);
+}
+
+__attribute__((noinline)) void operator delete(
+    void* pointer, const std::nothrow_t&) noexcept {
+  std::free(pointer);
+}
+#endif
+
+namespace haste {
+
+static std::atomic<size_t> global_num_allocations(0);
+
+arena_t::arena_t(size_t block_size) : _block_size(block_size) {}
+
+arena_t::~arena_t() {
+  for (auto&& block : _blocks) {
+    std::free(block.data);
+  }
+}
+
+void* arena_t::allocate(size_t size, size_t alignment) {
+  while (_block < _blocks.size()) {
+    block_t& block = _blocks[_block];
+    size_t address = size_t(block.data) + _offset;
+    size_t padding = (alignment - address % alignment) % alignment;
+
+    if (_offset + padding + size <= block.size) {
+      void* result = block.data + _offset + padding;
+      _offset += padding + size;
+      return result;
+    }
+
+    ++_block;
+    _offset = 0;
+  }
+
+  _add_block(std::max(_block_size, size + alignment));
+  _block = _blocks.size() - 1;
+  _offset = 0;
+
+  return allocate(size, alignment);
+}
+
+arena_t::mark_t arena_t::mark() const { return {_block, _offset}; }
+
+void arena_t::rewind(mark_t mark) {
+  _block = mark.block;
+  _offset = mark.offset;
+}
+
+void arena_t::reset() {
+  // Merge the blocks, so the next frame fits in a single one.
+  if (_blocks.size() > 1) {
+    size_t size = capacity();
+
+    for (auto&& block : _blocks) {
+      std::free(block.data);
+    }
+
+    _blocks.clear();
+    _block_size = std::max(_block_size, size);
+    _add_block(_block_size);
+  }
+
+  _block = 0;
+  _offset = 0;
+}
+
+void arena_t::_add_block(size_t size) {
+  block_t block;
+  block.size = size;
+  block.data = static_cast<char*>(std::malloc(block.size));
+
+  if (block.data == nullptr) {
+    throw std::bad_alloc();
+  }
+
+  count_allocation();
+  _blocks.push_back(block);
+}
+
+size_t arena_t::capacity() const {
+  size_t result = 0;
+
+  for (auto&& block : _blocks) {
+    result += block.size;
+  }
+
+  return result;
+}
+
+thread_arenas_t::thread_arenas_t(threadpool_t& pool) : _pool(pool) {
+  for (size_t i = 0; i < pool.num_threads() + 1; ++i) {
+    _arenas.emplace_back(new arena_t());
+  }
+}
+
+arena_t& thread_arenas_t::local() { return *_arenas[_pool.thread_index()]; }
+
+void thread_arenas_t::reset() {
+  for (auto&& arena : _arenas) {
+    arena->reset();
+  }
+}
+
+unittest() {
+  arena_t arena(64);
+
+  auto mark = arena.mark();
+  char* a = static_cast<char*>(arena.allocate(3, 1));
+  double* b = static_cast<double*>(arena.allocate(sizeof(double), alignof(double)));
+
+  assert_true(size_t(b) % alignof(double) == 0);
+  assert_true(a != (char*)b);
+
+  arena.allocate(256, 16);
+  assert_true(arena.capacity() > 256);
+
+  arena.rewind(mark);
+  assert_true(arena.allocate(3, 1) == a);
+
+  // The blocks are merged into one, which holds the same allocations again
+  // without calling malloc.
+  size_t capacity = arena.capacity();
+  arena.reset();
+  assert_true(arena.capacity() == capacity);
+
+  size_t num_allocations = haste::num_allocations();
+  arena.allocate(3, 1);
+  arena.allocate(sizeof(double), alignof(double));
+  arena.allocate(256, 16);
+  assert_true(arena.capacity() == capacity);
+  assert_true(haste::num_allocations() == num_allocations);
+
+#ifdef HASTE_COUNT_ALLOCATIONS
+  // The containers are counted too.
+  std::unique_ptr<std::vector<int>> vector(new std::vector<int>(16));
+  assert_true(haste::num_allocations() == num_allocations + 2);
+#endif
+}
+
+size_t thread_arenas_t::capacity() const {
+  size_t result = 0;
+
+  for (auto&& arena : _arenas) {
+    result += arena->capacity();
+  }
+
+  return result;
+}
+
+size_t num_allocations() {
+  return global_num_allocations.load(std::memory_order_relaxed);
+}
+
+void count_allocation() {
+#ifdef HASTE_COUNT_ALLOCATIONS
+  global_num_allocations.fetch_add(1, std::memory_order_relaxed);
+#endif
+}
+}
@@ -0,0 +1,121 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+#include <vector>
+#include <threadpool.hpp>
+
+namespace haste {
+
+// Monotonic allocator, the memory is released all at once by reset or
+// rewind. The memory is kept, reset replaces the blocks with a single one
+// of their total size, so once the arena has grown to the size of a frame
+// it stops calling malloc.
+class arena_t {
+ public:
+  struct mark_t {
+    size_t block;
+    size_t offset;
+  };
+
+  arena_t(size_t block_size = size_t(1) << 20);
+  arena_t(const arena_t&) = delete;
+  ~arena_t();
+
+  arena_t& operator=(const arena_t&) = delete;
+
+  void* allocate(size_t size, size_t alignment);
+
+  mark_t mark() const;
+  void rewind(mark_t mark);
+  void reset();
+
+  size_t capacity() const;
+
+ private:
+  struct block_t {
+    char* data;
+    size_t size;
+  };
+
+  void _add_block(size_t size);
+
+  std::vector<block_t> _blocks;
+  size_t _block = 0;
+  size_t _offset = 0;
+  size_t _block_size;
+};
+
+// Rewinds the arena to where it was at the construction, for temporaries
+// that don't outlive a scope (e.g. a tile).
+class arena_scope_t {
+ public:
+  arena_scope_t(arena_t& arena) : _arena(arena), _mark(arena.mark()) {}
+  ~arena_scope_t() { _arena.rewind(_mark); }
+
+  arena_scope_t(const arena_scope_t&) = delete;
+  arena_scope_t& operator=(const arena_scope_t&) = delete;
+
+ private:
+  arena_t& _arena;
+  arena_t::mark_t _mark;
+};
+
+template <class T>
+struct arena_allocator_t {
+  using value_type = T;
+  using propagate_on_container_copy_assignment = std::true_type;
+  using propagate_on_container_move_assignment = std::true_type;
+  using propagate_on_container_swap = std::true_type;
+
+  arena_allocator_t() = default;
+  arena_allocator_t(arena_t* arena) : arena(arena) {}
+
+  template <class U>
+  arena_allocator_t(const arena_allocator_t<U>& that) : arena(that.arena) {}
+
+  T* allocate(size_t n) {
+    return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T)));
+  }
+
+  void deallocate(T*, size_t) {}
+
+  arena_t* arena = nullptr;
+};
+
+template <class T, class U>
+bool operator==(const arena_allocator_t<T>& a, const arena_allocator_t<U>& b) {
+  return a.arena == b.arena;
+}
+
+template <class T, class U>
+bool operator!=(const arena_allocator_t<T>& a, const arena_allocator_t<U>& b) {
+  return a.arena != b.arena;
+}
+
+template <class T>
+using arena_vector_t = std::vector<T, arena_allocator_t<T>>;
+
+// One arena for every worker of the pool and one for the thread outside of
+// it. The arenas may be reset only when no task uses them.
+class thread_arenas_t {
+ public:
+  thread_arenas_t(threadpool_t& pool);
+
+  arena_t& local();
+  void reset();
+
+  size_t capacity() const;
+
+ private:
+  threadpool_t& _pool;
+  std::vector<std::unique_ptr<arena_t>> _arenas;
+};
+
+// Number of the allocations since the start of the process. Only the
+// diagnostic builds with HASTE_COUNT_ALLOCATIONS count them, they replace the
+// global operator new, the direct calls to malloc of the arenas and the data
+// queues are counted by hand. Otherwise it stays zero.
+size_t num_allocations();
+void count_allocation();
+}
@@ -0,0 +1,359 @@
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+
+#include <unittest>
+#include <checkpoint.hpp>
+
+namespace haste {
+
+static const char checkpoint_magic[8] = { 'H', 'A', 'S', 'T', 'E', 'C', 'K', 'P' };
+static const uint32_t checkpoint_version = 3;
+
+class checkpoint_writer_t {
+public:
+    checkpoint_writer_t(std::ostream& stream) : _stream(stream) { }
+
+    template <class T> void operator()(const T& value) {
+        _stream.write((const char*)&value, sizeof(T));
+    }
+
+    void operator()(const string& value) {
+        (*this)(uint64_t(value.size()));
+        _stream.write(value.data(), value.size());
+    }
+
+    template <class T> void operator()(const vector<T>& values) {
+        (*this)(uint64_t(values.size()));
+        _stream.write((const char*)values.data(), values.size() * sizeof(T));
+    }
+
+private:
+    std::ostream& _stream;
+};
+
+class checkpoint_reader_t {
+public:
+    checkpoint_reader_t(std::istream& stream) : _stream(stream) { }
+
+    template <class T> void operator()(T& value) {
+        _read(&value, sizeof(T));
+    }
+
+    void operator()(string& value) {
+        uint64_t size = 0;
+        (*this)(size);
+        value.resize(_checked(size, 1));
+        _read(&value[0], value.size());
+    }
+
+    template <class T> void operator()(vector<T>& values) {
+        uint64_t size = 0;
+        (*this)(size);
+        values.resize(_checked(size, sizeof(T)));
+        _read(values.data(), values.size() * sizeof(T));
+    }
+
+private:
+    std::istream& _stream;
+
+    void _read(void* data, size_t size) {
+        if (!_stream.read((char*)data, size)) {
+            throw std::runtime_error("Truncated checkpoint.");
+        }
+    }
+
+    // Guards the allocation against a corrupted size.
+    size_t _checked(uint64_t size, size_t element_size) {
+        if (size > (uint64_t(1) << 40) / element_size) {
+            throw std::runtime_error("Corrupted checkpoint.");
+        }
+
+        return size_t(size);
+    }
+};
+
+// The same list of fields serves for both directions.
+template <class Transfer, class Checkpoint>
+static void transfer(Transfer& transfer, Checkpoint& checkpoint) {
+    auto& metadata = checkpoint.metadata;
+
+    transfer(checkpoint.width);
+    transfer(checkpoint.height);
+    transfer(checkpoint.image);
+
+    transfer(metadata.technique);
+    transfer(metadata.sampler);
+    transfer(metadata.num_samples);
+    transfer(metadata.num_basic_rays);
+    transfer(metadata.num_shadow_rays);
+    transfer(metadata.num_tentative_rays);
+    transfer(metadata.num_primary_rays);
+    transfer(metadata.num_culled_rays);
+    transfer(metadata.num_photons);
+    transfer(metadata.num_scattered);
+    transfer(metadata.num_gathered);
+    transfer(metadata.num_splats);
+    transfer(metadata.num_allocations);
+    transfer(metadata.num_active_tiles);
+    transfer(metadata.num_tiles);
+    transfer(metadata.photon_size);
+    transfer(metadata.num_threads);
+    transfer(metadata.guiding_memory);
+    transfer(metadata.seed);
+    transfer(metadata.resolution);
+    transfer(metadata.roulette);
+    transfer(metadata.radius);
+    transfer(metadata.alpha);
+    transfer(metadata.beta);
+    transfer(metadata.epsilon);
+    transfer(metadata.adaptive_threshold);
+    transfer(metadata.total_time);
+    transfer(metadata.scatter_time);
+    transfer(metadata.build_time);
+    transfer(metadata.scatter_wait_time);
+    transfer(metadata.gather_time);
+    transfer(metadata.merge_time);
+    transfer(metadata.density_time);
+    transfer(metadata.intersect_time);
+    transfer(metadata.trace_eye_time);
+    transfer(metadata.trace_light_time);
+    transfer(metadata.primary_time);
+    transfer(metadata.packets);
+    transfer(metadata.pipeline);
+    transfer(metadata.average);
+
+    transfer(checkpoint.seed);
+    transfer(checkpoint.sequence);
+    transfer(checkpoint.stream);
+    transfer(checkpoint.sample);
+    transfer(checkpoint.dimension);
+
+    transfer(checkpoint.moments);
+    transfer(checkpoint.adaptive_threshold);
+}
+
+bool save_checkpoint(const string& path, const checkpoint_t& checkpoint) {
+    string temp_path = path + ".tmp";
+
+    {
+        std::ofstream stream(temp_path, std::ios::out | std::ios::binary | std::ios::trunc);
+        checkpoint_writer_t writer(stream);
+
+        stream.write(checkpoint_magic, sizeof(checkpoint_magic));
+        writer(checkpoint_version);
+        transfer(writer, checkpoint);
+
+        if (!stream) {
+            std::remove(temp_path.c_str());
+            return false;
+        }
+    }
+
+    return std::rename(temp_path.c_str(), path.c_str()) == 0;
+}
+
+void load_checkpoint(const string& path, checkpoint_t& checkpoint) {
+    std::ifstream stream(path, std::ios::in | std::ios::binary);
+
+    if (!stream) {
+        throw std::runtime_error("Cannot open checkpoint '" + path + "'.");
+    }
+
+    checkpoint_reader_t reader(stream);
+
+    char magic[sizeof(checkpoint_magic)];
+    uint32_t version = 0;
+    reader(magic);
+    reader(version);
+
+    if (std::memcmp(magic, checkpoint_magic, sizeof(magic)) != 0 ||
+        version != checkpoint_version) {
+        throw std::runtime_error("'" + path + "' is not a checkpoint of this version.");
+    }
+
+    transfer(reader, checkpoint);
+
+    if (checkpoint.image.size() != size_t(checkpoint.width) * checkpoint.height) {
+        throw std::runtime_error("Corrupted checkpoint.");
+    }
+}
+
+namespace {
+
+bool loading_throws(const string& path) {
+    checkpoint_t checkpoint;
+
+    try {
+        load_checkpoint(path, checkpoint);
+    }
+    catch (const std::runtime_error&) {
+        return true;
+    }
+
+    return false;
+}
+
+void write_file(const string& path, const string& content) {
+    std::ofstream stream(path, std::ios::out | std::ios::binary | std::ios::trunc);
+    stream.write(content.data(), content.size());
+}
+
+string read_file(const string& path) {
+    std::ifstream stream(path, std::ios::in | std::ios::binary);
+    return string(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+}
+
+}
+
+unittest() {
+    // Every field comes back as it was saved, none of them at its default.
+    const string path = "haste-unittest.checkpoint";
+
+    checkpoint_t saved;
+    saved.width = 3;
+    saved.height = 2;
+    saved.image.resize(6);
+
+    for (size_t i = 0; i < saved.image.size(); ++i) {
+        saved.image[i] = dvec4(i + 0.5, i * 2.0, 1.0 / (i + 1), i + 1);
+    }
+
+    metadata_t& metadata = saved.metadata;
+    metadata.technique = "UPG";
+    metadata.sampler = "sobol";
+    metadata.num_samples = 1;
+    metadata.num_basic_rays = 2;
+    metadata.num_shadow_rays = 3;
+    metadata.num_tentative_rays = 4;
+    metadata.num_primary_rays = 5;
+    metadata.num_culled_rays = 6;
+    metadata.num_photons = 7;
+    metadata.num_scattered = 8;
+    metadata.num_gathered = 9;
+    metadata.num_splats = 10;
+    metadata.num_allocations = 11;
+    metadata.num_active_tiles = 12;
+    metadata.num_tiles = 13;
+    metadata.photon_size = 14;
+    metadata.num_threads = 15;
+    metadata.guiding_memory = 16;
+    metadata.seed = 17;
+    metadata.resolution = glm::ivec2(3, 2);
+    metadata.roulette = 0.25;
+    metadata.radius = 0.5;
+    metadata.alpha = 0.75;
+    metadata.beta = 1.25;
+    metadata.epsilon = 1.5;
+    metadata.adaptive_threshold = 1.75;
+    metadata.total_time = 2.25;
+    metadata.scatter_time = 2.5;
+    metadata.build_time = 2.75;
+    metadata.scatter_wait_time = 3.25;
+    metadata.gather_time = 3.5;
+    metadata.merge_time = 3.75;
+    metadata.density_time = 4.25;
+    metadata.intersect_time = 4.5;
+    metadata.trace_eye_time = 4.75;
+    metadata.trace_light_time = 5.25;
+    metadata.primary_time = 5.5;
+    metadata.packets = true;
+    metadata.pipeline = true;
+    metadata.average = glm::vec3(0.25f, 0.5f, 0.75f);
+
+    saved.seed = 0x123456789ull;
+    saved.sequence = sequence_t::halton;
+    saved.stream = 99;
+    saved.sample = 1234;
+    saved.dimension = 56;
+
+    // The part Technique::save adds.
+    saved.moments = { 1.0, 2.0, 3.0, 4.0, 5.0, 6.0 };
+    saved.adaptive_threshold = 0.125;
+
+    assert_true(save_checkpoint(path, saved));
+
+    checkpoint_t loaded;
+    load_checkpoint(path, loaded);
+
+    assert_true(loaded.width == saved.width);
+    assert_true(loaded.height == saved.height);
+    assert_true(loaded.image == saved.image);
+
+    const metadata_t& result = loaded.metadata;
+    assert_true(result.technique == metadata.technique);
+    assert_true(result.sampler == metadata.sampler);
+    assert_true(result.num_samples == metadata.num_samples);
+    assert_true(result.num_basic_rays == metadata.num_basic_rays);
+    assert_true(result.num_shadow_rays == metadata.num_shadow_rays);
+    assert_true(result.num_tentative_rays == metadata.num_tentative_rays);
+    assert_true(result.num_primary_rays == metadata.num_primary_rays);
+    assert_true(result.num_culled_rays == metadata.num_culled_rays);
+    assert_true(result.num_photons == metadata.num_photons);
+    assert_true(result.num_scattered == metadata.num_scattered);
+    assert_true(result.num_gathered == metadata.num_gathered);
+    assert_true(result.num_splats == metadata.num_splats);
+    assert_true(result.num_allocations == metadata.num_allocations);
+    assert_true(result.num_active_tiles == metadata.num_active_tiles);
+    assert_true(result.num_tiles == metadata.num_tiles);
+    assert_true(result.photon_size == metadata.photon_size);
+    assert_true(result.num_threads == metadata.num_threads);
+    assert_true(result.guiding_memory == metadata.guiding_memory);
+    assert_true(result.seed == metadata.seed);
+    assert_true(result.resolution == metadata.resolution);
+    assert_true(result.roulette == metadata.roulette);
+    assert_true(result.radius == metadata.radius);
+    assert_true(result.alpha == metadata.alpha);
+    assert_true(result.beta == metadata.beta);
+    assert_true(result.epsilon == metadata.epsilon);
+    assert_true(result.adaptive_threshold == metadata.adaptive_threshold);
+    assert_true(result.total_time == metadata.total_time);
+    assert_true(result.scatter_time == metadata.scatter_time);
+    assert_true(result.build_time == metadata.build_time);
+    assert_true(result.scatter_wait_time == metadata.scatter_wait_time);
+    assert_true(result.gather_time == metadata.gather_time);
+    assert_true(result.merge_time == metadata.merge_time);
+    assert_true(result.density_time == metadata.density_time);
+    assert_true(result.intersect_time == metadata.intersect_time);
+    assert_true(result.trace_eye_time == metadata.trace_eye_time);
+    assert_true(result.trace_light_time == metadata.trace_light_time);
+    assert_true(result.primary_time == metadata.primary_time);
+    assert_true(result.packets == metadata.packets);
+    assert_true(result.pipeline == metadata.pipeline);
+    assert_true(result.average == metadata.average);
+
+    assert_true(loaded.seed == saved.seed);
+    assert_true(loaded.sequence == saved.sequence);
+    assert_true(loaded.stream == saved.stream);
+    assert_true(loaded.sample == saved.sample);
+    assert_true(loaded.dimension == saved.dimension);
+    assert_true(loaded.moments == saved.moments);
+    assert_true(loaded.adaptive_threshold == saved.adaptive_threshold);
+
+    // A file with another magic, another version, or cut short is rejected.
+    const string content = read_file(path);
+    const size_t version_offset = sizeof(checkpoint_magic);
+
+    string wrong_magic = content;
+    wrong_magic[0] = 'X';
+    write_file(path, wrong_magic);
+    assert_true(loading_throws(path));
+
+    string wrong_version = content;
+    uint32_t other_version = checkpoint_version + 1;
+    std::memcpy(&wrong_version[version_offset], &other_version, sizeof(other_version));
+    write_file(path, wrong_version);
+    assert_true(loading_throws(path));
+
+    write_file(path, content.substr(0, content.size() - 5));
+    assert_true(loading_throws(path));
+
+    write_file(path, content);
+    assert_true(!loading_throws(path));
+
+    std::remove(path.c_str());
+}
+
+}
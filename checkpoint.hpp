@@ -0,0 +1,33 @@
+#pragma once
+#include <Sample.hpp>
+#include <utility.hpp>
+
+namespace haste {
+
+// Everything a progressive render needs to continue where it stopped: the
+// raw accumulation buffer (sums of the samples and their counts in alpha),
+// the metadata with all the timers, the state of the generator, and the
+// per-pixel second moments of adaptive sampling.
+struct checkpoint_t {
+    uint32_t width = 0;
+    uint32_t height = 0;
+    vector<dvec4> image;
+    metadata_t metadata;
+
+    uint64_t seed = 0;
+    sequence_t sequence = sequence_t::random;
+    uint64_t stream = 0;
+    uint32_t sample = 0;
+    uint32_t dimension = 0;
+
+    vector<double> moments;
+    double adaptive_threshold = 0.0;
+};
+
+// The checkpoint is written to a temporary file and renamed, so a render
+// killed while saving leaves the previous checkpoint intact. Loading throws
+// if the file is not a checkpoint or is truncated.
+bool save_checkpoint(const string& path, const checkpoint_t& checkpoint);
+void load_checkpoint(const string& path, checkpoint_t& checkpoint);
+
+}
@@ -0,0 +1,189 @@
+#include <denoise.hpp>
+#include <random>
+#include <unittest>
+
+namespace haste {
+
+static const float albedo_epsilon = 0.01f;
+static const float sigma_normal = 128.0f;
+static const float sigma_depth = 0.05f;
+static const float sigma_albedo = 0.1f;
+static const float sigma_luminance = 4.0f;
+
+static float luminance(vec3 color) {
+  return dot(color, vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+void denoise(threadpool_t& pool, size_t width, size_t height,
+             const vec3* color, const feature_t* features, vec3* result,
+             size_t num_iterations) {
+  const size_t size = width * height;
+  const int iwidth = int(width);
+  const int iheight = int(height);
+
+  vector<vec3> albedo(size);
+  vector<vec4> source(size);
+  vector<vec4> target(size);
+
+  // Demodulation, the alpha holds the variance of the luminance.
+  exec1d(pool, height, 1, [&](size_t begin, size_t end) {
+    for (size_t y = begin; y < end; ++y) {
+      for (size_t x = 0; x < width; ++x) {
+        size_t i = y * width + x;
+        albedo[i] = features[i].depth == 0.0f
+                        ? vec3(1.0f)
+                        : max(features[i].albedo, vec3(albedo_epsilon));
+        source[i] = vec4(color[i] / albedo[i], 0.0f);
+      }
+    }
+  });
+
+  // The samples per pixel aren't kept, the variance is estimated from the
+  // 3x3 neighbourhood instead.
+  exec1d(pool, height, 1, [&](size_t begin, size_t end) {
+    for (int y = int(begin); y < int(end); ++y) {
+      for (int x = 0; x < iwidth; ++x) {
+        float sum = 0.0f, sum2 = 0.0f, count = 0.0f;
+
+        for (int v = max(y - 1, 0); v <= min(y + 1, iheight - 1); ++v) {
+          for (int u = max(x - 1, 0); u <= min(x + 1, iwidth - 1); ++u) {
+            float l = luminance(source[v * iwidth + u].rgb());
+            sum += l;
+            sum2 += l * l;
+            count += 1.0f;
+          }
+        }
+
+        float mean = sum / count;
+        target[y * iwidth + x] = vec4(source[y * iwidth + x].rgb(),
+                                      max(sum2 / count - mean * mean, 0.0f));
+      }
+    }
+  });
+
+  std::swap(source, target);
+
+  static const float kernel[5] = {1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f,
+                                  1.0f / 4.0f, 1.0f / 16.0f};
+
+  for (size_t iteration = 0; iteration < num_iterations; ++iteration) {
+    const int step = 1 << iteration;
+
+    exec1d(pool, height, 1, [&](size_t begin, size_t end) {
+      for (int y = int(begin); y < int(end); ++y) {
+        for (int x = 0; x < iwidth; ++x) {
+          const size_t p = y * iwidth + x;
+          const feature_t& fp = features[p];
+          const vec4 cp = source[p];
+          const float lp = luminance(cp.rgb());
+          const float sigma_p = sigma_luminance * sqrt(cp.a) + 1e-6f;
+          const bool hit_p = fp.depth != 0.0f;
+
+          vec3 color_sum = vec3(0.0f);
+          float variance_sum = 0.0f;
+          float weight_sum = 0.0f;
+
+          for (int j = -2; j <= 2; ++j) {
+            int v = y + j * step;
+
+            if (v < 0 || v >= iheight) {
+              continue;
+            }
+
+            for (int i = -2; i <= 2; ++i) {
+              int u = x + i * step;
+
+              if (u < 0 || u >= iwidth) {
+                continue;
+              }
+
+              const size_t q = v * iwidth + u;
+              const feature_t& fq = features[q];
+              const vec4 cq = source[q];
+              const bool hit_q = fq.depth != 0.0f;
+
+              if (hit_p != hit_q) {
+                continue;
+              }
+
+              float weight = kernel[i + 2] * kernel[j + 2];
+
+              if (hit_p) {
+                weight *= pow(max(dot(fp.normal, fq.normal), 0.0f),
+                              sigma_normal);
+                weight *= exp(-abs(fp.depth - fq.depth) /
+                              (sigma_depth * step * fp.depth));
+                vec3 albedo_delta = fp.albedo - fq.albedo;
+                weight *= exp(-dot(albedo_delta, albedo_delta) /
+                              (sigma_albedo * sigma_albedo));
+              }
+
+              weight *= exp(-abs(lp - luminance(cq.rgb())) / sigma_p);
+
+              color_sum += cq.rgb() * weight;
+              variance_sum += cq.a * weight * weight;
+              weight_sum += weight;
+            }
+          }
+
+          // The center always contributes, so the sum isn't zero.
+          target[p] = vec4(color_sum / weight_sum,
+                           variance_sum / (weight_sum * weight_sum));
+        }
+      }
+    });
+
+    std::swap(source, target);
+  }
+
+  exec1d(pool, height, 1, [&](size_t begin, size_t end) {
+    for (size_t i = begin * width; i < end * width; ++i) {
+      result[i] = source[i].rgb() * albedo[i];
+    }
+  });
+}
+
+unittest() {
+  // A gray image with noise and two halves with different normals. The
+  // noise is mostly removed and the edge between the halves is kept.
+  const size_t width = 64, height = 64, size = width * height;
+
+  std::mt19937 engine(1);
+  std::normal_distribution<float> noise(0.0f, 0.2f);
+
+  vector<vec3> color(size), result(size);
+  vector<feature_t> features(size);
+
+  for (size_t y = 0; y < height; ++y) {
+    for (size_t x = 0; x < width; ++x) {
+      size_t i = y * width + x;
+      bool left = x < width / 2;
+      features[i].albedo = vec3(0.5f);
+      features[i].normal = left ? vec3(1.0f, 0.0f, 0.0f) : vec3(0.0f, 1.0f, 0.0f);
+      features[i].depth = 1.0f;
+      color[i] = vec3((left ? 0.25f : 0.75f) + noise(engine));
+    }
+  }
+
+  threadpool_t pool(2);
+  denoise(pool, width, height, color.data(), features.data(), result.data());
+
+  double noisy_error = 0.0, denoised_error = 0.0;
+
+  for (size_t y = 0; y < height; ++y) {
+    for (size_t x = 0; x < width; ++x) {
+      size_t i = y * width + x;
+      float expected = x < width / 2 ? 0.25f : 0.75f;
+      noisy_error += pow(color[i].x - expected, 2.0f);
+      denoised_error += pow(result[i].x - expected, 2.0f);
+    }
+  }
+
+  assert_true(denoised_error * 10.0 < noisy_error);
+
+  size_t row = height / 2 * width;
+  assert_true(abs(result[row + width / 2 - 1].x - 0.25f) < 0.1f);
+  assert_true(abs(result[row + width / 2].x - 0.75f) < 0.1f);
+}
+
+}
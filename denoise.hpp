@@ -0,0 +1,19 @@
+#pragma once
+#include <glm>
+#include <threadpool.hpp>
+#include <utility.hpp>
+
+namespace haste {
+
+// Feature-guided edge-avoiding a-trous filter (Dammertz et al., with the
+// luminance variance guide of SVGF). The color is divided by the albedo, so
+// the textures aren't blurred, and filtered in num_iterations passes of a
+// 5x5 kernel with the step doubled every pass. The weights between two
+// pixels fall off with the difference of their normals, depths, albedos
+// and luminances, the latter relative to the local standard deviation.
+// The rows are filtered in parallel on the pool.
+void denoise(threadpool_t& pool, size_t width, size_t height,
+             const vec3* color, const feature_t* features, vec3* result,
+             size_t num_iterations = 5);
+
+}
@@ -2,6 +2,7 @@
 #include <cstddef>
 #include <iterator>
 #include <memory>
+#include <new>
 
 namespace haste {
 
@@ -51,6 +52,11 @@ class fixed_vector {
     ++_size;
   }
 
+  void push_back(const value_type& value) {
+    new (data() + _size) value_type(value);
+    ++_size;
+  }
+
   void pop_back() {
     --_size;
   }
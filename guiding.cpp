@@ -0,0 +1,363 @@
+#include <guiding.hpp>
+#include <utility.hpp>
+#include <unittest>
+
+namespace haste {
+
+static const float one_over_four_pi = 0.0795774715f;
+
+static vec2 direction_to_square(vec3 direction) {
+  float cos_theta = clamp(direction.z, -1.0f, 1.0f);
+  float phi = atan2(direction.y, direction.x);
+
+  if (phi < 0.0f) {
+    phi += two_pi<float>();
+  }
+
+  return clamp(vec2((cos_theta + 1.0f) * 0.5f, phi * one_over_two_pi<float>()),
+               vec2(0.0f), vec2(1.0f));
+}
+
+static vec3 square_to_direction(vec2 point) {
+  float cos_theta = point.x * 2.0f - 1.0f;
+  float sin_theta = sqrt(max(1.0f - cos_theta * cos_theta, 0.0f));
+  float phi = point.y * two_pi<float>();
+  return vec3(sin_theta * cos(phi), sin_theta * sin(phi), cos_theta);
+}
+
+static float select(float& uniform, float probability) {
+  const float one_minus_epsilon = 1.0f - FLT_EPSILON * 0.5f;
+
+  if (uniform < probability) {
+    uniform = min(uniform / probability, one_minus_epsilon);
+    return 0.0f;
+  } else {
+    uniform = min((uniform - probability) / (1.0f - probability),
+                  one_minus_epsilon);
+    return 1.0f;
+  }
+}
+
+dtree_t::dtree_t() {
+  node_t root = {{0.0f, 0.0f, 0.0f, 0.0f}, {0, 0, 0, 0}};
+  _sampling.push_back(root);
+  _building.push_back(root);
+}
+
+float dtree_t::pdf(vec3 direction) const {
+  if (!(_sampling_total() > 0.0f)) {
+    return one_over_four_pi;
+  }
+
+  vec2 point = direction_to_square(direction);
+  float density = one_over_four_pi;
+  std::uint32_t index = 0;
+
+  while (true) {
+    const node_t& node = _sampling[index];
+    int qx = point.x < 0.5f ? 0 : 1;
+    int qy = point.y < 0.5f ? 0 : 1;
+    int quadrant = qx + qy * 2;
+
+    float total = node.sums[0] + node.sums[1] + node.sums[2] + node.sums[3];
+
+    if (!(total > 0.0f)) {
+      return 0.0f;
+    }
+
+    density *= 4.0f * node.sums[quadrant] / total;
+
+    if (node.children[quadrant] == 0) {
+      return density;
+    }
+
+    index = node.children[quadrant];
+    point = point * 2.0f - vec2(float(qx), float(qy));
+  }
+}
+
+vec3 dtree_t::sample(random_generator_t& generator) const {
+  vec2 uniform = generator.sample<vec2>();
+
+  if (!(_sampling_total() > 0.0f)) {
+    return square_to_direction(uniform);
+  }
+
+  vec2 origin = vec2(0.0f);
+  float size = 1.0f;
+  std::uint32_t index = 0;
+
+  while (true) {
+    const node_t& node = _sampling[index];
+
+    // The column first, then the quadrant in it, both with the rescaled
+    // uniform numbers.
+    float left = node.sums[0] + node.sums[2];
+    float right = node.sums[1] + node.sums[3];
+    float qx = select(uniform.x, left / (left + right));
+
+    float bottom = node.sums[int(qx)];
+    float top = node.sums[int(qx) + 2];
+    float column = bottom + top;
+    float qy = select(uniform.y, column > 0.0f ? bottom / column : 0.5f);
+
+    size *= 0.5f;
+    origin += vec2(qx, qy) * size;
+
+    std::uint32_t child = node.children[int(qx) + int(qy) * 2];
+
+    if (child == 0) {
+      return square_to_direction(origin + uniform * size);
+    }
+
+    index = child;
+  }
+}
+
+void dtree_t::record(vec3 direction, float value) {
+  __atomic_fetch_add(&_num_records, 1, __ATOMIC_RELAXED);
+
+  if (!(value > 0.0f) || !std::isfinite(value)) {
+    return;
+  }
+
+  vec2 point = direction_to_square(direction);
+  std::uint32_t index = 0;
+
+  while (true) {
+    node_t& node = _building[index];
+    int qx = point.x < 0.5f ? 0 : 1;
+    int qy = point.y < 0.5f ? 0 : 1;
+    int quadrant = qx + qy * 2;
+
+    atomic_add(node.sums[quadrant], value);
+
+    if (node.children[quadrant] == 0) {
+      return;
+    }
+
+    index = node.children[quadrant];
+    point = point * 2.0f - vec2(float(qx), float(qy));
+  }
+}
+
+void dtree_t::refine(float threshold, std::size_t max_depth,
+                     std::size_t max_memory) {
+  _sampling.swap(_building);
+  _num_records = 0;
+
+  node_t root = {{0.0f, 0.0f, 0.0f, 0.0f}, {0, 0, 0, 0}};
+  _building.clear();
+  _building.push_back(root);
+
+  const float total = _sampling_total();
+
+  if (!(total > 0.0f)) {
+    return;
+  }
+
+  const std::size_t max_nodes =
+      max_memory / sizeof(node_t) > _sampling.capacity()
+          ? max_memory / sizeof(node_t) - _sampling.capacity()
+          : 1;
+
+  // A quadrant that isn't subdivided in the sampling tree passes a quarter
+  // of its energy to every new child.
+  struct entry_t {
+    std::uint32_t node;
+    std::int64_t source;
+    float sum;
+    std::size_t depth;
+  };
+
+  std::vector<entry_t> stack;
+  stack.push_back({0, 0, total, 1});
+
+  while (!stack.empty()) {
+    entry_t entry = stack.back();
+    stack.pop_back();
+
+    for (int quadrant = 0; quadrant < 4; ++quadrant) {
+      float sum = entry.source < 0 ? entry.sum * 0.25f
+                                   : _sampling[entry.source].sums[quadrant];
+
+      if (entry.depth < max_depth && sum > total * threshold &&
+          _building.size() < max_nodes) {
+        std::uint32_t child = std::uint32_t(_building.size());
+        _building.push_back(root);
+        _building[entry.node].children[quadrant] = child;
+
+        std::int64_t source =
+            entry.source < 0 || _sampling[entry.source].children[quadrant] == 0
+                ? -1
+                : std::int64_t(_sampling[entry.source].children[quadrant]);
+
+        stack.push_back({child, source, sum, entry.depth + 1});
+      }
+    }
+  }
+
+  // The budget bounds the nodes, not the slack left by the growth of the
+  // vector.
+  _building.shrink_to_fit();
+}
+
+std::uint64_t dtree_t::num_records() const { return _num_records; }
+
+void dtree_t::set_num_records(std::uint64_t num_records) {
+  _num_records = num_records;
+}
+
+std::size_t dtree_t::memory() const {
+  return sizeof(dtree_t) +
+         (_sampling.capacity() + _building.capacity()) * sizeof(node_t);
+}
+
+float dtree_t::_sampling_total() const {
+  const node_t& root = _sampling[0];
+  return root.sums[0] + root.sums[1] + root.sums[2] + root.sums[3];
+}
+
+guiding_t::guiding_t(vec3 lower, vec3 upper, std::size_t max_memory)
+    : _lower(lower),
+      _extent_inv(1.0f / max(upper - lower, vec3(FLT_EPSILON))),
+      _max_memory(max_memory) {
+  _nodes.push_back({-1, 0, 0});
+  _dtrees.emplace_back();
+}
+
+dtree_t& guiding_t::lookup(vec3 position) {
+  vec3 point = clamp((position - _lower) * _extent_inv, vec3(0.0f), vec3(1.0f));
+  std::size_t index = 0;
+
+  while (_nodes[index].child >= 0) {
+    const node_t& node = _nodes[index];
+
+    if (point[node.axis] < 0.5f) {
+      point[node.axis] *= 2.0f;
+      index = node.child;
+    } else {
+      point[node.axis] = point[node.axis] * 2.0f - 1.0f;
+      index = node.child + 1;
+    }
+  }
+
+  return _dtrees[_nodes[index].dtree];
+}
+
+void guiding_t::refine(threadpool_t& threadpool) {
+  const double threshold = 12000.0 * sqrt(pow(2.0, double(_iteration)));
+  std::size_t memory = this->memory();
+
+  // The new leaves are visited too, a leaf is split until the halves of
+  // its records fall below the threshold.
+  for (std::size_t i = 0; i < _nodes.size(); ++i) {
+    if (_nodes[i].child >= 0) {
+      continue;
+    }
+
+    std::uint32_t dtree = _nodes[i].dtree;
+    std::uint64_t num_records = _dtrees[dtree].num_records();
+    std::size_t split_memory = _dtrees[dtree].memory() + 2 * sizeof(node_t);
+
+    if (double(num_records) <= threshold ||
+        _max_memory < memory + split_memory) {
+      continue;
+    }
+
+    dtree_t copy = _dtrees[dtree];
+    copy.set_num_records(num_records / 2);
+    _dtrees[dtree].set_num_records(num_records / 2);
+    _dtrees.push_back(std::move(copy));
+
+    std::uint32_t axis = (_nodes[i].axis + 1) % 3;
+    _nodes[i].child = std::int32_t(_nodes.size());
+    _nodes.push_back({-1, axis, dtree});
+    _nodes.push_back({-1, axis, std::uint32_t(_dtrees.size() - 1)});
+
+    memory += split_memory;
+  }
+
+  _nodes.shrink_to_fit();
+  _dtrees.shrink_to_fit();
+
+  // What is left of the budget is shared evenly by the directional trees.
+  std::size_t spatial_memory = _nodes.capacity() * sizeof(node_t);
+  std::size_t dtree_memory =
+      _max_memory > spatial_memory
+          ? (_max_memory - spatial_memory) / _dtrees.size()
+          : 0;
+
+  exec1d(threadpool, _dtrees.size(), 1, [&](std::size_t begin, std::size_t end) {
+    for (std::size_t i = begin; i < end; ++i) {
+      _dtrees[i].refine(0.01f, 20, dtree_memory);
+    }
+  });
+
+  ++_iteration;
+}
+
+std::size_t guiding_t::iteration() const { return _iteration; }
+
+std::size_t guiding_t::memory() const {
+  std::size_t result = _nodes.capacity() * sizeof(node_t) +
+                       (_dtrees.capacity() - _dtrees.size()) * sizeof(dtree_t);
+
+  for (auto&& dtree : _dtrees) {
+    result += dtree.memory();
+  }
+
+  return result;
+}
+
+unittest() {
+  // The radiance comes from a cone around +z. The first iteration learns
+  // the structure, the second one the distribution on it. Then the density
+  // integrates to one, is concentrated in the cone and the sampled
+  // directions follow it.
+  dtree_t dtree;
+  random_generator_t generator(3);
+  const float cos_cone = 0.9f;
+
+  for (int iteration = 0; iteration < 2; ++iteration) {
+    for (int i = 0; i < 100000; ++i) {
+      vec3 direction = square_to_direction(generator.sample<vec2>());
+      dtree.record(direction, direction.z > cos_cone ? 1.0f : 0.0f);
+    }
+
+    dtree.refine(0.01f, 20, 1 << 20);
+    assert_true(dtree.num_records() == 0);
+  }
+
+  double integral = 0.0, inside = 0.0;
+  const int num_samples = 100000;
+
+  for (int i = 0; i < num_samples; ++i) {
+    vec3 direction = square_to_direction(generator.sample<vec2>());
+    integral += dtree.pdf(direction) * 4.0 * pi<double>() / num_samples;
+
+    vec3 sample = dtree.sample(generator);
+    inside += sample.z > cos_cone - 0.05f ? 1.0 / num_samples : 0.0;
+    assert_true(dtree.pdf(sample) > 0.0f);
+  }
+
+  assert_true(abs(integral - 1.0) < 0.05);
+  assert_true(inside > 0.95);
+  assert_true(dtree.pdf(vec3(0.0f, 0.0f, 1.0f)) > 10.0f * one_over_four_pi);
+
+  // The nodes allocated by the trees, not only the used ones, stay within
+  // the budget.
+  const std::size_t max_memory = 1024;
+  dtree_t small;
+
+  for (int iteration = 0; iteration < 3; ++iteration) {
+    for (int i = 0; i < 10000; ++i) {
+      small.record(square_to_direction(generator.sample<vec2>()), 1.0f);
+    }
+
+    small.refine(0.001f, 20, max_memory);
+    assert_true(small.memory() <= sizeof(dtree_t) + max_memory);
+  }
+}
+
+}
@@ -0,0 +1,81 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include <glm>
+#include <Sample.hpp>
+#include <threadpool.hpp>
+
+namespace haste {
+
+// Directional quadtree of Practical Path Guiding (Müller et al. 2017). The
+// directions are mapped to the unit square by (cos(theta), phi), which
+// preserves the area, and every node splits its square into quadrants with
+// the sums of the incident radiance recorded in them. The sampling tree is
+// the one learned in the previous iteration, it is only read while
+// rendering. The records go to the building tree with atomic additions.
+class dtree_t {
+ public:
+  dtree_t();
+
+  // Density per solid angle of sample, uniform while nothing is learned.
+  float pdf(vec3 direction) const;
+  vec3 sample(random_generator_t& generator) const;
+
+  void record(vec3 direction, float value);
+
+  // The building tree becomes the sampling tree. The new building tree
+  // has its structure refined where the quadrants hold more than the
+  // threshold of the energy, both trees stay within max_memory bytes.
+  void refine(float threshold, std::size_t max_depth, std::size_t max_memory);
+
+  std::uint64_t num_records() const;
+  void set_num_records(std::uint64_t num_records);
+  std::size_t memory() const;
+
+ private:
+  struct node_t {
+    float sums[4];
+    std::uint32_t children[4];
+  };
+
+  std::vector<node_t> _sampling;
+  std::vector<node_t> _building;
+  std::uint64_t _num_records = 0;
+
+  float _sampling_total() const;
+};
+
+// Binary tree over the scene bounds, the axes of the splits alternate. A
+// leaf splits in two once it got more records than sqrt(2^iteration) times
+// the threshold, both halves start with a copy of its directional tree.
+// Neither the spatial nor the directional trees grow beyond the memory
+// budget.
+class guiding_t {
+ public:
+  guiding_t(vec3 lower, vec3 upper, std::size_t max_memory);
+
+  dtree_t& lookup(vec3 position);
+
+  // Ends the current iteration, the directional trees are refined in
+  // parallel.
+  void refine(threadpool_t& threadpool);
+
+  std::size_t iteration() const;
+  std::size_t memory() const;
+
+ private:
+  struct node_t {
+    std::int32_t child;
+    std::uint32_t axis;
+    std::uint32_t dtree;
+  };
+
+  vec3 _lower;
+  vec3 _extent_inv;
+  std::size_t _max_memory;
+  std::size_t _iteration = 0;
+  std::vector<node_t> _nodes;
+  std::vector<dtree_t> _dtrees;
+};
+
+}
@@ -1,3 +1,6 @@
+#include <cfloat>
+#include <cstring>
+#include <unordered_map>
 #include <streamops.hpp>
 #include <runtime_assert>
 #include <assimp/Importer.hpp>
@@ -6,8 +9,10 @@
 
 #include <utility.hpp>
 #include <loader.hpp>
+#include <scene_cache.hpp>
 
 #include <BSDF.hpp>
+#include <threadpool.hpp>
 
 namespace haste {
 
@@ -121,6 +126,24 @@ vec3 toVec3(const aiColor3D& v) {
     return vec3(v.r, v.g, v.b);
 }
 
+mat4 toMat4(const aiMatrix4x4& m) {
+    return mat4(
+        m.a1, m.b1, m.c1, m.d1,
+        m.a2, m.b2, m.c2, m.d2,
+        m.a3, m.b3, m.c3, m.d3,
+        m.a4, m.b4, m.c4, m.d4);
+}
+
+aiMatrix4x4 absoluteTransform(const aiScene* scene, const aiString& name) {
+    aiMatrix4x4 result;
+
+    for (auto node = scene->mRootNode->FindNode(name); node; node = node->mParent) {
+        result = node->mTransformation * result;
+    }
+
+    return result;
+}
+
 string name(const aiMaterial* material) {
     aiString name;
     material->Get(AI_MATKEY_NAME, name);
@@ -286,43 +309,83 @@ bool isEmissive(const aiScene* scene, size_t meshID) {
     return emissive(material) != vec3(0.0f);
 }
 
-AreaLights loadAreaLights(const aiScene* scene, Materials& materials, const bounding_sphere_t& bounding_sphere) {
-    AreaLights result;
-
-    materials.lights_offset = scene->mNumLights + 1;
+vector<light_desc_t> loadAreaLights(const aiScene* scene) {
+    vector<light_desc_t> result;
 
     for (size_t i = 0; i < scene->mNumLights; ++i) {
         if (scene->mLights[i]->mType == aiLightSource_AREA) {
             auto light = scene->mLights[i];
-
-            result.addLight(
-                toString(light->mName),
-                int32_t(materials.bsdfs.size()) - materials.lights_offset,
-                toVec3(light->mPosition),
-                normalize(toVec3(light->mDirection)),
-                normalize(toVec3(light->mUp)),
-                toVec3(light->mColorDiffuse),
-                toVec2(light->mSize));
-
-            materials.names.push_back(toString(light->mName));
-            materials.bsdfs.push_back(result.light(i).create_bsdf(bounding_sphere));
+            auto transform = absoluteTransform(scene, light->mName);
+            auto rotation = aiMatrix3x3(transform);
+
+            light_desc_t desc;
+            desc.name = toString(light->mName);
+            desc.position = toVec3(transform * light->mPosition);
+            desc.direction = normalize(toVec3(rotation * light->mDirection));
+            desc.up = normalize(toVec3(rotation * light->mUp));
+            desc.exitance = toVec3(light->mColorDiffuse);
+            desc.size = toVec2(light->mSize);
+
+            result.push_back(desc);
         }
     }
 
     return result;
 }
 
+material_desc_t aiMaterial_to_desc(const aiMaterial* material) {
+    material_desc_t result;
+    result.name = name(material);
+
+    if (property<bool>(material, "$mat.blend.transparency.use")) {
+        result.type = material_desc_t::Transmission;
+        result.ior = property<float>(material, "$mat.blend.transparency.ior");
+    }
+    else if (property<bool>(material, "$mat.blend.mirror.use")) {
+        result.type = material_desc_t::Reflection;
+    }
+    else if (specular(material) == vec3(0.0f)) {
+        result.type = material_desc_t::Diffuse;
+        result.diffuse = diffuse(material);
+    }
+    else {
+        result.type = material_desc_t::Phong;
+        result.diffuse = diffuse(material);
+        result.specular = specular(material);
+        result.power = shininess(material);
+    }
+
+    return result;
+}
+
+unique<BSDF> create_bsdf(const material_desc_t& desc) {
+    switch (desc.type) {
+        case material_desc_t::Transmission:
+            return unique<BSDF>(new TransmissionBSDF(desc.ior, 1.0f));
+        case material_desc_t::Reflection:
+            return unique<BSDF>(new ReflectionBSDF());
+        case material_desc_t::Diffuse:
+            return unique<BSDF>(new DiffuseBSDF(desc.diffuse));
+        case material_desc_t::Phong:
+            return unique<BSDF>(new PhongBSDF(desc.diffuse, desc.specular, desc.power));
+    }
+
+    throw std::runtime_error("Unknown material type of \"" + desc.name + "\".");
+}
+
 Cameras loadCameras(const aiScene* scene) {
     Cameras cameras;
 
     for (size_t i = 0; i < scene->mNumCameras; ++i) {
         auto camera = scene->mCameras[i];
+        auto transform = absoluteTransform(scene, camera->mName);
+        auto rotation = aiMatrix3x3(transform);
 
         cameras.addCameraFovX(
             toString(camera->mName),
-            toVec3(camera->mPosition),
-            normalize(toVec3(camera->mLookAt)),
-            normalize(toVec3(camera->mUp)),
+            toVec3(transform * camera->mPosition),
+            normalize(toVec3(rotation * camera->mLookAt)),
+            normalize(toVec3(rotation * camera->mUp)),
             camera->mHorizontalFOV * 2.0f,
             camera->mClipPlaneNear,
             camera->mClipPlaneFar);
@@ -331,40 +394,113 @@ Cameras loadCameras(const aiScene* scene) {
     return cameras;
 }
 
-Mesh aiMeshToMesh(const aiMesh* mesh) {
-    runtime_assert(mesh != nullptr);
-    runtime_assert(mesh->mNormals != nullptr);
-    runtime_assert(mesh->mVertices != nullptr);
+struct weld_key_t {
+    vec3 position;
+    vec3 normal;
 
-    Mesh result;
+    bool operator==(const weld_key_t& that) const {
+        return position == that.position && normal == that.normal;
+    }
+};
 
-    if (mesh->mBitangents == nullptr ||
-        mesh->mTangents == nullptr) {
-        result.indices.resize(mesh->mNumFaces * 3);
-        result.tangents.resize(mesh->mNumFaces * 3);
-        result.vertices.resize(mesh->mNumFaces * 3);
+struct weld_key_hash_t {
+    size_t operator()(const weld_key_t& key) const {
+        uint32_t words[6];
+        std::memcpy(words, &key, sizeof(words));
 
-        for (size_t j = 0; j < mesh->mNumFaces; ++j) {
-            runtime_assert(mesh->mFaces[j].mNumIndices == 3);
+        size_t hash = 14695981039346656037ull;
 
-            for (size_t k = 0; k < 3; ++k) {
-                unsigned index = mesh->mFaces[j].mIndices[k];
-                result.indices[j * 3 + k] = j * 3 + k;
-                result.tangents[j * 3 + k][1] = toVec3(mesh->mNormals[index]);
-                result.vertices[j * 3 + k] = toVec3(mesh->mVertices[index]);
+        for (size_t i = 0; i < 6; ++i) {
+            hash = (hash ^ words[i]) * 1099511628211ull;
+        }
+
+        return hash;
+    }
+};
+
+vec3 any_perpendicular(const vec3& normal) {
+    vec3 axis = abs(normal.x) < 0.9f ? vec3(1.0f, 0.0f, 0.0f) : vec3(0.0f, 1.0f, 0.0f);
+    return normalize(cross(normal, axis));
+}
+
+// Builds an indexed mesh from a mesh without tangents. Vertices with the same
+// position and normal are merged and get a tangent frame averaged from the
+// first edges of the faces sharing them.
+void weld_vertices(const aiMesh* mesh, Mesh& result) {
+    std::unordered_map<weld_key_t, int, weld_key_hash_t> indices;
+    indices.reserve(mesh->mNumVertices);
+
+    vector<vec3> normals;
+    vector<vec3> tangents;
+
+    result.indices.resize(mesh->mNumFaces * 3);
+
+    for (size_t j = 0; j < mesh->mNumFaces; ++j) {
+        runtime_assert(mesh->mFaces[j].mNumIndices == 3);
+
+        for (size_t k = 0; k < 3; ++k) {
+            unsigned index = mesh->mFaces[j].mIndices[k];
+
+            weld_key_t key = {
+                toVec3(mesh->mVertices[index]),
+                toVec3(mesh->mNormals[index])
+            };
+
+            auto inserted = indices.insert(std::make_pair(key, int(result.vertices.size())));
+
+            if (inserted.second) {
+                result.vertices.push_back(key.position);
+                normals.push_back(key.normal);
+                tangents.push_back(vec3(0.0f));
             }
 
-            vec3 edge = result.vertices[j * 3 + 1] - result.vertices[j * 3 + 0];
+            result.indices[j * 3 + k] = inserted.first->second;
+        }
 
-            for (size_t k = 0; k < 3; ++k) {
-                vec3 normal = result.tangents[j * 3 + k][1];
-                vec3 tangent = normalize(edge - dot(normal, edge) * normal);
-                vec3 bitangent = normalize(cross(normal, tangent));
-                result.tangents[j * 3 + k][2] = bitangent;
-                result.tangents[j * 3 + k][0] = tangent;
+        int* face = result.indices.data() + j * 3;
+        vec3 edge = result.vertices[face[1]] - result.vertices[face[0]];
+
+        for (size_t k = 0; k < 3; ++k) {
+            vec3 normal = normals[face[k]];
+            vec3 tangent = edge - dot(normal, edge) * normal;
+            float length_sq = dot(tangent, tangent);
+
+            if (length_sq > 0.0f) {
+                tangents[face[k]] += tangent / sqrt(length_sq);
             }
         }
     }
+
+    result.tangents.resize(result.vertices.size());
+
+    for (size_t i = 0; i < result.vertices.size(); ++i) {
+        vec3 normal = normals[i];
+        vec3 tangent = tangents[i] - dot(normal, tangents[i]) * normal;
+
+        tangent = dot(tangent, tangent) > FLT_EPSILON
+            ? normalize(tangent)
+            : any_perpendicular(normal);
+
+        result.tangents[i][0] = tangent;
+        result.tangents[i][1] = normal;
+        result.tangents[i][2] = normalize(cross(normal, tangent));
+    }
+
+    size_t num_unwelded = mesh->mNumFaces * 3;
+    result.welded_bytes = (num_unwelded - result.vertices.size()) * (sizeof(vec3) + sizeof(mat3));
+}
+
+Mesh aiMeshToMesh(const aiMesh* mesh) {
+    runtime_assert(mesh != nullptr);
+    runtime_assert(mesh->mNormals != nullptr);
+    runtime_assert(mesh->mVertices != nullptr);
+
+    Mesh result;
+
+    if (mesh->mBitangents == nullptr ||
+        mesh->mTangents == nullptr) {
+        weld_vertices(mesh, result);
+    }
     else {
         result.tangents.resize(mesh->mNumVertices);
         result.vertices.resize(mesh->mNumVertices);
@@ -393,99 +529,181 @@ Mesh aiMeshToMesh(const aiMesh* mesh) {
     return result;
 }
 
-vector<Mesh> aiMeshes_to_Meshes(aiMesh const *const *const meshes, std::size_t num_meshes) {
-    vector<Mesh> result;
+vector<Mesh> aiMeshes_to_Meshes(
+    threadpool_t& pool,
+    aiMesh const *const *const meshes,
+    std::size_t num_meshes)
+{
+    vector<Mesh> result(num_meshes);
 
-    for (size_t i = 0; i < num_meshes; ++i) {
-        result.push_back(aiMeshToMesh(meshes[i]));
-    }
+    exec1d(pool, num_meshes, 1, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            result[i] = aiMeshToMesh(meshes[i]);
+        }
+    });
 
     return result;
 }
 
-bounding_sphere_t compute_bounding_sphere(const std::vector<Mesh>& meshes) {
-    bounding_sphere_t result = { vec3(0.0f), 0.0f };
-    size_t num_vertices = 0;
+void aiNode_to_Instances(
+    const aiNode* node,
+    const aiMatrix4x4& parent,
+    vector<Instance>& instances)
+{
+    aiMatrix4x4 transform = parent * node->mTransformation;
 
-    for (auto&& mesh : meshes) {
-        for (auto&& vertex : mesh.vertices) {
-            result.center += vertex;
-        }
+    for (unsigned i = 0; i < node->mNumMeshes; ++i) {
+        Instance instance;
+        instance.meshID = node->mMeshes[i];
+        instance.transform = toMat4(transform);
+        instances.push_back(instance);
+    }
 
-        num_vertices += mesh.vertices.size();
+    for (unsigned i = 0; i < node->mNumChildren; ++i) {
+        aiNode_to_Instances(node->mChildren[i], transform, instances);
     }
+}
 
-    result.center /= static_cast<float>(num_vertices);
+bounding_sphere_t compute_bounding_sphere(
+    threadpool_t& pool,
+    const std::vector<Mesh>& meshes,
+    const std::vector<Instance>& instances)
+{
+    // The bound of every instance is its mesh bound transformed to the world,
+    // so the vertices of a repeated mesh are visited only once.
+    vector<bounding_sphere_t> mesh_spheres(meshes.size());
+
+    exec1d(pool, meshes.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            bounding_sphere_t& sphere = mesh_spheres[i];
+            sphere = { vec3(0.0f), 0.0f };
+
+            for (auto&& vertex : meshes[i].vertices) {
+                sphere.center += vertex;
+            }
+
+            sphere.center /= static_cast<float>(glm::max(size_t(1), meshes[i].vertices.size()));
 
-    for (auto&& mesh : meshes) {
-        for (auto&& vertex : mesh.vertices) {
-            result.radius = glm::max(result.radius, glm::distance2(result.center, vertex));
+            for (auto&& vertex : meshes[i].vertices) {
+                sphere.radius = glm::max(sphere.radius, glm::distance2(sphere.center, vertex));
+            }
+
+            sphere.radius = glm::sqrt(sphere.radius);
         }
+    });
+
+    bounding_sphere_t result = { vec3(0.0f), 0.0f };
+    size_t num_vertices = 0;
+
+    for (auto&& instance : instances) {
+        size_t size = meshes[instance.meshID].vertices.size();
+        result.center += vec3(instance.transform * vec4(mesh_spheres[instance.meshID].center, 1.0f)) * float(size);
+        num_vertices += size;
     }
 
-    result.radius = glm::sqrt(result.radius);
+    result.center /= static_cast<float>(num_vertices);
+
+    for (auto&& instance : instances) {
+        const bounding_sphere_t& sphere = mesh_spheres[instance.meshID];
+        vec3 center = vec3(instance.transform * vec4(sphere.center, 1.0f));
+
+        float scale = glm::max(
+            length(vec3(instance.transform[0])),
+            glm::max(length(vec3(instance.transform[1])), length(vec3(instance.transform[2]))));
+
+        result.radius = glm::max(result.radius, distance(result.center, center) + sphere.radius * scale);
+    }
 
     return result;
 }
 
-shared<Scene> loadScene(string path) {
+scene_desc_t import_scene(const string& path, threadpool_t& pool, double& import_time) {
     Assimp::Importer importer;
 
     auto flags =
         aiProcess_Triangulate |
         aiProcess_GenNormals |
-        aiProcess_JoinIdenticalVertices |
-        aiProcess_PreTransformVertices;
+        aiProcess_JoinIdenticalVertices;
 
+    import_time = high_resolution_time();
     const aiScene* scene = importer.ReadFile(path, flags);
-
-    using namespace std;
+    import_time = high_resolution_time() - import_time;
 
     if (!scene) {
         throw std::runtime_error("Cannot load \"" + path + "\" scene.");
     }
 
-    vector<Mesh> meshes = aiMeshes_to_Meshes(scene->mMeshes, scene->mNumMeshes);
-    bounding_sphere_t meshes_bounding_sphere = compute_bounding_sphere(meshes);
+    scene_desc_t result;
+    aiNode_to_Instances(scene->mRootNode, aiMatrix4x4(), result.instances);
+    result.cameras = loadCameras(scene);
+    result.meshes = aiMeshes_to_Meshes(pool, scene->mMeshes, scene->mNumMeshes);
+    result.lights = loadAreaLights(scene);
+    result.lights_offset = scene->mNumLights + 1;
 
-    Materials materials;
+    for (size_t i = 0; i < scene->mNumMaterials; ++i) {
+        result.materials.push_back(aiMaterial_to_desc(scene->mMaterials[i]));
+    }
 
-    AreaLights lights = loadAreaLights(scene, materials, meshes_bounding_sphere);
+    return result;
+}
 
-    materials.names.push_back("camera");
-    materials.bsdfs.push_back(unique<BSDF>(new CameraBSDF()));
+shared<Scene> make_scene(threadpool_t& pool, scene_desc_t&& desc) {
+    bounding_sphere_t meshes_bounding_sphere = compute_bounding_sphere(pool, desc.meshes, desc.instances);
 
-    for (size_t i = 0; i < scene->mNumMaterials; ++i) {
-        const aiMaterial* material = scene->mMaterials[i];
+    Materials materials;
+    AreaLights lights;
+
+    materials.lights_offset = desc.lights_offset;
+
+    for (auto&& light : desc.lights) {
+        size_t light_id = lights.addLight(
+            light.name,
+            int32_t(materials.bsdfs.size()) - materials.lights_offset,
+            light.position,
+            light.direction,
+            light.up,
+            light.exitance,
+            light.size);
+
+        materials.names.push_back(light.name);
+        materials.bsdfs.push_back(lights.light(light_id).create_bsdf(meshes_bounding_sphere));
+    }
 
-        materials.names.push_back(name(scene->mMaterials[i]));
+    materials.names.push_back("camera");
+    materials.bsdfs.push_back(unique<BSDF>(new CameraBSDF()));
 
-        if (property<bool>(material, "$mat.blend.transparency.use")) {
-            float ior = property<float>(material, "$mat.blend.transparency.ior");
-            auto bsdf = unique<BSDF>(new TransmissionBSDF(ior, 1.0f));
-            materials.bsdfs.push_back(std::move(bsdf));
-        }
-        else if (property<bool>(material, "$mat.blend.mirror.use")) {
-            materials.bsdfs.push_back(unique<BSDF>(new ReflectionBSDF()));
-        }
-        else if (specular(material) == vec3(0.0f)) {
-            materials.bsdfs.push_back(unique<BSDF>(new DiffuseBSDF(diffuse(material))));
-        }
-        else {
-            materials.bsdfs.push_back(
-                unique<BSDF>(new PhongBSDF(
-                    diffuse(material),
-                    specular(material),
-                    shininess(material))));
-        }
+    for (auto&& material : desc.materials) {
+        materials.names.push_back(material.name);
+        materials.bsdfs.push_back(create_bsdf(material));
     }
 
-    shared<Scene> result = make_shared<Scene>(
-        loadCameras(scene),
+    return make_shared<Scene>(
+        move(desc.cameras),
         move(materials),
-        move(meshes),
+        move(desc.meshes),
+        move(desc.instances),
         move(lights),
         meshes_bounding_sphere);
+}
+
+shared<Scene> loadScene(string path, threadpool_t& pool) {
+    double start = high_resolution_time();
+    double import_time = 0.0;
+
+    scene_desc_t desc;
+
+    if (load_scene_cache(path, desc)) {
+        import_time = high_resolution_time() - start;
+    }
+    else {
+        desc = import_scene(path, pool, import_time);
+        save_scene_cache(path, desc);
+    }
+
+    auto result = make_scene(pool, move(desc));
+
+    result->import_time = import_time;
+    result->convert_time = high_resolution_time() - start - import_time;
 
     return result;
 }
@@ -3,7 +3,7 @@
 
 namespace haste {
 
-shared<Scene> loadScene(string path);
+shared<Scene> loadScene(string path, threadpool_t& pool);
 
 struct Triangle {
     vec3 vertices[3];
@@ -77,6 +77,10 @@ int main(int argc, char **argv) {
         print_time(options.input0);
     }
     else {
+        // Created once, before the scene, the techniques borrow it and
+        // survive the reloads.
+        shared_threadpool(options.numThreads, options.pinThreads);
+
         Application application(options);
 
         if (!options.batch) {
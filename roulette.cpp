@@ -0,0 +1,151 @@
+#include <roulette.hpp>
+#include <unittest>
+
+namespace haste {
+
+// The window around the expected contribution of one (Vorba and Krivanek
+// use a width of 5), and the lowest probability of survival, it bounds the
+// weights when the estimates are off.
+static const float window_width = 5.0f;
+static const float window_lower = 2.0f / (1.0f + window_width);
+static const float window_upper = window_lower * window_width;
+static const float min_probability = 0.05f;
+
+static float luminance(vec3 color) {
+  return dot(color, vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+void roulette_t::set_enabled(bool enabled) { _enabled = enabled; }
+
+bool roulette_t::enabled() const { return _enabled; }
+
+void roulette_t::update(threadpool_t& threadpool, const ImageView& view) {
+  size_t num_cols = (view.width() + _region_size - 1) / _region_size;
+  size_t num_rows = (view.height() + _region_size - 1) / _region_size;
+
+  if (num_cols != _num_cols || num_rows != _num_rows) {
+    _num_cols = num_cols;
+    _num_rows = num_rows;
+    _regions.resize(_num_cols * _num_rows);
+    _counts.resize(_num_cols * _num_rows);
+  }
+
+  // A task per row of regions, the regions of a row are only written by it.
+  exec1d(threadpool, _num_rows, 1, [&](size_t begin, size_t end) {
+    for (size_t row = begin; row < end; ++row) {
+      size_t y_end = min((row + 1) * _region_size, view.height());
+
+      for (size_t col = 0; col < _num_cols; ++col) {
+        size_t x_end = min((col + 1) * _region_size, view.width());
+        double sum = 0.0;
+        size_t count = 0;
+
+        for (size_t y = row * _region_size; y < y_end; ++y) {
+          for (size_t x = col * _region_size; x < x_end; ++x) {
+            const dvec4& pixel = view.absAt(x, y);
+
+            if (pixel.a >= double(_min_samples)) {
+              sum += luminance(vec3(pixel.rgb() / pixel.a));
+              ++count;
+            }
+          }
+        }
+
+        _regions[row * _num_cols + col] = float(sum);
+        _counts[row * _num_cols + col] = count;
+      }
+    }
+  });
+
+  double sum = 0.0;
+  size_t count = 0;
+
+  for (size_t i = 0; i < _regions.size(); ++i) {
+    sum += _regions[i];
+    count += _counts[i];
+    _regions[i] = _counts[i] != 0 ? _regions[i] / _counts[i] : 0.0f;
+  }
+
+  _average = count != 0 ? float(sum / count) : 0.0f;
+}
+
+float roulette_t::expected(vec3 throughput, vec2 pixel, float fallback) const {
+  if (!_enabled || _regions.empty() || !(_average > 0.0f)) {
+    return fallback;
+  }
+
+  size_t col = min(size_t(pixel.x) / _region_size, _num_cols - 1);
+  size_t row = min(size_t(pixel.y) / _region_size, _num_rows - 1);
+  float estimate = _regions[row * _num_cols + col];
+
+  if (!(estimate > 0.0f)) {
+    return fallback;
+  }
+
+  float value = luminance(throughput);
+
+  if (!std::isfinite(value)) {
+    return fallback;
+  }
+
+  float ratio = value * _average / estimate;
+
+  if (!(ratio >= window_lower)) {
+    return max(ratio, min_probability);
+  } else if (ratio > window_upper) {
+    return min(ratio, float(_max_split));
+  } else {
+    return 1.0f;
+  }
+}
+
+size_t roulette_t::continuations(random_generator_t& generator,
+                                 float expected) {
+  float whole = floor(expected);
+  return size_t(whole) + (generator.sample() < expected - whole ? 1 : 0);
+}
+
+unittest() {
+  // The left quarter of the image is 13 times brighter than the rest, the
+  // average is 4. A path of unit throughput is killed on the left and split
+  // in four on the right.
+  const size_t width = 32, height = 16;
+  vector<dvec4> data(width * height);
+
+  for (size_t y = 0; y < height; ++y) {
+    for (size_t x = 0; x < width; ++x) {
+      double value = x < width / 4 ? 13.0 : 1.0;
+      data[y * width + x] = dvec4(value * 8.0, value * 8.0, value * 8.0, 8.0);
+    }
+  }
+
+  threadpool_t threadpool(2);
+  roulette_t roulette;
+  roulette.update(threadpool, ImageView(data.data(), width, height));
+  assert_true(roulette.expected(vec3(1.0f), vec2(2.0f, 2.0f), 0.9f) == 0.9f);
+
+  roulette.set_enabled(true);
+  float bright = roulette.expected(vec3(1.0f), vec2(2.0f, 2.0f), 0.9f);
+  float dark = roulette.expected(vec3(1.0f), vec2(30.0f, 2.0f), 0.9f);
+  assert_almost_eq(bright, 4.0f / 13.0f);
+  assert_almost_eq(dark, 4.0f);
+  assert_true(roulette.expected(vec3(INFINITY), vec2(2.0f, 2.0f), 0.9f) == 0.9f);
+  assert_true(roulette.expected(vec3(NAN), vec2(2.0f, 2.0f), 0.9f) == 0.9f);
+
+  // The estimates are the same when updated again over the same buffers.
+  roulette.update(threadpool, ImageView(data.data(), width, height));
+  assert_almost_eq(roulette.expected(vec3(1.0f), vec2(30.0f, 2.0f), 0.9f), dark);
+
+  // The number of continuations is unbiased.
+  random_generator_t generator(1);
+  const size_t num_samples = 100000;
+  size_t sum = 0;
+
+  for (size_t i = 0; i < num_samples; ++i) {
+    sum += roulette_t::continuations(generator, dark);
+  }
+
+  assert_true(abs(double(sum) / num_samples - dark) < 0.01);
+}
+
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include <ImageView.hpp>
+#include <Sample.hpp>
+#include <threadpool.hpp>
+#include <utility.hpp>
+
+namespace haste {
+
+// Russian roulette and splitting with a weight window, after the
+// adjoint-driven roulette of Vorba and Krivanek (2016). The expected
+// contribution of a path continued from a vertex is its throughput times
+// the average radiance of the image. It is compared to the estimate of the
+// region of the image the pixel of the path belongs to. Paths below the
+// window survive with the probability of their ratio, those above it are
+// split in as many. The paths of dark regions are split and the ones of
+// bright regions, mostly lit directly, are killed early. The estimates are
+// updated in parallel from the accumulated image after every pass, the
+// buffers are kept while the size of the image doesn't change. They are only
+// read while tracing.
+class roulette_t {
+ public:
+  void set_enabled(bool enabled);
+  bool enabled() const;
+
+  void update(threadpool_t& threadpool, const ImageView& view);
+
+  // Expected number of continuations of a path through the pixel, below one
+  // it is the probability of survival. While disabled, if the region has no
+  // estimate yet or if the throughput isn't finite, the fallback is
+  // returned.
+  float expected(vec3 throughput, vec2 pixel, float fallback) const;
+
+  // The number of continuations, its mean is the expected one.
+  static size_t continuations(random_generator_t& generator, float expected);
+
+ private:
+  static const size_t _region_size = 8;
+  static const size_t _min_samples = 4;
+  static const size_t _max_split = 8;
+
+  bool _enabled = false;
+  size_t _num_cols = 0;
+  size_t _num_rows = 0;
+  float _average = 0.0f;
+  std::vector<float> _regions;
+  std::vector<size_t> _counts;
+};
+
+}
@@ -0,0 +1,526 @@
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include <unittest>
+#include <scene_cache.hpp>
+
+namespace haste {
+
+static const char scene_cache_magic[8] = { 'H', 'A', 'S', 'T', 'E', 'S', 'C', 'N' };
+static const uint32_t scene_cache_version = 3;
+static const size_t scene_cache_alignment = 16;
+
+struct scene_cache_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t source_mtime;
+    uint64_t source_size;
+    uint64_t source_hash;
+    uint64_t payload_size;
+};
+
+class mapped_file_t {
+public:
+    mapped_file_t(const string& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+
+        if (fd == -1) {
+            return;
+        }
+
+        struct stat buf;
+
+        if (fstat(fd, &buf) == 0 && buf.st_size > 0) {
+            void* data = mmap(nullptr, size_t(buf.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+
+            if (data != MAP_FAILED) {
+                madvise(data, size_t(buf.st_size), MADV_SEQUENTIAL);
+                _data = (const char*)data;
+                _size = size_t(buf.st_size);
+            }
+        }
+
+        close(fd);
+    }
+
+    ~mapped_file_t() {
+        if (_data != nullptr) {
+            munmap((void*)_data, _size);
+        }
+    }
+
+    mapped_file_t(const mapped_file_t&) = delete;
+    mapped_file_t& operator=(const mapped_file_t&) = delete;
+
+    const char* data() const { return _data; }
+    size_t size() const { return _size; }
+
+private:
+    const char* _data = nullptr;
+    size_t _size = 0;
+};
+
+static uint64_t hash_file(const mapped_file_t& file) {
+    uint64_t hash = 14695981039346656037ull;
+
+    for (size_t i = 0; i < file.size(); ++i) {
+        hash = (hash ^ uint64_t(uint8_t(file.data()[i]))) * 1099511628211ull;
+    }
+
+    return hash;
+}
+
+class cache_writer_t {
+public:
+    template <class T> void write(const T& value) {
+        _append(&value, sizeof(T));
+    }
+
+    void write(const string& value) {
+        write(uint64_t(value.size()));
+        _append(value.data(), value.size());
+    }
+
+    template <class T> void write(const vector<T>& values) {
+        write(uint64_t(values.size()));
+        _align();
+        _append(values.data(), values.size() * sizeof(T));
+    }
+
+    const vector<char>& buffer() const { return _buffer; }
+
+private:
+    vector<char> _buffer;
+
+    void _append(const void* data, size_t size) {
+        _buffer.insert(_buffer.end(), (const char*)data, (const char*)data + size);
+    }
+
+    void _align() {
+        _buffer.resize((_buffer.size() + scene_cache_alignment - 1) / scene_cache_alignment * scene_cache_alignment, 0);
+    }
+};
+
+class cache_reader_t {
+public:
+    cache_reader_t(const char* data, size_t size) : _data(data), _size(size) { }
+
+    template <class T> void read(T& value) {
+        std::memcpy(&value, _advance(sizeof(T)), sizeof(T));
+    }
+
+    void read(string& value) {
+        uint64_t size;
+        read(size);
+        value.assign(_advance(size), size);
+    }
+
+    // The arrays are copied out of the mapping: the meshes own their vectors
+    // for the lifetime of the scene, and the mapping is gone once loaded.
+    template <class T> void read(vector<T>& values) {
+        uint64_t size;
+        read(size);
+        _align();
+
+        if (size > (_size - _offset) / sizeof(T)) {
+            throw std::runtime_error("Truncated scene cache.");
+        }
+
+        values.resize(size);
+        std::memcpy(values.data(), _advance(size * sizeof(T)), size * sizeof(T));
+    }
+
+private:
+    const char* _data;
+    size_t _size;
+    size_t _offset = 0;
+
+    const char* _advance(size_t size) {
+        if (size > _size - _offset) {
+            throw std::runtime_error("Truncated scene cache.");
+        }
+
+        const char* result = _data + _offset;
+        _offset += size;
+        return result;
+    }
+
+    void _align() {
+        _advance((scene_cache_alignment - _offset % scene_cache_alignment) % scene_cache_alignment);
+    }
+};
+
+static void write_payload(cache_writer_t& writer, const scene_desc_t& desc) {
+    writer.write(uint64_t(desc.cameras.numCameras()));
+
+    for (size_t i = 0; i < desc.cameras.numCameras(); ++i) {
+        writer.write(desc.cameras.name(i));
+        writer.write(desc.cameras.position(i));
+        writer.write(desc.cameras.direction(i));
+        writer.write(desc.cameras.up(i));
+        writer.write(desc.cameras.fovx(i, 1.0f));
+        writer.write(desc.cameras.near(i));
+        writer.write(desc.cameras.far(i));
+    }
+
+    writer.write(uint64_t(desc.meshes.size()));
+
+    for (auto&& mesh : desc.meshes) {
+        writer.write(mesh.name);
+        writer.write(mesh.materialID);
+        writer.write(mesh.indices);
+        writer.write(mesh.vertices);
+        writer.write(mesh.tangents);
+        writer.write(uint64_t(mesh.welded_bytes));
+    }
+
+    writer.write(desc.instances);
+
+    writer.write(uint64_t(desc.materials.size()));
+
+    for (auto&& material : desc.materials) {
+        writer.write(material.name);
+        writer.write(material.type);
+        writer.write(material.diffuse);
+        writer.write(material.specular);
+        writer.write(material.power);
+        writer.write(material.ior);
+    }
+
+    writer.write(uint64_t(desc.lights.size()));
+
+    for (auto&& light : desc.lights) {
+        writer.write(light.name);
+        writer.write(light.position);
+        writer.write(light.direction);
+        writer.write(light.up);
+        writer.write(light.exitance);
+        writer.write(light.size);
+    }
+
+    writer.write(desc.lights_offset);
+}
+
+static void read_payload(cache_reader_t& reader, scene_desc_t& desc) {
+    uint64_t num_cameras;
+    reader.read(num_cameras);
+
+    for (size_t i = 0; i < num_cameras; ++i) {
+        string name;
+        vec3 position, direction, up;
+        float fovx, near, far;
+
+        reader.read(name);
+        reader.read(position);
+        reader.read(direction);
+        reader.read(up);
+        reader.read(fovx);
+        reader.read(near);
+        reader.read(far);
+
+        desc.cameras.addCameraFovX(name, position, direction, up, fovx, near, far);
+    }
+
+    uint64_t num_meshes;
+    reader.read(num_meshes);
+    desc.meshes.resize(num_meshes);
+
+    for (auto&& mesh : desc.meshes) {
+        reader.read(mesh.name);
+        reader.read(mesh.materialID);
+        reader.read(mesh.indices);
+        reader.read(mesh.vertices);
+        reader.read(mesh.tangents);
+
+        uint64_t welded_bytes;
+        reader.read(welded_bytes);
+        mesh.welded_bytes = welded_bytes;
+    }
+
+    reader.read(desc.instances);
+
+    uint64_t num_materials;
+    reader.read(num_materials);
+    desc.materials.resize(num_materials);
+
+    for (auto&& material : desc.materials) {
+        reader.read(material.name);
+        reader.read(material.type);
+        reader.read(material.diffuse);
+        reader.read(material.specular);
+        reader.read(material.power);
+        reader.read(material.ior);
+    }
+
+    uint64_t num_lights;
+    reader.read(num_lights);
+    desc.lights.resize(num_lights);
+
+    for (auto&& light : desc.lights) {
+        reader.read(light.name);
+        reader.read(light.position);
+        reader.read(light.direction);
+        reader.read(light.up);
+        reader.read(light.exitance);
+        reader.read(light.size);
+    }
+
+    reader.read(desc.lights_offset);
+}
+
+string scene_cache_path(const string& path) {
+    return path + ".cache";
+}
+
+bool load_scene_cache(const string& path, scene_desc_t& desc) {
+    string cache_path = scene_cache_path(path);
+    mapped_file_t cache(cache_path);
+
+    if (cache.size() < sizeof(scene_cache_header_t)) {
+        return false;
+    }
+
+    scene_cache_header_t header;
+    std::memcpy(&header, cache.data(), sizeof(header));
+
+    if (std::memcmp(header.magic, scene_cache_magic, sizeof(header.magic)) != 0
+        || header.version != scene_cache_version
+        || header.header_size != sizeof(header)
+        || header.payload_size != cache.size() - sizeof(header)) {
+        return false;
+    }
+
+    uint64_t source_mtime = getmtime(path);
+
+    if (header.source_mtime != source_mtime) {
+        mapped_file_t source(path);
+
+        if (header.source_size != source.size() || header.source_hash != hash_file(source)) {
+            return false;
+        }
+
+        // The content is the same (the file was touched or copied), refresh
+        // the time stamp so the hash isn't recomputed on every load.
+        header.source_mtime = source_mtime;
+
+        std::fstream stream(cache_path, std::ios::in | std::ios::out | std::ios::binary);
+        stream.write((const char*)&header, sizeof(header));
+    }
+
+    try {
+        scene_desc_t result;
+        cache_reader_t reader(cache.data() + sizeof(header), header.payload_size);
+        read_payload(reader, result);
+        desc = move(result);
+    }
+    catch (const std::runtime_error&) {
+        return false;
+    }
+
+    return true;
+}
+
+bool save_scene_cache(const string& path, const scene_desc_t& desc) {
+    cache_writer_t writer;
+    write_payload(writer, desc);
+
+    mapped_file_t source(path);
+
+    scene_cache_header_t header;
+    std::memcpy(header.magic, scene_cache_magic, sizeof(header.magic));
+    header.version = scene_cache_version;
+    header.header_size = sizeof(header);
+    header.source_mtime = getmtime(path);
+    header.source_size = source.size();
+    header.source_hash = hash_file(source);
+    header.payload_size = writer.buffer().size();
+
+    // Write to a temporary file first, so a concurrent or interrupted run
+    // never sees a partially written cache.
+    string cache_path = scene_cache_path(path);
+    string temp_path = cache_path + ".tmp";
+
+    {
+        std::ofstream stream(temp_path, std::ios::out | std::ios::binary | std::ios::trunc);
+        stream.write((const char*)&header, sizeof(header));
+        stream.write(writer.buffer().data(), writer.buffer().size());
+
+        if (!stream) {
+            std::remove(temp_path.c_str());
+            return false;
+        }
+    }
+
+    return std::rename(temp_path.c_str(), cache_path.c_str()) == 0;
+}
+
+namespace {
+
+void write_file(const string& path, const string& content) {
+    std::ofstream stream(path, std::ios::out | std::ios::binary | std::ios::trunc);
+    stream.write(content.data(), content.size());
+}
+
+void set_mtime(const string& path, time_t mtime) {
+    struct utimbuf times;
+    times.actime = mtime;
+    times.modtime = mtime;
+    utime(path.c_str(), &times);
+}
+
+bool scenes_match(const scene_desc_t& a, const scene_desc_t& b) {
+    if (a.cameras.numCameras() != b.cameras.numCameras()
+        || a.meshes.size() != b.meshes.size()
+        || a.instances.size() != b.instances.size()
+        || a.materials.size() != b.materials.size()
+        || a.lights.size() != b.lights.size()
+        || a.lights_offset != b.lights_offset) {
+        return false;
+    }
+
+    for (size_t i = 0; i < a.cameras.numCameras(); ++i) {
+        if (a.cameras.name(i) != b.cameras.name(i)
+            || a.cameras.position(i) != b.cameras.position(i)
+            || a.cameras.direction(i) != b.cameras.direction(i)
+            || a.cameras.up(i) != b.cameras.up(i)
+            || a.cameras.fovx(i, 1.0f) != b.cameras.fovx(i, 1.0f)
+            || a.cameras.near(i) != b.cameras.near(i)
+            || a.cameras.far(i) != b.cameras.far(i)) {
+            return false;
+        }
+    }
+
+    for (size_t i = 0; i < a.meshes.size(); ++i) {
+        if (a.meshes[i].name != b.meshes[i].name
+            || a.meshes[i].materialID != b.meshes[i].materialID
+            || a.meshes[i].indices != b.meshes[i].indices
+            || a.meshes[i].vertices != b.meshes[i].vertices
+            || a.meshes[i].tangents != b.meshes[i].tangents
+            || a.meshes[i].welded_bytes != b.meshes[i].welded_bytes) {
+            return false;
+        }
+    }
+
+    for (size_t i = 0; i < a.instances.size(); ++i) {
+        if (a.instances[i].meshID != b.instances[i].meshID
+            || a.instances[i].transform != b.instances[i].transform) {
+            return false;
+        }
+    }
+
+    for (size_t i = 0; i < a.materials.size(); ++i) {
+        if (a.materials[i].name != b.materials[i].name
+            || a.materials[i].type != b.materials[i].type
+            || a.materials[i].diffuse != b.materials[i].diffuse
+            || a.materials[i].specular != b.materials[i].specular
+            || a.materials[i].power != b.materials[i].power
+            || a.materials[i].ior != b.materials[i].ior) {
+            return false;
+        }
+    }
+
+    for (size_t i = 0; i < a.lights.size(); ++i) {
+        if (a.lights[i].name != b.lights[i].name
+            || a.lights[i].position != b.lights[i].position
+            || a.lights[i].direction != b.lights[i].direction
+            || a.lights[i].up != b.lights[i].up
+            || a.lights[i].exitance != b.lights[i].exitance
+            || a.lights[i].size != b.lights[i].size) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+}
+
+unittest() {
+    // The cache gives back the scene it was saved from. It is trusted while
+    // the modification time of the source matches, and while the content
+    // does if the time doesn't.
+    const string path = "haste-unittest.scene";
+    write_file(path, "first scene");
+    set_mtime(path, 1000000);
+
+    scene_desc_t saved;
+    saved.cameras.addCameraFovX("front", vec3(0.0f, 1.0f, 5.0f), vec3(0.0f, 0.0f, -1.0f), vec3(0.0f, 1.0f, 0.0f), 1.25f, 0.5f, 50.0f);
+    saved.cameras.addCameraFovX("side", vec3(5.0f, 1.0f, 0.0f), vec3(-1.0f, 0.0f, 0.0f), vec3(0.0f, 1.0f, 0.0f), 0.75f);
+
+    saved.meshes.resize(2);
+
+    for (size_t i = 0; i < saved.meshes.size(); ++i) {
+        Mesh& mesh = saved.meshes[i];
+        mesh.name = i == 0 ? "floor" : "light";
+        mesh.materialID = unsigned(i);
+        mesh.indices = { 0, 1, 2, 2, 3, 0 };
+        mesh.vertices = { vec3(-1.0f, float(i), -1.0f), vec3(1.0f, float(i), -1.0f), vec3(1.0f, float(i), 1.0f), vec3(-1.0f, float(i), 1.0f) };
+        mesh.tangents.assign(4, mat3(float(i + 1)));
+        mesh.welded_bytes = 48 * i;
+    }
+
+    saved.instances.resize(3);
+    saved.instances[0].meshID = 0;
+    saved.instances[0].transform = mat4(1.0f);
+    saved.instances[1].meshID = 0;
+    saved.instances[1].transform = mat4(2.0f);
+    saved.instances[2].meshID = 1;
+    saved.instances[2].transform = mat4(3.0f);
+
+    saved.materials.resize(2);
+    saved.materials[0].name = "floor";
+    saved.materials[0].type = material_desc_t::Phong;
+    saved.materials[0].diffuse = vec3(0.5f, 0.25f, 0.125f);
+    saved.materials[0].specular = vec3(0.25f);
+    saved.materials[0].power = 32.0f;
+    saved.materials[1].name = "glass";
+    saved.materials[1].type = material_desc_t::Transmission;
+    saved.materials[1].ior = 1.5f;
+
+    saved.lights.resize(1);
+    saved.lights[0].name = "light";
+    saved.lights[0].position = vec3(0.0f, 1.0f, 0.0f);
+    saved.lights[0].direction = vec3(0.0f, -1.0f, 0.0f);
+    saved.lights[0].up = vec3(0.0f, 0.0f, 1.0f);
+    saved.lights[0].exitance = vec3(10.0f, 9.0f, 8.0f);
+    saved.lights[0].size = vec2(0.5f, 0.25f);
+    saved.lights_offset = 1;
+
+    assert_true(save_scene_cache(path, saved));
+
+    scene_desc_t loaded;
+    assert_true(load_scene_cache(path, loaded));
+    assert_true(scenes_match(loaded, saved));
+
+    // Touched, the same content: the hash matches and the time stamp of the
+    // cache is refreshed, so the time alone is trusted afterwards.
+    set_mtime(path, 2000000);
+    assert_true(load_scene_cache(path, loaded));
+    assert_true(scenes_match(loaded, saved));
+
+    write_file(path, "other scene");
+    set_mtime(path, 2000000);
+    assert_true(load_scene_cache(path, loaded));
+
+    // Both the time and the content differ.
+    set_mtime(path, 3000000);
+    assert_true(!load_scene_cache(path, loaded));
+
+    // A cache cut short is not used.
+    assert_true(save_scene_cache(path, saved));
+    assert_true(truncate(scene_cache_path(path).c_str(), 100) == 0);
+    assert_true(!load_scene_cache(path, loaded));
+
+    std::remove(scene_cache_path(path).c_str());
+    std::remove(path.c_str());
+}
+
+}
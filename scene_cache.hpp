@@ -0,0 +1,45 @@
+#pragma once
+#include <Scene.hpp>
+
+namespace haste {
+
+struct material_desc_t {
+    enum type_t : uint32_t { Diffuse, Phong, Reflection, Transmission };
+
+    string name;
+    type_t type = Diffuse;
+    vec3 diffuse = vec3(0.0f);
+    vec3 specular = vec3(0.0f);
+    float power = 0.0f;
+    float ior = 1.0f;
+};
+
+struct light_desc_t {
+    string name;
+    vec3 position;
+    vec3 direction;
+    vec3 up;
+    vec3 exitance;
+    vec2 size;
+};
+
+// Everything the loader extracts from the imported file, before the BSDFs
+// and the acceleration structures are created.
+struct scene_desc_t {
+    Cameras cameras;
+    vector<Mesh> meshes;
+    vector<Instance> instances;
+    vector<material_desc_t> materials;
+    vector<light_desc_t> lights;
+    int32_t lights_offset = 0;
+};
+
+string scene_cache_path(const string& path);
+
+// The cache lives next to the source file. It is used as long as the
+// modification time of the source matches, or, if it doesn't, as long as the
+// content hash does. Returns false if there is no usable cache.
+bool load_scene_cache(const string& path, scene_desc_t& desc);
+bool save_scene_cache(const string& path, const scene_desc_t& desc);
+
+}
@@ -1,7 +1,18 @@
+#include <algorithm>
+#include <chrono>
 #include <condition_variable>
+#include <cstdint>
+#include <functional>
 #include <mutex>
+#include <fstream>
 #include <stdexcept>
+#include <string>
 #include <threadpool.hpp>
+#include <arena.hpp>
+#include <unittest>
+
+#include <pthread.h>
+#include <sched.h>
 
 namespace haste {
 
@@ -45,6 +56,7 @@ struct data_queue_impl_t {
   data_queue_thunk_t* acquire_thunk(size_t thunk_size) {
     if (buffer == nullptr) {
       buffer = reinterpret_cast<char*>(std::malloc(capacity));
+      count_allocation();
     }
 
     if (capacity < tail + thunk_size) {
@@ -154,68 +166,664 @@ size_t default_num_cores() {
   return num_cores == 0 ? 4 : num_cores;
 }
 
-threadpool_t::threadpool_t(size_t num_threads) {
-  num_threads = num_threads == 0 ? default_num_cores() : num_threads;
+// Free lists of the pool tasks, by size class. Tasks are usually created on
+// one thread and destroyed on another, so the lists are shared.
+struct task_free_list_t {
+  struct block_t {
+    block_t* next;
+  };
+
+  std::mutex mutex;
+  block_t* head = nullptr;
+};
+
+static const size_t task_size_classes[] = {64, 128, 256, 512, 1024};
+static const size_t num_task_size_classes = 5;
+
+static task_free_list_t* task_free_lists() {
+  static task_free_list_t lists[num_task_size_classes];
+  return lists;
+}
+
+static size_t task_size_class(size_t size) {
+  size_t index = 0;
+
+  while (index < num_task_size_classes && task_size_classes[index] < size) {
+    ++index;
+  }
+
+  return index;
+}
+
+void* pool_task_t::operator new(size_t size) {
+  size_t index = task_size_class(size);
+
+  if (index == num_task_size_classes) {
+    return ::operator new(size);
+  }
+
+  task_free_list_t& list = task_free_lists()[index];
+
+  {
+    std::unique_lock<std::mutex> lock(list.mutex);
+
+    if (list.head != nullptr) {
+      task_free_list_t::block_t* block = list.head;
+      list.head = block->next;
+      return block;
+    }
+  }
+
+  return ::operator new(task_size_classes[index]);
+}
+
+void pool_task_t::operator delete(void* pointer, size_t size) {
+  size_t index = task_size_class(size);
+
+  if (index == num_task_size_classes) {
+    ::operator delete(pointer);
+    return;
+  }
+
+  task_free_list_t& list = task_free_lists()[index];
+  auto block = static_cast<task_free_list_t::block_t*>(pointer);
+
+  std::unique_lock<std::mutex> lock(list.mutex);
+  block->next = list.head;
+  list.head = block;
+}
+
+// Chase-Lev work stealing deque, as formulated for C11 atomics by Le et al.
+// The owner pushes and takes at the bottom, thieves steal from the top.
+class work_stealing_deque_t {
+ public:
+  work_stealing_deque_t(size_t capacity = 256)
+      : _top(0), _bottom(0), _array(new array_t(capacity)) {
+    _arrays.emplace_back(_array.load(std::memory_order_relaxed));
+  }
+
+  void push(pool_task_t* task) {
+    int64_t bottom = _bottom.load(std::memory_order_relaxed);
+    int64_t top = _top.load(std::memory_order_acquire);
+    array_t* array = _array.load(std::memory_order_relaxed);
+
+    if (bottom - top > int64_t(array->capacity) - 1) {
+      array = _grow(array, top, bottom);
+    }
+
+    array->put(bottom, task);
+    std::atomic_thread_fence(std::memory_order_release);
+    _bottom.store(bottom + 1, std::memory_order_relaxed);
+  }
+
+  pool_task_t* take() {
+    int64_t bottom = _bottom.load(std::memory_order_relaxed) - 1;
+    array_t* array = _array.load(std::memory_order_relaxed);
+    _bottom.store(bottom, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t top = _top.load(std::memory_order_relaxed);
+
+    if (top > bottom) {
+      _bottom.store(bottom + 1, std::memory_order_relaxed);
+      return nullptr;
+    }
+
+    pool_task_t* task = array->get(bottom);
+
+    if (top == bottom) {
+      if (!_top.compare_exchange_strong(top, top + 1,
+                                        std::memory_order_seq_cst,
+                                        std::memory_order_relaxed)) {
+        task = nullptr;
+      }
+
+      _bottom.store(bottom + 1, std::memory_order_relaxed);
+    }
+
+    return task;
+  }
+
+  pool_task_t* steal() {
+    int64_t top = _top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t bottom = _bottom.load(std::memory_order_acquire);
+
+    if (top >= bottom) {
+      return nullptr;
+    }
+
+    array_t* array = _array.load(std::memory_order_acquire);
+    pool_task_t* task = array->get(top);
+
+    if (!_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst,
+                                      std::memory_order_relaxed)) {
+      return nullptr;
+    }
+
+    return task;
+  }
+
+ private:
+  struct array_t {
+    array_t(size_t capacity)
+        : capacity(capacity), tasks(new std::atomic<pool_task_t*>[capacity]) {}
+
+    pool_task_t* get(int64_t index) const {
+      return tasks[size_t(index) & (capacity - 1)].load(
+          std::memory_order_relaxed);
+    }
+
+    void put(int64_t index, pool_task_t* task) {
+      tasks[size_t(index) & (capacity - 1)].store(task,
+                                                  std::memory_order_relaxed);
+    }
+
+    size_t capacity;
+    std::unique_ptr<std::atomic<pool_task_t*>[]> tasks;
+  };
+
+  std::atomic<int64_t> _top;
+  std::atomic<int64_t> _bottom;
+  std::atomic<array_t*> _array;
+
+  // Thieves may still read from the replaced arrays, so they are kept
+  // until the deque is destroyed.
+  std::vector<std::unique_ptr<array_t>> _arrays;
+
+  array_t* _grow(array_t* array, int64_t top, int64_t bottom) {
+    array_t* result = new array_t(array->capacity * 2);
+
+    for (int64_t i = top; i < bottom; ++i) {
+      result->put(i, array->get(i));
+    }
+
+    _arrays.emplace_back(result);
+    _array.store(result, std::memory_order_release);
+    return result;
+  }
+};
+
+struct threadpool_t::worker_t {
+  work_stealing_deque_t deque;
+  uint32_t seed;
+  size_t node = 0;
+};
+
+struct cpu_t {
+  int id;
+  size_t node;
+};
+
+static std::vector<int> parse_cpu_list(const std::string& list) {
+  std::vector<int> result;
+  size_t begin = 0;
+
+  while (begin < list.size()) {
+    size_t end = list.find(',', begin);
+    end = end == std::string::npos ? list.size() : end;
+
+    std::string range = list.substr(begin, end - begin);
+    size_t dash = range.find('-');
+
+    if (!range.empty()) {
+      int first = std::stoi(range.substr(0, dash));
+      int last = dash == std::string::npos ? first
+                                           : std::stoi(range.substr(dash + 1));
+
+      for (int cpu = first; cpu <= last; ++cpu) {
+        result.push_back(cpu);
+      }
+    }
+
+    begin = end + 1;
+  }
+
+  return result;
+}
+
+// The cores the process may run on, grouped by NUMA node. Without the sysfs
+// node information all of them are assumed to be on node 0.
+static std::vector<cpu_t> allowed_cpus() {
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+    return std::vector<cpu_t>();
+  }
+
+  std::vector<cpu_t> result;
+  std::vector<bool> assigned(CPU_SETSIZE, false);
+
+  for (size_t node = 0;; ++node) {
+    std::ifstream stream("/sys/devices/system/node/node" +
+                         std::to_string(node) + "/cpulist");
+
+    if (!stream) {
+      break;
+    }
+
+    std::string list;
+    std::getline(stream, list);
+
+    for (int cpu : parse_cpu_list(list)) {
+      if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed) && !assigned[cpu]) {
+        result.push_back({cpu, node});
+        assigned[cpu] = true;
+      }
+    }
+  }
+
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &allowed) && !assigned[cpu]) {
+      result.push_back({cpu, 0});
+    }
+  }
+
+  return result;
+}
+
+static thread_local threadpool_t* current_pool = nullptr;
+static thread_local size_t current_index = SIZE_MAX;
 
+threadpool_t::threadpool_t(size_t num_threads, bool pin_threads)
+    : _num_pending(0), _num_sleeping(0) {
   _threads = std::vector<std::thread>(num_threads);
 
+  std::vector<cpu_t> cpus = pin_threads ? allowed_cpus() : std::vector<cpu_t>();
+
+  for (size_t i = 0; i < num_threads; ++i) {
+    _workers.emplace_back(new worker_t());
+    _workers.back()->seed = uint32_t(i * 2654435761u + 1u);
+
+    if (!cpus.empty()) {
+      _workers.back()->node = cpus[i % cpus.size()].node;
+    }
+  }
+
   _terminate = false;
 
-  for (auto&& thread : _threads) {
-    thread = std::thread([this]() {
-      while (!_terminate) {
-        _queue.exec();
-      }
-    });
+  for (size_t i = 0; i < num_threads; ++i) {
+    _threads[i] = std::thread([this, i]() { _worker_loop(i); });
+
+    if (!cpus.empty()) {
+      cpu_set_t cpu_set;
+      CPU_ZERO(&cpu_set);
+      CPU_SET(cpus[i % cpus.size()].id, &cpu_set);
+
+      // Failing to pin isn't fatal, the worker just keeps migrating.
+      pthread_setaffinity_np(_threads[i].native_handle(), sizeof(cpu_set),
+                             &cpu_set);
+    }
   }
 }
 
-threadpool_t::~threadpool_t() {
-  _terminate = true;
+threadpool_t& shared_threadpool(size_t num_threads, bool pin_threads) {
+  if (num_threads == 0) {
+    num_threads = std::max(default_num_cores(), size_t(2));
+  }
 
-  for (size_t i = 0; i < num_threads(); ++i) {
-    _queue.push([] {});
+  static threadpool_t pool(num_threads - 1, pin_threads);
+  return pool;
+}
+
+threadpool_t::~threadpool_t() {
+  {
+    std::unique_lock<std::mutex> lock(_sleep_mutex);
+    _terminate = true;
   }
 
+  _sleep_condition.notify_all();
+
   for (size_t i = 0; i < num_threads(); ++i) {
     _threads[i].join();
   }
+
+  for (auto&& worker : _workers) {
+    while (pool_task_t* task = worker->deque.take()) {
+      delete task;
+    }
+  }
+
+  for (auto&& task : _injection) {
+    delete task;
+  }
 }
 
 size_t threadpool_t::num_threads() { return _threads.size(); }
 
-namespace detail {
+size_t threadpool_t::thread_index() const {
+  return current_pool == this ? current_index : _threads.size();
+}
 
-void exec2d(threadpool_t& pool, size_t width, size_t height, size_t batch,
-            void* closure,
-            void (*callback)(void*, size_t, size_t, size_t, size_t)) {
+void threadpool_t::_push(pool_task_t* task) {
+  ++_num_pending;
+
+  if (current_pool == this) {
+    _workers[current_index]->deque.push(task);
+  } else {
+    std::unique_lock<std::mutex> lock(_injection_mutex);
+    _injection.push_back(task);
+  }
+
+  _notify();
+}
+
+void threadpool_t::_notify() {
+  if (_num_sleeping.load() != 0) {
+    { std::unique_lock<std::mutex> lock(_sleep_mutex); }
+    _sleep_condition.notify_one();
+  }
+}
+
+pool_task_t* threadpool_t::_acquire(size_t index) {
+  pool_task_t* task = nullptr;
+
+  if (index < _workers.size()) {
+    task = _workers[index]->deque.take();
+  }
+
+  if (task == nullptr) {
+    std::unique_lock<std::mutex> lock(_injection_mutex, std::try_to_lock);
+
+    if (lock.owns_lock() && !_injection.empty()) {
+      task = _injection.front();
+      _injection.pop_front();
+
+      // Move a share of the injected tasks to the own deque, so the other
+      // workers steal them from there instead of queuing on the mutex.
+      if (index < _workers.size()) {
+        size_t share = _injection.size() / (_workers.size() + 1);
+
+        for (size_t i = 0; i < share; ++i) {
+          _workers[index]->deque.push(_injection.front());
+          _injection.pop_front();
+        }
+
+        if (share != 0) {
+          _notify();
+        }
+      }
+    }
+  }
+
+  if (task == nullptr && !_workers.empty()) {
+    uint32_t seed = index < _workers.size()
+                        ? _workers[index]->seed
+                        : uint32_t(std::hash<std::thread::id>()(
+                              std::this_thread::get_id()));
+
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+
+    if (index < _workers.size()) {
+      _workers[index]->seed = seed;
+    }
+
+    size_t node = index < _workers.size() ? _workers[index]->node : 0;
+
+    // Steal from the same node first, the data of those tasks is likely
+    // local to it.
+    for (size_t pass = 0; pass < 2 && task == nullptr; ++pass) {
+      for (size_t i = 0; i < _workers.size() && task == nullptr; ++i) {
+        size_t victim = (seed + i) % _workers.size();
+
+        if (victim != index && (_workers[victim]->node == node) == (pass == 0)) {
+          task = _workers[victim]->deque.steal();
+        }
+      }
+    }
+  }
+
+  if (task != nullptr) {
+    --_num_pending;
+  }
+
+  return task;
+}
+
+bool threadpool_t::exec_one() {
+  size_t index = current_pool == this ? current_index : SIZE_MAX;
+  pool_task_t* task = _acquire(index);
+
+  if (task == nullptr) {
+    return false;
+  }
+
+  task->exec();
+  delete task;
+  return true;
+}
+
+void threadpool_t::wait(const std::atomic<size_t>& counter, size_t target) {
+  while (counter.load(std::memory_order_acquire) != target) {
+    if (!exec_one()) {
+      std::this_thread::yield();
+    }
+  }
+}
+
+void threadpool_t::_worker_loop(size_t index) {
+  current_pool = this;
+  current_index = index;
+
+  while (!_terminate) {
+    if (exec_one()) {
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(_sleep_mutex);
+    ++_num_sleeping;
+    _sleep_condition.wait(lock,
+                          [this] { return _terminate || _num_pending != 0; });
+    --_num_sleeping;
+  }
+}
+
+static size_t hilbert_index(size_t size, size_t x, size_t y) {
+  size_t result = 0;
+
+  for (size_t s = size / 2; s > 0; s /= 2) {
+    size_t rx = (x & s) > 0;
+    size_t ry = (y & s) > 0;
+    result += s * s * ((3 * rx) ^ ry);
+
+    if (ry == 0) {
+      if (rx == 1) {
+        x = s - 1 - x;
+        y = s - 1 - y;
+      }
+
+      std::swap(x, y);
+    }
+  }
+
+  return result;
+}
+
+tile_scheduler_t::tile_scheduler_t(size_t min_batch) : _min_batch(min_batch) {}
+
+tile_scheduler_t::~tile_scheduler_t() {}
+
+size_t tile_scheduler_t::num_splits() const { return _num_splits; }
+
+void tile_scheduler_t::exec(
+    threadpool_t& pool, size_t width, size_t height, size_t batch,
+    void* closure, void (*callback)(void*, size_t, size_t, size_t, size_t)) {
   size_t num_cols = (width + batch - 1) / batch;
   size_t num_rows = (height + batch - 1) / batch;
   size_t num_cells = num_cols * num_rows;
 
-  std::mutex mutex;
-  std::condition_variable condition;
-  std::atomic<size_t> counter(0);
+  if (num_cells == 0) {
+    return;
+  }
+
+  if (num_cols != _num_cols || num_rows != _num_rows) {
+    _num_cols = num_cols;
+    _num_rows = num_rows;
+    _costs.assign(num_cells, 0);
+    _order.resize(num_cells);
+    _keys.resize(num_cells);
+    _frame_costs.reset(new std::atomic<uint64_t>[num_cells]);
+  }
 
-  for (size_t col = 0; col < num_cols; ++col) {
-    for (size_t row = 0; row < num_rows; ++row) {
-      pool.exec([=, &mutex, &counter, &condition] {
-        size_t x0 = col * batch;
-        size_t x1 = std::min(width, x0 + batch);
-        size_t y0 = row * batch;
-        size_t y1 = std::min(height, y0 + batch);
-        callback(closure, x0, x1, y0, y1);
-
-        if (counter.fetch_add(1) == num_cells - 1) {
-          std::unique_lock<std::mutex> lock(mutex);
-          condition.notify_one();
+  size_t curve_size = 1;
+
+  while (curve_size < std::max(num_cols, num_rows)) {
+    curve_size *= 2;
+  }
+
+  const std::vector<size_t>& order = _order;
+  std::vector<size_t>& keys = _keys;
+  std::atomic<uint64_t>* costs = _frame_costs.get();
+
+  for (size_t cell = 0; cell < num_cells; ++cell) {
+    _order[cell] = cell;
+    keys[cell] = hilbert_index(curve_size, cell % num_cols, cell / num_cols);
+    costs[cell] = 0;
+  }
+
+  // Most expensive first, the ones that cost the same (e.g. nothing, in the
+  // first frame) in the curve order.
+  std::sort(_order.begin(), _order.end(), [&](size_t a, size_t b) {
+    return _costs[a] != _costs[b] ? _costs[a] > _costs[b] : keys[a] < keys[b];
+  });
+
+  // Every tile is a task of the pool. When fewer tasks are queued than
+  // there are threads, a tile is split in four subtasks rather than
+  // rendered, so the threads that run out of tiles at the end of the frame
+  // share the last ones. Completion is counted in pixels, the target of the
+  // fork-join doesn't depend on the splits.
+  struct tiles_t {
+    tiles_t(threadpool_t& pool, size_t num_workers, size_t min_batch,
+            std::atomic<uint64_t>* costs, void* closure,
+            void (*callback)(void*, size_t, size_t, size_t, size_t))
+        : pool(pool),
+          num_workers(num_workers),
+          min_batch(min_batch),
+          costs(costs),
+          closure(closure),
+          callback(callback),
+          num_queued(0),
+          num_done(0),
+          num_splits(0) {}
+
+    threadpool_t& pool;
+    const size_t num_workers;
+    const size_t min_batch;
+    std::atomic<uint64_t>* costs;
+    void* closure;
+    void (*callback)(void*, size_t, size_t, size_t, size_t);
+
+    std::atomic<size_t> num_queued;
+    std::atomic<size_t> num_done;
+    std::atomic<size_t> num_splits;
+
+    void spawn(const tile_t& tile) {
+      pool.exec([this, tile] { run(tile); });
+    }
+
+    void run(const tile_t& tile) {
+      --num_queued;
+
+      size_t w = tile.x1 - tile.x0;
+      size_t h = tile.y1 - tile.y0;
+
+      if ((w > min_batch || h > min_batch) && num_queued.load() < num_workers) {
+        size_t xm = w > min_batch ? tile.x0 + w / 2 : tile.x1;
+        size_t ym = h > min_batch ? tile.y0 + h / 2 : tile.y1;
+
+        size_t xs[] = {tile.x0, xm, tile.x1};
+        size_t ys[] = {tile.y0, ym, tile.y1};
+
+        // Counted before the spawns, the fork-join may complete and the
+        // tiles go out of scope as soon as the last subtask is done.
+        ++num_splits;
+
+        for (size_t j = 0; j < 2; ++j) {
+          for (size_t i = 0; i < 2; ++i) {
+            if (xs[i] < xs[i + 1] && ys[j] < ys[j + 1]) {
+              ++num_queued;
+              spawn({xs[i], xs[i + 1], ys[j], ys[j + 1], tile.cell});
+            }
+          }
         }
-      });
+
+        return;
+      }
+
+      auto start = std::chrono::steady_clock::now();
+      callback(closure, tile.x0, tile.x1, tile.y0, tile.y1);
+      auto elapsed = std::chrono::steady_clock::now() - start;
+
+      costs[tile.cell] += uint64_t(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed)
+              .count());
+
+      num_done.fetch_add(w * h, std::memory_order_release);
     }
+  };
+
+  tiles_t tiles(pool, pool.num_threads() + 1, _min_batch, costs, closure,
+                callback);
+
+  // All the tiles count as queued from the start, none is split while the
+  // others are still being pushed.
+  tiles.num_queued = num_cells;
+
+  for (size_t index = 0; index < num_cells; ++index) {
+    size_t cell = order[index];
+    size_t x0 = cell % num_cols * batch;
+    size_t y0 = cell / num_cols * batch;
+    tiles.spawn({x0, std::min(width, x0 + batch), y0,
+                std::min(height, y0 + batch), cell});
+  }
+
+  pool.wait(tiles.num_done, width * height);
+
+  for (size_t cell = 0; cell < num_cells; ++cell) {
+    _costs[cell] = costs[cell];
+  }
+
+  _num_splits += tiles.num_splits;
+}
+
+namespace detail {
+
+void exec1d(threadpool_t& pool, size_t size, size_t batch, void* closure,
+            void (*callback)(void*, size_t, size_t)) {
+  size_t num_cells = (size + batch - 1) / batch;
+
+  if (num_cells == 0) {
+    return;
+  }
+
+  std::atomic<size_t> counter(0);
+
+  for (size_t cell = 0; cell < num_cells; ++cell) {
+    pool.exec([=, &counter] {
+      size_t begin = cell * batch;
+      size_t end = std::min(size, begin + batch);
+      callback(closure, begin, end);
+
+      counter.fetch_add(1, std::memory_order_release);
+    });
   }
 
-  std::unique_lock<std::mutex> lock(mutex);
-  condition.wait(lock, [&] { return counter == num_cells; });
+  pool.wait(counter, num_cells);
+}
+
+void exec2d(threadpool_t& pool, size_t width, size_t height, size_t batch,
+            void* closure,
+            void (*callback)(void*, size_t, size_t, size_t, size_t)) {
+  tile_scheduler_t scheduler;
+  scheduler.exec(pool, width, height, batch, closure, callback);
+}
+
+void exec2d(threadpool_t& pool, tile_scheduler_t& scheduler, size_t width,
+            size_t height, size_t batch, void* closure,
+            void (*callback)(void*, size_t, size_t, size_t, size_t)) {
+  scheduler.exec(pool, width, height, batch, closure, callback);
 }
 
 void exec_in_bands(threadpool_t& pool, size_t width, size_t height,
@@ -224,54 +832,238 @@ void exec_in_bands(threadpool_t& pool, size_t width, size_t height,
   size_t num_rows = (height + batch - 1) / batch;
   size_t num_cells = num_rows;
 
-  std::mutex mutex;
-  std::condition_variable condition;
   std::atomic<size_t> counter(0);
 
   for (size_t row = 0; row < num_rows; ++row) {
-    pool.exec([=, &mutex, &counter, &condition] {
+    pool.exec([=, &counter] {
       size_t x0 = 0;
       size_t x1 = width;
       size_t y0 = row * batch;
       size_t y1 = std::min(height, y0 + batch);
       callback(closure, x0, x1, y0, y1);
 
-      if (counter.fetch_add(1) == num_cells - 1) {
-        std::unique_lock<std::mutex> lock(mutex);
-        condition.notify_one();
-      }
+      counter.fetch_add(1, std::memory_order_release);
     });
   }
 
-  std::unique_lock<std::mutex> lock(mutex);
-  condition.wait(lock, [&] { return counter == num_cells; });
+  pool.wait(counter, num_cells);
 }
 
 void generate(threadpool_t& pool, void** results, size_t number, void* closure,
               void (*callback)(void*, void*, size_t)) {
-  const size_t num_tasks = pool.num_threads();
+  const size_t num_tasks = std::max(pool.num_threads(), size_t(1));
 
-  std::mutex mutex;
-  std::condition_variable condition;
   std::atomic<size_t> counter(0);
 
-  std::atomic<size_t> remaining(number);
   const size_t per_task = number / num_tasks;
+  const size_t remainder = number % num_tasks;
 
   for (size_t task = 0; task < num_tasks; ++task) {
-    pool.exec([=, &mutex, &counter, &condition, &remaining] {
+    size_t task_number = per_task + (task < remainder ? 1 : 0);
+
+    pool.exec([=, &counter] {
+      callback(closure, results[task], task_number);
+      counter.fetch_add(1, std::memory_order_release);
+    });
+  }
+
+  pool.wait(counter, num_tasks);
+}
+}
+
+unittest() {
+  // Every task pushed to a deque is taken exactly once, by the owner or by
+  // one of the thieves, while the deque grows from 16 slots. The tasks are
+  // only compared, never run.
+  const size_t num_tasks = 100000;
+  const size_t num_thieves = 3;
 
-      callback(closure, results[task], std::min(remaining.load(), per_task));
+  work_stealing_deque_t deque(16);
+  std::unique_ptr<std::atomic<size_t>[]> taken(
+      new std::atomic<size_t>[num_tasks]);
+  std::atomic<size_t> num_taken(0);
+  std::atomic<bool> done(false);
 
-      if (counter.fetch_add(1) == num_tasks - 1) {
-        std::unique_lock<std::mutex> lock(mutex);
-        condition.notify_one();
+  for (size_t i = 0; i < num_tasks; ++i) {
+    taken[i] = 0;
+  }
+
+  auto record = [&](pool_task_t* task) {
+    ++taken[reinterpret_cast<size_t>(task) / 8 - 1];
+    ++num_taken;
+  };
+
+  std::vector<std::thread> thieves;
+
+  for (size_t i = 0; i < num_thieves; ++i) {
+    thieves.emplace_back([&] {
+      while (!done) {
+        if (pool_task_t* task = deque.steal()) {
+          record(task);
+        }
       }
     });
   }
 
-  std::unique_lock<std::mutex> lock(mutex);
-  condition.wait(lock, [&] { return counter == num_tasks; });
+  for (size_t i = 0; i < num_tasks; ++i) {
+    deque.push(reinterpret_cast<pool_task_t*>((i + 1) * 8));
+
+    if (i % 3 == 0) {
+      if (pool_task_t* task = deque.take()) {
+        record(task);
+      }
+    }
+  }
+
+  while (num_taken != num_tasks) {
+    if (pool_task_t* task = deque.take()) {
+      record(task);
+    }
+  }
+
+  done = true;
+
+  for (auto&& thief : thieves) {
+    thief.join();
+  }
+
+  for (size_t i = 0; i < num_tasks; ++i) {
+    assert_true(taken[i] == 1);
+  }
 }
+
+unittest() {
+  // A task that waits for a fork-join of its own helps running it, also
+  // when the pool has no workers and the caller runs everything.
+  for (size_t num_threads : {0, 1, 3}) {
+    threadpool_t pool(num_threads);
+
+    for (size_t repeat = 0; repeat < 20; ++repeat) {
+      std::atomic<size_t> sum(0);
+
+      exec1d(pool, 64, 1, [&](size_t begin, size_t end) {
+        std::atomic<size_t> inner(0);
+
+        exec1d(pool, 10, 3, [&](size_t begin, size_t end) {
+          inner += end - begin;
+        });
+
+        size_t result = 0;
+        future_t future = async(pool, [&] { result = 1; });
+        future.wait();
+
+        sum += (end - begin) * (inner == 10) * result;
+      });
+
+      assert_true(sum == 64);
+    }
+  }
+}
+
+unittest() {
+  // The loops visit every index exactly once.
+  for (size_t num_threads : {0, 1, 3}) {
+    threadpool_t pool(num_threads);
+
+    const size_t width = 67, height = 45;
+    std::vector<std::atomic<size_t>> hits(width * height);
+
+    for (auto&& hit : hits) {
+      hit = 0;
+    }
+
+    exec2d(pool, width, height, 8,
+           [&](size_t x0, size_t x1, size_t y0, size_t y1) {
+             for (size_t y = y0; y < y1; ++y) {
+               for (size_t x = x0; x < x1; ++x) {
+                 ++hits[y * width + x];
+               }
+             }
+           });
+
+    exec_in_bands(pool, width, height, 7,
+                  [&](size_t x0, size_t x1, size_t y0, size_t y1) {
+                    for (size_t y = y0; y < y1; ++y) {
+                      for (size_t x = x0; x < x1; ++x) {
+                        ++hits[y * width + x];
+                      }
+                    }
+                  });
+
+    for (auto&& hit : hits) {
+      assert_true(hit == 2);
+    }
+
+    std::atomic<size_t> num_segments(0);
+
+    std::vector<size_t> generated =
+        generate<size_t>(pool, 1001, [&](size_t number) {
+          return std::vector<size_t>(number, ++num_segments);
+        });
+
+    assert_true(generated.size() == 1001);
+    assert_true(num_segments == std::max(pool.num_threads(), size_t(1)));
+  }
+}
+
+unittest() {
+  // The tiles split near the end of a frame and reordered by the costs of
+  // the previous one still cover every pixel exactly once. A single tile
+  // larger than the image is split right away, it is all that is queued.
+  for (size_t num_threads : {0, 3}) {
+    threadpool_t pool(num_threads);
+    tile_scheduler_t scheduler(4);
+
+    const size_t width = 101, height = 67;
+    std::vector<std::atomic<size_t>> hits(width * height);
+
+    for (size_t batch : {128, 128, 16, 16}) {
+      for (auto&& hit : hits) {
+        hit = 0;
+      }
+
+      exec2d(pool, scheduler, width, height, batch,
+             [&](size_t x0, size_t x1, size_t y0, size_t y1) {
+               for (size_t y = y0; y < y1; ++y) {
+                 for (size_t x = x0; x < x1; ++x) {
+                   ++hits[y * width + x];
+                 }
+               }
+             });
+
+      for (auto&& hit : hits) {
+        assert_true(hit == 1);
+      }
+    }
+
+    assert_true(scheduler.num_splits() != 0);
+  }
+}
+
+unittest() {
+  // The results of async are visible after wait, its exceptions are thrown
+  // by wait.
+  threadpool_t pool(2);
+
+  int result = 0;
+  future_t future = async(pool, [&] { result = 42; });
+  future.wait();
+
+  assert_true(result == 42);
+  assert_true(!future.valid());
+  assert_true(future.ready());
+
+  future_t failing =
+      async(pool, [] { throw std::runtime_error("async unittest"); });
+  bool thrown = false;
+
+  try {
+    failing.wait();
+  } catch (const std::runtime_error&) {
+    thrown = true;
+  }
+
+  assert_true(thrown);
+  assert_true(!failing.valid());
 }
 }
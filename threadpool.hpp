@@ -1,7 +1,14 @@
 #pragma once
+#include <algorithm>
 #include <atomic>
 #include <cstddef>
+#include <cstdint>
 #include <cstdlib>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
 #include <thread>
 #include <vector>
 
@@ -82,9 +89,29 @@ class task_queue_t {
   };
 };
 
+struct pool_task_t {
+  virtual ~pool_task_t() {}
+  virtual void exec() = 0;
+
+  // The tasks are recycled through free lists, so the fork-joins of a
+  // frame don't call malloc once the pool is warm.
+  static void* operator new(size_t size);
+  static void operator delete(void* pointer, size_t size);
+};
+
+// The number of hardware threads, 4 if it can't be told.
+size_t default_num_cores();
+
+// Every worker owns a Chase-Lev deque. Tasks pushed from a worker go to its
+// own deque, tasks pushed from other threads go through a shared injection
+// queue. Idle workers steal from the top of the other deques, from the ones
+// on the same NUMA node first. With pin_threads the workers are bound to the
+// allowed cores, filling one NUMA node after another. A pool without workers
+// is valid, the threads waiting for the fork-joins run all the tasks.
 class threadpool_t {
  public:
-  threadpool_t(size_t num_threads = 0);
+  threadpool_t(size_t num_threads = default_num_cores(),
+               bool pin_threads = false);
   threadpool_t(const threadpool_t&) = delete;
   ~threadpool_t();
 
@@ -92,28 +119,188 @@ class threadpool_t {
 
   template <class F>
   void exec(F&& task) {
-    _queue.push(task);
+    using Closure = typename std::decay<F>::type;
+
+    struct closure_task_t : pool_task_t {
+      closure_task_t(F&& task) : closure(std::forward<F>(task)) {}
+      void exec() override { closure(); }
+      Closure closure;
+    };
+
+    _push(new closure_task_t(std::forward<F>(task)));
   }
 
+  // Runs one pending task on the calling thread. Returns false if there was
+  // nothing to run. Lets the thread waiting for a fork-join to complete
+  // take part in it.
+  bool exec_one();
+
+  // Helps executing the tasks until the counter reaches the target.
+  void wait(const std::atomic<size_t>& counter, size_t target);
+
   size_t num_threads();
 
+  // Index of the calling worker, or num_threads() for a thread outside the
+  // pool (the one that waits for a fork-join to complete).
+  size_t thread_index() const;
+
  private:
+  struct worker_t;
+
   std::atomic<bool> _terminate;
   std::vector<std::thread> _threads;
-  task_queue_t _queue;
+  std::vector<std::unique_ptr<worker_t>> _workers;
+
+  std::mutex _injection_mutex;
+  std::deque<pool_task_t*> _injection;
+
+  std::atomic<size_t> _num_pending;
+  std::atomic<size_t> _num_sleeping;
+  std::mutex _sleep_mutex;
+  std::condition_variable _sleep_condition;
+
+  void _push(pool_task_t* task);
+  void _notify();
+  pool_task_t* _acquire(size_t index);
+  void _worker_loop(size_t index);
+};
+
+// The pool shared by the whole process. The first call creates it, later ones
+// return the same pool and ignore the arguments, so it should be created
+// at startup. The thread that drives the rendering takes part in every
+// fork-join, so the pool gets num_threads - 1 workers and a single thread
+// renders alone. With num_threads equal to 0 it leaves one core to the
+// driving thread.
+threadpool_t& shared_threadpool(size_t num_threads = 0,
+                                bool pin_threads = false);
+
+// Completion of a task started with async. Waiting helps executing the other
+// tasks of the pool, so it can be used from inside the pool too. An exception
+// thrown by the task is rethrown by wait.
+class future_t {
+ public:
+  future_t() = default;
+  future_t(threadpool_t& pool)
+      : _pool(&pool), _state(std::make_shared<state_t>()) {}
+
+  bool valid() const { return _pool != nullptr; }
+
+  bool ready() const {
+    return !valid() || _state->done.load(std::memory_order_acquire) != 0;
+  }
+
+  void wait() {
+    if (valid()) {
+      _pool->wait(_state->done, 1);
+      std::exception_ptr exception = _state->exception;
+      _pool = nullptr;
+      _state.reset();
+
+      if (exception) {
+        std::rethrow_exception(exception);
+      }
+    }
+  }
+
+ private:
+  template <class F>
+  friend future_t async(threadpool_t& pool, F&& task);
+
+  struct state_t {
+    std::atomic<size_t> done;
+    std::exception_ptr exception;
+
+    state_t() : done(0) {}
+  };
+
+  threadpool_t* _pool = nullptr;
+  std::shared_ptr<state_t> _state;
+};
+
+// Runs the task in the pool while the caller continues, the results are
+// passed through the state the task captures.
+template <class F>
+future_t async(threadpool_t& pool, F&& task) {
+  future_t future(pool);
+  std::shared_ptr<future_t::state_t> state = future._state;
+  typename std::decay<F>::type closure = std::forward<F>(task);
+
+  pool.exec([=]() mutable {
+    try {
+      closure();
+    } catch (...) {
+      state->exception = std::current_exception();
+    }
+
+    state->done.fetch_add(1, std::memory_order_release);
+  });
+
+  return future;
+}
+
+// Decides the order of the tiles of exec2d and remembers how long every tile
+// took. The first frame follows a Hilbert curve, the following ones start with
+// the tiles that were the most expensive in the previous frame. When the
+// queue runs low near the end of a frame, tiles larger than min_batch are
+// split into quadrants so the idle threads get work.
+class tile_scheduler_t {
+ public:
+  tile_scheduler_t(size_t min_batch = 8);
+  tile_scheduler_t(const tile_scheduler_t&) = delete;
+  ~tile_scheduler_t();
+
+  tile_scheduler_t& operator=(const tile_scheduler_t&) = delete;
+
+  void exec(threadpool_t& pool, size_t width, size_t height, size_t batch,
+            void* closure,
+            void (*callback)(void*, size_t, size_t, size_t, size_t));
+
+  size_t num_splits() const;
+
+ private:
+  struct tile_t {
+    size_t x0, x1, y0, y1;
+    size_t cell;
+  };
+
+  size_t _min_batch;
+  size_t _num_cols = 0;
+  size_t _num_rows = 0;
+  size_t _num_splits = 0;
+  std::vector<uint64_t> _costs;
+
+  // Reused from frame to frame.
+  std::vector<size_t> _order;
+  std::vector<size_t> _keys;
+  std::unique_ptr<std::atomic<uint64_t>[]> _frame_costs;
 };
 
 namespace detail {
 
+void exec1d(threadpool_t&, size_t, size_t, void*,
+            void (*)(void*, size_t, size_t));
+
 void exec2d(threadpool_t&, size_t, size_t, size_t, void*,
             void (*)(void*, size_t, size_t, size_t, size_t));
 
+void exec2d(threadpool_t&, tile_scheduler_t&, size_t, size_t, size_t, void*,
+            void (*)(void*, size_t, size_t, size_t, size_t));
+
 void exec_in_bands(threadpool_t&, size_t, size_t, size_t, void*,
                    void (*)(void*, size_t, size_t, size_t, size_t));
 
 void generate(threadpool_t&, void**, size_t, void*, void (*)(void*, void*, size_t));
 }
 
+template <class F>
+void exec1d(threadpool_t& pool, size_t size, size_t batch, F&& task) {
+  detail::exec1d(pool, size, batch, &task,
+                 [](void* closure, size_t begin, size_t end) {
+                   using Closure = typename std::decay<F>::type;
+                   (*reinterpret_cast<Closure*>(closure))(begin, end);
+                 });
+}
+
 template <class F>
 void exec2d(threadpool_t& pool, size_t width, size_t height, size_t batch,
             F&& task) {
@@ -124,6 +311,16 @@ void exec2d(threadpool_t& pool, size_t width, size_t height, size_t batch,
                  });
 }
 
+template <class F>
+void exec2d(threadpool_t& pool, tile_scheduler_t& scheduler, size_t width,
+            size_t height, size_t batch, F&& task) {
+  detail::exec2d(pool, scheduler, width, height, batch, &task,
+                 [](void* closure, size_t x0, size_t x1, size_t y0, size_t y1) {
+                   using Closure = typename std::decay<F>::type;
+                   (*reinterpret_cast<Closure*>(closure))(x0, x1, y0, y1);
+                 });
+}
+
 template <class F>
 void exec_in_bands(threadpool_t& pool, size_t width, size_t height,
                    size_t batch, F&& task) {
@@ -135,10 +332,50 @@ void exec_in_bands(threadpool_t& pool, size_t width, size_t height,
       });
 }
 
-template <class T, class F>
-std::vector<T> generate(threadpool_t& pool, std::size_t number, F&& task) {
-  std::vector<std::vector<T>> results(pool.num_threads());
-  std::vector<std::vector<T>*> pointers(pool.num_threads());
+// The results of generate_segments, one segment per task, viewed as a
+// single sequence without copying them together.
+template <class T, class Allocator = std::allocator<T>>
+class segmented_vector_t {
+ public:
+  using segment_t = std::vector<T, Allocator>;
+
+  segmented_vector_t(std::vector<segment_t>&& segments)
+      : _segments(std::move(segments)), _offsets(_segments.size() + 1, 0) {
+    for (size_t i = 0; i < _segments.size(); ++i) {
+      _offsets[i + 1] = _offsets[i] + _segments[i].size();
+    }
+  }
+
+  size_t size() const { return _offsets.back(); }
+  bool empty() const { return size() == 0; }
+
+  size_t num_segments() const { return _segments.size(); }
+  size_t offset(size_t segment) const { return _offsets[segment]; }
+  segment_t& segment(size_t segment) { return _segments[segment]; }
+
+  const T& operator[](size_t index) const {
+    size_t segment =
+        std::upper_bound(_offsets.begin(), _offsets.end(), index) -
+        _offsets.begin() - 1;
+
+    return _segments[segment][index - _offsets[segment]];
+  }
+
+ private:
+  std::vector<segment_t> _segments;
+  std::vector<size_t> _offsets;
+};
+
+// Calls task(number) on every thread, with the numbers summing up to the
+// given one, and keeps the returned vectors as separate segments.
+template <class T, class Allocator = std::allocator<T>, class F>
+segmented_vector_t<T, Allocator> generate_segments(threadpool_t& pool,
+                                                   std::size_t number,
+                                                   F&& task) {
+  using segment_t = std::vector<T, Allocator>;
+
+  std::vector<segment_t> results(std::max(pool.num_threads(), size_t(1)));
+  std::vector<segment_t*> pointers(results.size());
 
   for (std::size_t i = 0; i < results.size(); ++i) {
     pointers[i] = &results[i];
@@ -147,23 +384,32 @@ std::vector<T> generate(threadpool_t& pool, std::size_t number, F&& task) {
   detail::generate(pool, reinterpret_cast<void**>(pointers.data()), number,
                    &task, [](void* closure, void* result, size_t number) {
                      using Closure = typename std::decay<F>::type;
-                     *reinterpret_cast<std::vector<T>*>(result) =
+                     *reinterpret_cast<segment_t*>(result) =
                          (*reinterpret_cast<Closure*>(closure))(number);
                    });
 
-  std::size_t total_size = 0;
-
-  for (std::size_t i = 0; i < results.size(); ++i) {
-    total_size += results[i].size();
-  }
-
-  results.front().reserve(total_size);
-
-  for (std::size_t i = 1; i < results.size(); ++i) {
-    results.front().insert(results.front().begin(), results[i].begin(),
-                           results[i].end());
-  }
+  return segmented_vector_t<T, Allocator>(std::move(results));
+}
 
-  return results.front();
+// Like generate_segments, but moves the segments to their offsets in a single
+// vector sized up front.
+template <class T, class F>
+std::vector<T> generate(threadpool_t& pool, std::size_t number, F&& task) {
+  segmented_vector_t<T> segments =
+      generate_segments<T>(pool, number, std::forward<F>(task));
+
+  std::vector<T> result(segments.size());
+
+  exec1d(pool, segments.num_segments(), 1, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      auto& segment = segments.segment(i);
+      std::move(segment.begin(), segment.end(),
+                result.begin() + segments.offset(i));
+      segment.clear();
+      segment.shrink_to_fit();
+    }
+  });
+
+  return result;
 }
 }
@@ -4,28 +4,101 @@
 #include <runtime_assert>
 #include <sstream>
 #include <stdexcept>
+#include <unittest>
 #include <utility.hpp>
 
 namespace haste {
 
-PiecewiseSampler::PiecewiseSampler() {}
+alias_table_t::alias_table_t() {}
 
-PiecewiseSampler::PiecewiseSampler(const float* weightsBegin,
-                                   const float* weightsEnd) {
-  std::random_device device;
-  engine.seed(device());
+alias_table_t::alias_table_t(const float* weights_begin,
+                             const float* weights_end) {
+  size_t size = weights_end - weights_begin;
+  double sum = 0.0;
 
-  size_t numWeights = weightsEnd - weightsBegin;
+  for (size_t i = 0; i < size; ++i) {
+    sum += weights_begin[i];
+  }
+
+  if (!(sum > 0.0)) {
+    return;
+  }
+
+  _entries.resize(size);
+  _pmf.resize(size);
+
+  std::vector<double> scaled(size);
+  std::vector<uint32_t> small, large;
+
+  for (size_t i = 0; i < size; ++i) {
+    _pmf[i] = float(weights_begin[i] / sum);
+    scaled[i] = weights_begin[i] / sum * double(size);
+    (scaled[i] < 1.0 ? small : large).push_back(uint32_t(i));
+  }
 
-  auto lambda = [&](float x) {
-    return weightsBegin[min(size_t(x * numWeights), numWeights - 1)];
-  };
+  // Every small entry is topped up to one by a large one, which becomes
+  // its alias. The remainder of the large entry goes back to the lists.
+  while (!small.empty() && !large.empty()) {
+    uint32_t less = small.back();
+    uint32_t more = large.back();
+    small.pop_back();
+
+    _entries[less].threshold = float(scaled[less]);
+    _entries[less].alias = more;
+
+    scaled[more] = (scaled[more] + scaled[less]) - 1.0;
+
+    if (scaled[more] < 1.0) {
+      large.pop_back();
+      small.push_back(more);
+    }
+  }
+
+  // What is left is one up to the rounding.
+  for (uint32_t i : small) {
+    _entries[i].threshold = 1.0f;
+    _entries[i].alias = i;
+  }
 
-  distribution =
-      std::piecewise_constant_distribution<float>(numWeights, 0.f, 1.f, lambda);
+  for (uint32_t i : large) {
+    _entries[i].threshold = 1.0f;
+    _entries[i].alias = i;
+  }
 }
 
-float PiecewiseSampler::sample() { return distribution(engine); }
+size_t alias_table_t::sample(float uniform) const {
+  const size_t size = _entries.size();
+  float scaled = uniform * float(size);
+  size_t index = min(size_t(scaled), size - 1);
+  const entry_t& entry = _entries[index];
+  return scaled - float(index) < entry.threshold ? index : entry.alias;
+}
+
+unittest() {
+  // Stratified uniform numbers give the frequencies of the indices.
+  const float weights[] = {1.0f, 0.0f, 3.0f, 4.0f, 0.5f, 7.5f};
+  alias_table_t table(weights, weights + 6);
+
+  const size_t num_samples = 1 << 20;
+  std::vector<size_t> counts(6, 0);
+
+  for (size_t i = 0; i < num_samples; ++i) {
+    ++counts[table.sample((float(i) + 0.5f) / float(num_samples))];
+  }
+
+  assert_true(counts[1] == 0);
+
+  for (size_t i = 0; i < 6; ++i) {
+    assert_true(abs(table.pmf(i) - weights[i] / 16.0f) < 1e-6f);
+    assert_true(abs(float(counts[i]) / num_samples - table.pmf(i)) < 1e-4f);
+  }
+
+  // Nothing to sample from weights that are all zero.
+  const float zeros[] = {0.0f, 0.0f};
+  alias_table_t empty(zeros, zeros + 2);
+  assert_true(empty.size() == 0);
+  assert_true(empty.pmf(1) == 0.0f);
+}
 }
 
 #include <ImfArray.h>
@@ -42,7 +115,8 @@ using namespace Imf;
 namespace haste {
 
 void saveEXR(const std::string& path, const metadata_t& metadata,
-             const vec3* data) {
+             const vec3* data, const float* samples,
+             const feature_t* features) {
   runtime_assert(metadata.resolution.x > 0);
   runtime_assert(metadata.resolution.y > 0);
 
@@ -54,7 +128,22 @@ void saveEXR(const std::string& path, const metadata_t& metadata,
   header.channels().insert("G", Channel(Imf::FLOAT));
   header.channels().insert("B", Channel(Imf::FLOAT));
 
+  if (samples != nullptr) {
+    header.channels().insert("samples", Channel(Imf::FLOAT));
+  }
+
+  static const char* feature_channels[] = {"albedo.R", "albedo.G", "albedo.B",
+                                           "normal.X", "normal.Y", "normal.Z",
+                                           "depth.Z"};
+
+  if (features != nullptr) {
+    for (auto channel : feature_channels) {
+      header.channels().insert(channel, Channel(Imf::FLOAT));
+    }
+  }
+
   header.insert("technique", StringAttribute(metadata.technique));
+  header.insert("sampler", StringAttribute(metadata.sampler));
   header.insert("num_samples", DoubleAttribute(double(metadata.num_samples)));
   header.insert("num_basic_rays",
                 DoubleAttribute(double(metadata.num_basic_rays)));
@@ -64,12 +153,17 @@ void saveEXR(const std::string& path, const metadata_t& metadata,
                 DoubleAttribute(double(metadata.num_tentative_rays)));
   header.insert("num_photons", DoubleAttribute(double(metadata.num_photons)));
   header.insert("num_threads", DoubleAttribute(double(metadata.num_threads)));
+  header.insert("guiding_memory",
+                DoubleAttribute(double(metadata.guiding_memory)));
+  header.insert("seed", StringAttribute(std::to_string(metadata.seed)));
 
   header.insert("roulette", DoubleAttribute(double(metadata.roulette)));
   header.insert("radius", DoubleAttribute(double(metadata.radius)));
   header.insert("alpha", DoubleAttribute(double(metadata.alpha)));
   header.insert("beta", DoubleAttribute(double(metadata.beta)));
   header.insert("epsilon", DoubleAttribute(double(metadata.epsilon)));
+  header.insert("adaptive_threshold",
+                DoubleAttribute(double(metadata.adaptive_threshold)));
   header.insert("total_time", DoubleAttribute(double(metadata.total_time)));
 
   Imath::V3f metadata_average(metadata.average.x, metadata.average.y,
@@ -103,6 +197,44 @@ void saveEXR(const std::string& path, const metadata_t& metadata,
   framebuffer.insert("G", G);
   framebuffer.insert("B", B);
 
+  vector<float> samples_copy;
+
+  if (samples != nullptr) {
+    samples_copy.resize(width * height);
+
+    for (int y = 0; y < height; ++y) {
+      for (int x = 0; x < width; ++x) {
+        samples_copy[y * width + x] = samples[(height - y - 1) * width + x];
+      }
+    }
+
+    framebuffer.insert("samples",
+                       Slice(Imf::FLOAT, (char*)samples_copy.data(),
+                             sizeof(float), sizeof(float) * width));
+  }
+
+  vector<feature_t> features_copy;
+
+  if (features != nullptr) {
+    features_copy.resize(width * height);
+
+    for (int y = 0; y < height; ++y) {
+      for (int x = 0; x < width; ++x) {
+        features_copy[y * width + x] = features[(height - y - 1) * width + x];
+      }
+    }
+
+    static_assert(sizeof(feature_t) == sizeof(float) * 7,
+                  "feature_t is expected to be 7 packed floats.");
+
+    for (size_t i = 0; i < 7; ++i) {
+      framebuffer.insert(
+          feature_channels[i],
+          Slice(Imf::FLOAT, (char*)features_copy.data() + sizeof(float) * i,
+                sizeof(feature_t), sizeof(feature_t) * width));
+    }
+  }
+
   file.setFrameBuffer(framebuffer);
   file.writePixels(height);
 }
@@ -151,12 +283,18 @@ void loadEXR(const string& path, metadata_t& metadata, vector<vec3>& data) {
       file.header().findTypedAttribute<DoubleAttribute>("num_photons");
   auto num_threads =
       file.header().findTypedAttribute<DoubleAttribute>("num_threads");
+  auto guiding_memory =
+      file.header().findTypedAttribute<DoubleAttribute>("guiding_memory");
 
   auto roulette = file.header().findTypedAttribute<DoubleAttribute>("roulette");
   auto radius = file.header().findTypedAttribute<DoubleAttribute>("radius");
   auto alpha = file.header().findTypedAttribute<DoubleAttribute>("alpha");
   auto beta = file.header().findTypedAttribute<DoubleAttribute>("beta");
   auto epsilon = file.header().findTypedAttribute<DoubleAttribute>("epsilon");
+  auto seed = file.header().findTypedAttribute<StringAttribute>("seed");
+  auto sampler = file.header().findTypedAttribute<StringAttribute>("sampler");
+  auto adaptive_threshold =
+      file.header().findTypedAttribute<DoubleAttribute>("adaptive_threshold");
   auto total_time =
       file.header().findTypedAttribute<DoubleAttribute>("total_time");
 
@@ -179,12 +317,18 @@ void loadEXR(const string& path, metadata_t& metadata, vector<vec3>& data) {
       num_tentative_rays ? num_tentative_rays->value() : std::size_t(0);
   metadata.num_photons = num_photons ? num_photons->value() : std::size_t(0);
   metadata.num_threads = num_threads ? num_threads->value() : std::size_t(0);
+  metadata.guiding_memory =
+      guiding_memory ? guiding_memory->value() : std::size_t(0);
 
   metadata.roulette = roulette ? roulette->value() : 0.0;
   metadata.radius = radius ? radius->value() : 0.0;
   metadata.alpha = alpha ? alpha->value() : 0.0;
   metadata.beta = beta ? beta->value() : 0.0;
   metadata.epsilon = epsilon ? epsilon->value() : 0.0;
+  metadata.seed = seed ? std::stoull(seed->value()) : 0;
+  metadata.sampler = sampler ? sampler->value() : std::string("random");
+  metadata.adaptive_threshold =
+      adaptive_threshold ? adaptive_threshold->value() : 0.0;
   metadata.total_time = total_time ? total_time->value() : 0.0;
 
   Imath::V3f metadata_average =
@@ -253,13 +397,17 @@ std::vector<vec3> vv4f_to_vv3f(std::size_t size, const vec4* data) {
 }
 
 std::vector<vec3> vv4d_to_vv3f(std::size_t size, const dvec4* data) {
-  std::vector<vec3> result(size);
+  std::vector<vec3> result;
+  vv4d_to_vv3f(result, size, data);
+  return result;
+}
+
+void vv4d_to_vv3f(std::vector<vec3>& result, std::size_t size, const dvec4* data) {
+  result.resize(size);
 
   for (std::size_t i = 0; i < size; ++i) {
     result[i] = data[i].rgb() / data[i].a;
   }
-
-  return result;
 }
 }
 
@@ -412,15 +560,32 @@ void merge(const string& result, const string& path0, const string& path1) {
       metadata0.num_shadow_rays + metadata1.num_shadow_rays;
   metadata.num_tentative_rays =
       metadata0.num_tentative_rays + metadata1.num_tentative_rays;
+  metadata.num_primary_rays =
+      metadata0.num_primary_rays + metadata1.num_primary_rays;
+  metadata.num_culled_rays =
+      metadata0.num_culled_rays + metadata1.num_culled_rays;
   metadata.num_photons = metadata0.num_photons + metadata1.num_photons;
   metadata.num_scattered = metadata0.num_scattered + metadata1.num_scattered;
+  metadata.num_gathered = metadata0.num_gathered + metadata1.num_gathered;
+  metadata.num_splats = metadata0.num_splats + metadata1.num_splats;
+  metadata.num_allocations = metadata0.num_allocations;
+  metadata.num_active_tiles = metadata0.num_active_tiles;
+  metadata.num_tiles = metadata0.num_tiles;
+  metadata.adaptive_threshold = metadata0.adaptive_threshold;
+  metadata.photon_size = metadata0.photon_size;
+  metadata.guiding_memory =
+      std::max(metadata0.guiding_memory, metadata1.guiding_memory);
   metadata.num_threads = metadata0.num_threads + metadata1.num_threads;
+  metadata.seed = metadata0.seed;
+  metadata.sampler = metadata0.sampler;
   metadata.resolution.x = metadata0.resolution.x;
   metadata.resolution.y = metadata0.resolution.y;
 
   metadata.total_time = metadata0.total_time + metadata1.total_time;
   metadata.scatter_time = metadata0.scatter_time + metadata1.scatter_time;
   metadata.build_time = metadata0.build_time + metadata1.build_time;
+  metadata.scatter_wait_time =
+      metadata0.scatter_wait_time + metadata1.scatter_wait_time;
   metadata.gather_time = metadata0.gather_time + metadata1.gather_time;
   metadata.merge_time = metadata0.merge_time + metadata1.merge_time;
   metadata.density_time = metadata0.density_time + metadata1.density_time;
@@ -428,6 +593,7 @@ void merge(const string& result, const string& path0, const string& path1) {
   metadata.trace_eye_time = metadata0.trace_eye_time + metadata1.trace_eye_time;
   metadata.trace_light_time =
       metadata0.trace_light_time + metadata1.trace_light_time;
+  metadata.primary_time = metadata0.primary_time + metadata1.primary_time;
 
   saveEXR(result, metadata, data2);
 }
@@ -457,13 +623,13 @@ compute_errors_t compute_errors(const string& path0, const string& path1) {
     }
   }
 
-  return {abs_sum / num, sqrt(rms_sum / num)};
+  return {abs_sum / num, sqrt(rms_sum / num), metadata0.total_time};
 }
 
 void print_errors(const string& path0, const string& path1) {
   auto errors = compute_errors(path0, path1);
-  std::cout << std::setprecision(10) << errors.abs << " " << errors.rms
-            << std::endl;
+  std::cout << std::setprecision(10) << errors.abs << " " << errors.rms << " "
+            << errors.time << " " << errors.mse_time() << std::endl;
 }
 
 void filter_out_nan(const string& source, const string& target) {
@@ -13,44 +13,96 @@ using std::string;
 using std::pair;
 using namespace glm;
 
-class PiecewiseSampler {
+// Lock-free addition to a float shared by the threads.
+inline void atomic_add(float& target, float value) {
+  float expected, desired;
+  __atomic_load(&target, &expected, __ATOMIC_RELAXED);
+
+  do {
+    desired = expected + value;
+  } while (!__atomic_compare_exchange(&target, &expected, &desired, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// Walker's alias method with Vose's construction. Samples an index in
+// proportion to the weights in constant time from a single uniform number,
+// the table is read-only, so it can be shared by the render threads. Without
+// weights, or if all of them are zero, the table is empty and has nothing to
+// sample.
+class alias_table_t {
  public:
-  PiecewiseSampler();
-  PiecewiseSampler(const float* weightsBegin, const float* weightsEnd);
-  float sample();
+  alias_table_t();
+  alias_table_t(const float* weights_begin, const float* weights_end);
+
+  size_t sample(float uniform) const;
+
+  // The probability of the index, the normalized weight.
+  float pmf(size_t index) const {
+    return index < _pmf.size() ? _pmf[index] : 0.0f;
+  }
+  size_t size() const { return _pmf.size(); }
 
  private:
-  std::minstd_rand engine;
-  std::piecewise_constant_distribution<float> distribution;
+  struct entry_t {
+    float threshold;
+    uint32_t alias;
+  };
+
+  std::vector<entry_t> _entries;
+  std::vector<float> _pmf;
 };
 
 struct metadata_t {
   std::string technique;
+  std::string sampler = "random";
   size_t num_samples = 0;
   size_t num_basic_rays = 0;
   size_t num_shadow_rays = 0;
   size_t num_tentative_rays = 0;
+  size_t num_primary_rays = 0;
+  size_t num_culled_rays = 0;
   size_t num_photons = 0;
   size_t num_scattered = 0;
+  size_t num_gathered = 0;
+  size_t num_splats = 0;
+  size_t num_allocations = 0;
+  size_t num_active_tiles = 0;
+  size_t num_tiles = 0;
+  size_t photon_size = 0;
   size_t num_threads = 0;
+  size_t guiding_memory = 0;
+  uint64_t seed = 0;
   glm::ivec2 resolution = glm::ivec2(0, 0);
   double roulette = 0.0;
   double radius = 0.0;
   double alpha = 0.0;
   double beta = 0.0;
   double epsilon = 0.0;
+  double adaptive_threshold = 0.0;
   double total_time = 0.0;
   double scatter_time = 0.0;
   double build_time = 0.0;
+  double scatter_wait_time = 0.0;
   double gather_time = 0.0;
   double merge_time = 0.0;
   double density_time = 0.0;
   double intersect_time = 0.0;
   double trace_eye_time = 0.0;
   double trace_light_time = 0.0;
+  double primary_time = 0.0;
+  bool packets = false;
+  bool pipeline = false;
   glm::vec3 average = glm::vec3(0.0f, 0.0f, 0.0f);
 };
 
+// Features of the first hit of the camera rays, averaged over the samples
+// of a pixel. The depth is the distance from the camera, zero for misses.
+struct feature_t {
+  glm::vec3 albedo = glm::vec3(0.0f, 0.0f, 0.0f);
+  glm::vec3 normal = glm::vec3(0.0f, 0.0f, 0.0f);
+  float depth = 0.0f;
+};
+
 template <class Stream> Stream& operator<<(Stream& stream, const metadata_t& meta) {
     double connection_time = meta.trace_eye_time - meta.trace_light_time - meta.gather_time;
     double query_time = meta.gather_time - meta.merge_time - meta.intersect_time;
@@ -63,9 +115,24 @@ template <class Stream> Stream& operator<<(Stream& stream, const metadata_t& met
         << "num basic rays: " << meta.num_basic_rays << "\n"
         << "num shadow rays: " << meta.num_shadow_rays << "\n"
         << "num tentative rays: " << meta.num_tentative_rays << "\n"
+        << "num culled rays: " << meta.num_culled_rays << "\n"
+        << "rays/s: " << (meta.num_basic_rays + meta.num_shadow_rays) / meta.total_time << "\n"
+        << "primary rays/s: " << meta.num_primary_rays / meta.primary_time << (meta.packets ? " (packets)\n" : " (scalar)\n")
         << "num photons: " << meta.num_photons << "\n"
         << "num scattered: " << meta.num_scattered / meta.num_samples << " (" << (meta.num_scattered / meta.num_samples + meta.num_photons - 1) / max(size_t(1), meta.num_photons) << "x)\n"
+        << "photon size: " << meta.photon_size << " bytes\n"
+        << "gather throughput: " << meta.num_gathered / meta.gather_time << " photons/s\n"
+        << "splats/s: " << meta.num_splats / meta.total_time << "\n"
+#ifdef HASTE_COUNT_ALLOCATIONS
+        << "allocations per frame: " << meta.num_allocations << "\n"
+#else
+        << "allocations per frame: not counted (build with -DHASTE_COUNT_ALLOCATIONS)\n"
+#endif
+        << "active tiles: " << meta.num_active_tiles << " / " << meta.num_tiles << " (threshold " << meta.adaptive_threshold << ")\n"
+        << "guiding memory: " << meta.guiding_memory << " bytes\n"
         << "num threads: " << meta.num_threads << "\n"
+        << "seed: " << meta.seed << "\n"
+        << "sampler: " << meta.sampler << "\n"
         << "resolution: [" << meta.resolution.x << ", " << meta.resolution.y << "]\n"
         << "roulette: " << meta.roulette << "\n"
         << "radius: " << meta.radius << "\n"
@@ -73,7 +140,8 @@ template <class Stream> Stream& operator<<(Stream& stream, const metadata_t& met
         << "beta: " << meta.beta << "\n"
         << "epsilon: " << meta.epsilon << "\n"
         << "total time: " << meta.total_time << "s\n"
-        << "time per sample: " << meta.total_time / meta.num_samples << "s\n"
+        << "time per sample: " << meta.total_time / meta.num_samples << (meta.pipeline ? "s (pipelined)\n" : "s\n")
+        << "    scatter wait time: " << meta.scatter_wait_time / meta.total_time << " (" << meta.scatter_wait_time / meta.num_samples << "s)\n"
         << "    trace eye time: " << meta.trace_eye_time / meta.total_time << " (" << meta.trace_eye_time / meta.num_samples << "s)\n"
         << "        trace light time: " << meta.trace_light_time / meta.total_time << " (" << meta.trace_light_time / meta.num_samples << "s)\n"
         << "        gather time: " << meta.gather_time / meta.total_time << " (" << meta.gather_time / meta.num_samples << "s)\n"
@@ -91,8 +159,12 @@ template <class Stream> Stream& operator<<(Stream& stream, const metadata_t& met
     return stream;
 }
 
+// The optional samples are the per-pixel sample counts, they are written
+// to the `samples` channel. The optional features go to the `albedo.RGB`,
+// `normal.XYZ` and `depth.Z` channels.
 void saveEXR(const std::string& path, const metadata_t& metadata,
-             const vec3* data);
+             const vec3* data, const float* samples = nullptr,
+             const feature_t* features = nullptr);
 
 void saveEXR(const std::string& path, const metadata_t& metadata,
              const std::vector<vec3>& data);
@@ -103,6 +175,7 @@ void loadEXR(const std::string& path, metadata_t& metadata,
 std::vector<dvec4> vv3f_to_vv4d(const std::vector<vec3>& data);
 std::vector<vec3> vv4f_to_vv3f(std::size_t size, const vec4* data);
 std::vector<vec3> vv4d_to_vv3f(std::size_t size, const dvec4* data);
+void vv4d_to_vv3f(std::vector<vec3>& result, std::size_t size, const dvec4* data);
 
 string homePath();
 string baseName(string path);
@@ -119,6 +192,11 @@ void merge(const string& result, const string& path0, const string& path1);
 struct compute_errors_t {
   double abs;
   double rms;
+  double time;
+
+  // Inverse efficiency, the mse falls as 1 / time, so lower values reach
+  // a given error sooner.
+  double mse_time() const { return rms * rms * time; }
 };
 
 compute_errors_t compute_errors(const string& path0, const string& path1);